@@ -0,0 +1,71 @@
+//
+// Heap allocation counter.
+//
+#include <stdlib.h>
+#include <new>
+#include <atomic>
+
+#include "alloccount.h"
+
+#ifdef TSAM_COUNT_ALLOCS
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void *p = malloc(size ? size : 1);
+    if(p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+uint64_t allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+bool allocationCountingEnabled()
+{
+    return true;
+}
+
+#else
+
+uint64_t allocationCount()
+{
+    return 0;
+}
+
+bool allocationCountingEnabled()
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,20 @@
+//
+// Heap allocation counter.
+//
+// When built with -DTSAM_COUNT_ALLOCS (as microbench is) the global
+// operator new is replaced by one that counts every call, so the number of
+// heap allocations an operation makes can be measured. Without the flag
+// nothing is replaced and allocationCount() always returns 0.
+//
+#ifndef TSAM_ALLOCCOUNT_H
+#define TSAM_ALLOCCOUNT_H
+
+#include <stdint.h>
+
+// Total number of operator new calls so far in this process.
+uint64_t allocationCount();
+
+// True if this build counts allocations.
+bool allocationCountingEnabled();
+
+#endif
@@ -0,0 +1,774 @@
+//
+// Load generator and latency benchmark for the TSAM chat server.
+//
+// Command line: ./bench [options] <ip> <port>
+//
+// Opens many connections to the server and keeps a number of operations
+// in flight on each, picked at random from a weighted mix of SENDMSG,
+// GETMSGS, KEEPALIVE and LISTSERVERS. SENDMSG and GETMSGS have no reply
+// that marks their end, so each is followed by a KEEPALIVE for the same
+// group; the operation completes when the KEEPALIVE reply arrives. Since
+// the server answers a connection's commands in order, that gives the
+// latency of the whole operation.
+//
+// Connections are opened before the run, with a number of connection
+// attempts in flight at once, and the time each takes to complete is
+// recorded too, which measures how fast the server accepts connections.
+//
+// Results are printed as a table, and optionally written as JSON so runs
+// can be compared automatically.
+//
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <random>
+
+#include "eventloop.h"
+#include "histogram.h"
+
+#define DEFAULT_CONNECTIONS 100    // Connections opened to the server
+#define DEFAULT_THREADS     1      // Threads sharing the connections
+#define DEFAULT_DURATION    10.0   // Seconds measured
+#define DEFAULT_WARMUP      1.0    // Seconds run before measuring
+#define DEFAULT_DEPTH       1      // Operations in flight per connection
+#define DEFAULT_GROUPS      100    // Groups messages are sent to
+#define DEFAULT_MSG_SIZE    64     // Bytes of message content
+#define DEFAULT_WINDOW      64     // Connection attempts in flight per thread
+#define CONNECT_TIMEOUT     30.0   // Seconds allowed for all connections to be made
+#define DRAIN_TIMEOUT       2.0    // Seconds to wait for replies after the run
+#define READ_CHUNK          65536  // Bytes read per recv()
+#define MAX_EVENTS          256
+
+const char SOH = '\x01'; // Start of Header character
+const char EOT = '\x04'; // End of Transmission character
+
+enum OpType {
+    OP_SENDMSG,
+    OP_GETMSGS,
+    OP_KEEPALIVE,
+    OP_LISTSERVERS,
+    OP_TYPES
+};
+
+static const char *opNames[OP_TYPES] = { "sendmsg", "getmsgs", "keepalive", "listservers" };
+
+struct BenchConfig {
+    struct sockaddr_in server;
+    int connections;
+    int threads;
+    double duration;
+    double warmup;
+    int depth;
+    int groups;
+    int messageSize;
+    int connectWindow;
+    unsigned weights[OP_TYPES];
+    const char *jsonPath;          // NULL for no JSON output, "-" for stdout
+};
+
+// An operation sent and waiting for the reply that ends it
+struct PendingOp {
+    uint64_t start;                // nanoseconds, when it was queued (or connect started)
+    uint8_t type;
+};
+
+struct Connection {
+    int sock;
+    std::string output;            // bytes not yet taken by the socket
+    size_t outputSent;             // ...starting at this offset
+    std::vector<char> input;       // bytes received, not yet a whole frame
+    std::deque<PendingOp> pending;
+    bool writeArmed;
+    bool connecting;               // connection attempt not finished yet
+};
+
+struct ThreadResult {
+    Histogram all;
+    Histogram perOp[OP_TYPES];
+    Histogram connect;             // time for each connection to be set up
+    uint64_t connectErrors;
+    uint64_t errors;               // error replies and lost connections
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    int connected;
+
+    ThreadResult() : connectErrors(0), errors(0), bytesSent(0), bytesReceived(0), connected(0) {}
+};
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Timings shared by all threads
+struct Schedule {
+    uint64_t measureStart;         // operations started from here are measured
+    uint64_t end;                  // no new operations from here
+    uint64_t drainEnd;             // give up waiting for replies
+};
+
+class BenchThread {
+public:
+    BenchThread(const BenchConfig& config, int connections, unsigned seed)
+        : cfg(config), wanted(connections), random(seed), backend(NULL) {
+        payload.assign(cfg.messageSize, 'x');
+        for(int i = 0; i < OP_TYPES; i++)
+            weightTotal += cfg.weights[i];
+    }
+
+    ~BenchThread() {
+        for(Connection *c : conns)
+        {
+            if(c->sock >= 0)
+                close(c->sock);
+            delete c;
+        }
+        delete backend;
+    }
+
+    // Open this thread's connections. Returns false if none could be made.
+    bool connectAll();
+
+    void run(const Schedule& schedule);
+
+    ThreadResult result;
+
+private:
+    void queueOp(Connection *c, uint64_t now);
+    void flush(Connection *c);
+    void receive(Connection *c, uint64_t now, const Schedule& schedule);
+    void drop(Connection *c);
+
+    const BenchConfig& cfg;
+    int wanted;
+    std::mt19937 random;
+    unsigned weightTotal = 0;
+    std::string payload;
+    EventBackend *backend;
+    std::vector<Connection *> conns;
+    int open = 0;
+};
+
+bool BenchThread::connectAll()
+{
+    IoEvent events[MAX_EVENTS];
+    int started  = 0;
+    int inFlight = 0;
+    uint64_t deadline = nowNs() + (uint64_t)(CONNECT_TIMEOUT * 1e9);
+    std::vector<Connection *> connecting;
+
+    if((backend = createEventBackend()) == NULL)
+        return false;
+
+    while(started < wanted || inFlight > 0)
+    {
+        // Keep the window of attempts full
+        while(started < wanted && inFlight < cfg.connectWindow)
+        {
+            started++;
+
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+            if(sock < 0)
+            {
+                perror("socket failed");
+                result.connectErrors++;
+                continue;
+            }
+
+            int set = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &set, sizeof(set));
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+            Connection *c = new Connection();
+            c->sock       = sock;
+            c->outputSent = 0;
+            c->writeArmed = false;
+            c->connecting = true;
+            c->pending.push_back(PendingOp { nowNs(), 0 });
+
+            // Writable once the connection is made (or has failed)
+            if((connect(sock, (struct sockaddr *)&cfg.server, sizeof(cfg.server)) < 0 &&
+                errno != EINPROGRESS) || !backend->add(sock, EV_WRITE, c))
+            {
+                close(sock);
+                delete c;
+                result.connectErrors++;
+                continue;
+            }
+            connecting.push_back(c);
+            inFlight++;
+        }
+
+        if(inFlight == 0)
+            continue;
+        if(nowNs() > deadline)
+            break;
+
+        int n = backend->wait(events, MAX_EVENTS, 100);
+        uint64_t now = nowNs();
+
+        for(int i = 0; i < n; i++)
+        {
+            Connection *c = (Connection *)events[i].data;
+            int error = 0;
+            socklen_t length = sizeof(error);
+
+            // Hangups are reported for connections already made too
+            if(!c->connecting)
+                continue;
+
+            inFlight--;
+            c->connecting = false;
+            getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &error, &length);
+
+            if(error != 0)
+            {
+                backend->remove(c->sock);
+                close(c->sock);
+                c->sock = -1;
+                continue;
+            }
+
+            result.connect.record(now - c->pending.front().start);
+            c->pending.clear();
+            backend->modify(c->sock, EV_READ, c);
+            conns.push_back(c);
+        }
+    }
+
+    // Give up on attempts still going after the timeout
+    for(Connection *c : connecting)
+    {
+        if(c->connecting)
+        {
+            backend->remove(c->sock);
+            close(c->sock);
+        }
+        if(c->connecting || c->sock < 0)
+            delete c;
+    }
+
+    open = result.connected = conns.size();
+    result.connectErrors = wanted - open;
+    return open > 0;
+}
+
+// Add a randomly chosen operation to the connection's output
+void BenchThread::queueOp(Connection *c, uint64_t now)
+{
+    unsigned pick = random() % weightTotal;
+    int type = 0;
+
+    while(pick >= cfg.weights[type])
+        pick -= cfg.weights[type++];
+
+    std::string group = "BENCH_" + std::to_string(random() % cfg.groups);
+    std::string& out  = c->output;
+
+    switch(type)
+    {
+        case OP_SENDMSG:
+            out += SOH;
+            out += "SENDMSG," + group + ",BENCH,";
+            out += payload;
+            out += EOT;
+            break;
+        case OP_GETMSGS:
+            out += SOH;
+            out += "GETMSGS," + group;
+            out += EOT;
+            break;
+        case OP_LISTSERVERS:
+            out += SOH;
+            out += "LISTSERVERS";
+            out += EOT;
+            break;
+    }
+
+    // KEEPALIVE is the operation itself, or the fence ending it
+    if(type != OP_LISTSERVERS)
+    {
+        out += SOH;
+        out += "KEEPALIVE," + group;
+        out += EOT;
+    }
+
+    c->pending.push_back(PendingOp { now, (uint8_t)type });
+}
+
+void BenchThread::drop(Connection *c)
+{
+    if(c->sock < 0)
+        return;
+
+    backend->remove(c->sock);
+    close(c->sock);
+    c->sock = -1;
+    c->pending.clear();
+    result.errors++;
+    open--;
+}
+
+// Send as much of the connection's output as the socket will take
+void BenchThread::flush(Connection *c)
+{
+    while(c->outputSent < c->output.size())
+    {
+        ssize_t n = send(c->sock, c->output.data() + c->outputSent,
+                         c->output.size() - c->outputSent, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                drop(c);
+                return;
+            }
+            break;
+        }
+        c->outputSent += n;
+        result.bytesSent += n;
+    }
+
+    if(c->outputSent == c->output.size())
+    {
+        c->output.clear();
+        c->outputSent = 0;
+    }
+
+    // Only ask to hear about room in the socket while output is waiting
+    bool wantWrite = !c->output.empty();
+    if(wantWrite != c->writeArmed)
+    {
+        backend->modify(c->sock, EV_READ | (wantWrite ? EV_WRITE : 0), c);
+        c->writeArmed = wantWrite;
+    }
+}
+
+// Read the server's replies, completing an operation for every reply that
+// ends one, and start a new operation in its place while the run lasts
+void BenchThread::receive(Connection *c, uint64_t now, const Schedule& schedule)
+{
+    char chunk[READ_CHUNK];
+
+    for(;;)
+    {
+        ssize_t n = recv(c->sock, chunk, sizeof(chunk), 0);
+        if(n == 0)
+        {
+            drop(c);
+            return;
+        }
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                drop(c);
+            break;
+        }
+
+        result.bytesReceived += n;
+        c->input.insert(c->input.end(), chunk, chunk + n);
+        if(n < (ssize_t)sizeof(chunk))
+            break;
+    }
+
+    size_t start = 0;
+    size_t used  = c->input.size();
+    const char *data = c->input.data();
+
+    for(;;)
+    {
+        const char *eot = (const char *)memchr(data + start, EOT, used - start);
+        if(eot == NULL)
+            break;
+
+        const char *frame = data + start;
+        size_t length = eot - frame;
+        start = eot - data + 1;
+
+        if(length > 0 && frame[0] == SOH)
+        {
+            frame++;
+            length--;
+        }
+
+        if(length >= 5 && memcmp(frame, "Error", 5) == 0)
+            result.errors++;
+
+        bool ends = (length >= 10 && memcmp(frame, "KEEPALIVE,", 10) == 0) ||
+                    (length >= 8 && memcmp(frame, "SERVERS,", 8) == 0);
+
+        if(!ends || c->pending.empty())
+            continue;
+
+        PendingOp op = c->pending.front();
+        c->pending.pop_front();
+
+        if(op.start >= schedule.measureStart && op.start < schedule.end)
+        {
+            uint64_t latency = now - op.start;
+            result.all.record(latency);
+            result.perOp[op.type].record(latency);
+        }
+
+        if(now < schedule.end)
+            queueOp(c, now);
+    }
+
+    c->input.erase(c->input.begin(), c->input.begin() + start);
+}
+
+void BenchThread::run(const Schedule& schedule)
+{
+    IoEvent events[MAX_EVENTS];
+    uint64_t now = nowNs();
+
+    for(Connection *c : conns)
+    {
+        for(int i = 0; i < cfg.depth; i++)
+            queueOp(c, now);
+        flush(c);
+    }
+
+    for(;;)
+    {
+        now = nowNs();
+        if(now >= schedule.drainEnd || open == 0)
+            break;
+
+        // Once the run is over, stop as soon as every reply is in
+        if(now >= schedule.end)
+        {
+            bool waiting = false;
+            for(Connection *c : conns)
+                waiting = waiting || (c->sock >= 0 && !c->pending.empty());
+            if(!waiting)
+                break;
+        }
+
+        int n = backend->wait(events, MAX_EVENTS, 100);
+        if(n < 0)
+            break;
+
+        now = nowNs();
+        for(int i = 0; i < n; i++)
+        {
+            Connection *c = (Connection *)events[i].data;
+
+            if(c->sock >= 0 && (events[i].events & (EV_READ | EV_ERROR)))
+                receive(c, now, schedule);
+            if(c->sock >= 0)
+                flush(c);
+        }
+    }
+}
+
+// Parse a mix such as "sendmsg=50,getmsgs=20,keepalive=25,listservers=5"
+static bool parseMix(const char *text, unsigned *weights)
+{
+    std::string mix(text);
+    size_t pos = 0;
+
+    for(int i = 0; i < OP_TYPES; i++)
+        weights[i] = 0;
+
+    while(pos < mix.size())
+    {
+        size_t comma = mix.find(',', pos);
+        if(comma == std::string::npos)
+            comma = mix.size();
+
+        std::string item = mix.substr(pos, comma - pos);
+        size_t eq = item.find('=');
+        if(eq == std::string::npos)
+            return false;
+
+        int type;
+        for(type = 0; type < OP_TYPES; type++)
+        {
+            if(item.compare(0, eq, opNames[type]) == 0)
+                break;
+        }
+        if(type == OP_TYPES)
+            return false;
+
+        weights[type] = atoi(item.c_str() + eq + 1);
+        pos = comma + 1;
+    }
+
+    unsigned total = 0;
+    for(int i = 0; i < OP_TYPES; i++)
+        total += weights[i];
+    return total > 0;
+}
+
+// Allow enough open files for the connections asked for
+static void raiseFileLimit(int connections)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return;
+
+    rlim_t needed = connections + 64;
+    if(limit.rlim_cur >= needed)
+        return;
+
+    limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > needed)
+                     ? needed : limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < needed)
+        printf("Warning: open file limit %lu is below %lu\n",
+               (unsigned long)limit.rlim_cur, (unsigned long)needed);
+}
+
+static void printRow(FILE *out, const char *name, const Histogram& h)
+{
+    fprintf(out, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long)h.count(),
+            h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+            h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+            h.max() / 1000.0);
+}
+
+static void jsonLatency(FILE *out, const Histogram& h)
+{
+    fprintf(out, "{\"count\": %llu, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+            "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+            (unsigned long long)h.count(), h.mean() / 1000.0,
+            h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+            h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+            h.max() / 1000.0);
+}
+
+static void usage()
+{
+    printf("Usage: bench [options] <ip> <port>\n");
+    printf("  -c connections   connections to open (default %d)\n", DEFAULT_CONNECTIONS);
+    printf("  -t threads       threads driving the connections (default %d)\n", DEFAULT_THREADS);
+    printf("  -d seconds       measured run time (default %.0f)\n", DEFAULT_DURATION);
+    printf("  -w seconds       warmup before measuring (default %.0f)\n", DEFAULT_WARMUP);
+    printf("  -p depth         operations in flight per connection (default %d)\n", DEFAULT_DEPTH);
+    printf("  -g groups        groups to send messages to (default %d)\n", DEFAULT_GROUPS);
+    printf("  -s bytes         message size for SENDMSG (default %d)\n", DEFAULT_MSG_SIZE);
+    printf("  -m mix           operation weights, e.g.\n");
+    printf("                   sendmsg=50,getmsgs=20,keepalive=25,listservers=5\n");
+    printf("  -C attempts      connection attempts in flight per thread (default %d)\n", DEFAULT_WINDOW);
+    printf("  -j file          write results as JSON to file (- for stdout)\n");
+    exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig cfg;
+    int opt;
+
+    cfg.connections = DEFAULT_CONNECTIONS;
+    cfg.threads     = DEFAULT_THREADS;
+    cfg.duration    = DEFAULT_DURATION;
+    cfg.warmup      = DEFAULT_WARMUP;
+    cfg.depth       = DEFAULT_DEPTH;
+    cfg.groups      = DEFAULT_GROUPS;
+    cfg.messageSize = DEFAULT_MSG_SIZE;
+    cfg.connectWindow = DEFAULT_WINDOW;
+    cfg.jsonPath    = NULL;
+    parseMix("sendmsg=50,getmsgs=20,keepalive=25,listservers=5", cfg.weights);
+
+    while((opt = getopt(argc, argv, "c:t:d:w:p:g:s:m:j:C:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': cfg.connections = atoi(optarg); break;
+            case 't': cfg.threads     = atoi(optarg); break;
+            case 'd': cfg.duration    = atof(optarg); break;
+            case 'w': cfg.warmup      = atof(optarg); break;
+            case 'p': cfg.depth       = atoi(optarg); break;
+            case 'g': cfg.groups      = atoi(optarg); break;
+            case 's': cfg.messageSize = atoi(optarg); break;
+            case 'j': cfg.jsonPath    = optarg;       break;
+            case 'C': cfg.connectWindow = atoi(optarg); break;
+            case 'm':
+                if(!parseMix(optarg, cfg.weights))
+                {
+                    printf("Invalid mix: %s\n", optarg);
+                    exit(0);
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if(argc - optind != 2 || cfg.connections < 1 || cfg.threads < 1 ||
+       cfg.duration <= 0 || cfg.warmup < 0 || cfg.depth < 1 || cfg.groups < 1 ||
+       cfg.messageSize < 0 || cfg.connectWindow < 1)
+    {
+        usage();
+    }
+
+    if(cfg.threads > cfg.connections)
+        cfg.threads = cfg.connections;
+
+    struct addrinfo hints, *svr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;            // IPv4 only addresses
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(argv[optind], argv[optind + 1], &hints, &svr) != 0)
+    {
+        printf("Unable to resolve %s\n", argv[optind]);
+        exit(0);
+    }
+    memcpy(&cfg.server, svr->ai_addr, sizeof(cfg.server));
+    freeaddrinfo(svr);
+
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit(cfg.connections);
+
+    // Connect everything before the clock starts
+    std::vector<BenchThread *> threads;
+    int connected = 0;
+    uint64_t connectStart = nowNs();
+
+    for(int i = 0; i < cfg.threads; i++)
+    {
+        int share = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads);
+        threads.push_back(new BenchThread(cfg, share, 12345 + i));
+    }
+
+    std::vector<std::thread> connecting;
+    for(BenchThread *t : threads)
+        connecting.emplace_back(&BenchThread::connectAll, t);
+    for(auto& c : connecting)
+        c.join();
+
+    Histogram connectLatency;
+    uint64_t connectErrors = 0;
+    for(BenchThread *t : threads)
+    {
+        connected += t->result.connected;
+        connectErrors += t->result.connectErrors;
+        connectLatency.merge(t->result.connect);
+    }
+
+    double connectSeconds = (nowNs() - connectStart) / 1e9;
+
+    if(connected == 0)
+    {
+        printf("No connections could be made\n");
+        exit(0);
+    }
+
+    Schedule schedule;
+    uint64_t start = nowNs();
+    schedule.measureStart = start + (uint64_t)(cfg.warmup * 1e9);
+    schedule.end          = schedule.measureStart + (uint64_t)(cfg.duration * 1e9);
+    schedule.drainEnd     = schedule.end + (uint64_t)(DRAIN_TIMEOUT * 1e9);
+
+    std::vector<std::thread> running;
+    for(BenchThread *t : threads)
+        running.emplace_back(&BenchThread::run, t, std::cref(schedule));
+    for(auto& r : running)
+        r.join();
+
+    // Combine the threads' results
+    ThreadResult total;
+    for(BenchThread *t : threads)
+    {
+        total.all.merge(t->result.all);
+        for(int i = 0; i < OP_TYPES; i++)
+            total.perOp[i].merge(t->result.perOp[i]);
+        total.errors        += t->result.errors;
+        total.bytesSent     += t->result.bytesSent;
+        total.bytesReceived += t->result.bytesReceived;
+        delete t;
+    }
+
+    double opsPerSecond = total.all.count() / cfg.duration;
+
+    double connectsPerSecond = connected / connectSeconds;
+
+    printf("Connections: %d of %d (%d thread%s), connected in %.2fs (%.0f/s), %llu failed\n",
+           connected, cfg.connections, cfg.threads, cfg.threads > 1 ? "s" : "",
+           connectSeconds, connectsPerSecond, (unsigned long long)connectErrors);
+    printf("Duration:    %.1fs after %.1fs warmup, %d in flight per connection\n",
+           cfg.duration, cfg.warmup, cfg.depth);
+    printf("Operations:  %llu (%.0f ops/s), errors %llu\n",
+           (unsigned long long)total.all.count(), opsPerSecond,
+           (unsigned long long)total.errors);
+    printf("Traffic:     %.1f MB sent, %.1f MB received\n\n",
+           total.bytesSent / 1e6, total.bytesReceived / 1e6);
+
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n",
+           "latency(us)", "count", "p50", "p90", "p99", "p99.9", "max");
+    printRow(stdout, "connect", connectLatency);
+    printRow(stdout, "all", total.all);
+    for(int i = 0; i < OP_TYPES; i++)
+    {
+        if(total.perOp[i].count() > 0)
+            printRow(stdout, opNames[i], total.perOp[i]);
+    }
+
+    if(cfg.jsonPath != NULL)
+    {
+        FILE *out = (strcmp(cfg.jsonPath, "-") == 0) ? stdout : fopen(cfg.jsonPath, "w");
+        if(out == NULL)
+        {
+            perror("Unable to open JSON output");
+            exit(0);
+        }
+
+        fprintf(out, "{\"connections\": %d, \"threads\": %d, \"depth\": %d, "
+                "\"duration_s\": %.3f, \"warmup_s\": %.3f, \"message_size\": %d, "
+                "\"groups\": %d,\n",
+                connected, cfg.threads, cfg.depth, cfg.duration, cfg.warmup,
+                cfg.messageSize, cfg.groups);
+        fprintf(out, " \"connect_s\": %.3f, \"connects_per_sec\": %.1f, "
+                "\"connect_errors\": %llu, \"connect_latency_us\": ",
+                connectSeconds, connectsPerSecond, (unsigned long long)connectErrors);
+        jsonLatency(out, connectLatency);
+        fprintf(out, ",\n");
+        fprintf(out, " \"ops\": %llu, \"ops_per_sec\": %.1f, \"errors\": %llu, "
+                "\"bytes_sent\": %llu, \"bytes_received\": %llu,\n",
+                (unsigned long long)total.all.count(), opsPerSecond,
+                (unsigned long long)total.errors,
+                (unsigned long long)total.bytesSent,
+                (unsigned long long)total.bytesReceived);
+        fprintf(out, " \"latency_us\": ");
+        jsonLatency(out, total.all);
+        fprintf(out, ",\n \"ops_by_type\": {");
+        for(int i = 0; i < OP_TYPES; i++)
+        {
+            fprintf(out, "%s\n  \"%s\": {\"weight\": %u, \"latency_us\": ",
+                    i ? "," : "", opNames[i], cfg.weights[i]);
+            jsonLatency(out, total.perOp[i]);
+            fprintf(out, "}");
+        }
+        fprintf(out, "}}\n");
+
+        if(out != stdout)
+            fclose(out);
+    }
+
+    return 0;
+}
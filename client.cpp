@@ -53,7 +53,16 @@ void listenServer(int serverSocket)
        }
        else if(nread > 0)
        {
-          printf("%s\n", buffer);
+          // Responses are framed with SOH/EOT and several may arrive
+          // in one read, so print each one on its own line
+          for(int i = 0; i < nread; i++)
+          {
+             if(buffer[i] == EOT)
+                putchar('\n');
+             else if(buffer[i] != SOH)
+                putchar(buffer[i]);
+          }
+          fflush(stdout);
        }
     }
 }
@@ -0,0 +1,35 @@
+//
+// In-place tokenizer for TSAM protocol commands.
+//
+#include <string.h>
+
+#include "command.h"
+
+size_t CommandTokens::parse(std::string_view command)
+{
+    const char *p   = command.data();
+    const char *end = p + command.size();
+
+    text  = command;
+    count = 0;
+
+    while(p < end)
+    {
+        if(count == MAX_TOKENS - 1)
+        {
+            // Out of space, the last token takes whatever is left
+            tokens[count++] = std::string_view(p, end - p);
+            break;
+        }
+
+        const char *comma = (const char *)memchr(p, ',', end - p);
+        const char *stop  = comma ? comma : end;
+
+        tokens[count++] = std::string_view(p, stop - p);
+
+        if(comma == NULL)
+            break;
+        p = comma + 1;
+    }
+    return count;
+}
@@ -0,0 +1,113 @@
+//
+// In-place tokenizer for TSAM protocol commands.
+//
+// A command is a comma separated list of fields, e.g.
+// "SENDMSG,<TO GROUP ID>,<FROM GROUP ID>,<message contents>". The fields
+// are returned as string_views into the receive buffer, so splitting a
+// command allocates nothing. The views are only valid while the frame
+// they point into is.
+//
+#ifndef TSAM_COMMAND_H
+#define TSAM_COMMAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+#define MAX_TOKENS 16      // Fields kept per command; the last one holds the rest
+
+class CommandTokens {
+public:
+    CommandTokens() : count(0) {}
+
+    // Split command on commas. An empty trailing field is dropped, and a
+    // command with more than MAX_TOKENS fields has the remainder (commas
+    // included) in its last token. Returns the number of tokens.
+    size_t parse(std::string_view command);
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const std::string_view& operator[](size_t i) const { return tokens[i]; }
+
+    // Everything from the start of token i to the end of the command,
+    // commas included. Used for fields like message contents that may
+    // themselves contain commas.
+    std::string_view rest(size_t i) const {
+        return text.substr(tokens[i].data() - text.data());
+    }
+
+private:
+    std::string_view text;                 // the whole command
+    std::string_view tokens[MAX_TOKENS];   // fields of the command
+    size_t count;                          // fields in use
+};
+
+// Command dispatch
+//
+// Commands are looked up through a perfect hash built at compile time:
+// buildCommandIndex() searches for a seed under which every command name
+// in a table lands in its own slot of a COMMAND_SLOTS array, so finding a
+// handler is one hash of the command name, one array read and a single
+// string compare, however many commands there are.
+
+#define COMMAND_SLOTS 32   // Size of the dispatch index, a power of two
+
+// FNV-1a, with the seed mixed into the offset basis.
+constexpr uint32_t commandHash(std::string_view name, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    for(char c : name)
+    {
+        h ^= (unsigned char)c;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+struct CommandIndex {
+    uint32_t seed;                    // seed that gives no collisions
+    signed char slot[COMMAND_SLOTS];  // table position for each slot, -1 if free
+
+    // Position of name in the table the index was built from, or -1.
+    // The caller still has to compare the name, as an unknown command
+    // can hash to a used slot.
+    int find(std::string_view name) const {
+        return slot[commandHash(name, seed) & (COMMAND_SLOTS - 1)];
+    }
+};
+
+// Build the index for a table of entries with a `name` member. Fails to
+// compile (by throwing during constant evaluation) if no seed is found.
+template <typename Spec, size_t N>
+constexpr CommandIndex buildCommandIndex(const Spec (&table)[N])
+{
+    static_assert(N < COMMAND_SLOTS, "too many commands for COMMAND_SLOTS");
+
+    for(uint32_t seed = 0; seed < 10000; seed++)
+    {
+        CommandIndex index = {};
+        bool collision = false;
+
+        index.seed = seed;
+        for(size_t i = 0; i < COMMAND_SLOTS; i++)
+            index.slot[i] = -1;
+
+        for(size_t i = 0; i < N && !collision; i++)
+        {
+            uint32_t s = commandHash(table[i].name, seed) & (COMMAND_SLOTS - 1);
+
+            if(index.slot[s] != -1)
+                collision = true;
+            else
+                index.slot[s] = (signed char)i;
+        }
+
+        if(!collision)
+            return index;
+    }
+    throw "no collision-free seed for the command table";
+}
+
+#endif
@@ -0,0 +1,218 @@
+//
+// Event engine backends for the TSAM chat server.
+//
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <vector>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "eventloop.h"
+#include "logger.h"
+
+#ifdef __linux__
+
+// Linux epoll backend. The registered data pointer is stored in the kernel
+// alongside the fd, so a ready event maps straight back to its connection.
+class EpollBackend : public EventBackend {
+public:
+    EpollBackend() : epfd(-1), events(0), capacity(0) {}
+
+    ~EpollBackend() {
+        delete[] events;
+        if(epfd >= 0)
+            close(epfd);
+    }
+
+    bool init() {
+        if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        {
+            logError("epoll_create1 failed");
+            return false;
+        }
+        return true;
+    }
+
+    const char *name() const { return "epoll"; }
+
+    bool add(int fd, uint32_t flags, void *data) {
+        return control(EPOLL_CTL_ADD, fd, flags, data);
+    }
+
+    bool modify(int fd, uint32_t flags, void *data) {
+        return control(EPOLL_CTL_MOD, fd, flags, data);
+    }
+
+    // Closing the socket takes it out of the epoll set (we never dup()
+    // them), so there is no need for an EPOLL_CTL_DEL call first
+    void closing(int fd) {}
+
+    bool remove(int fd) {
+        struct epoll_event ev = {};   // non-NULL for pre 2.6.9 kernels
+
+        if(epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev) < 0)
+        {
+            logError("epoll_ctl(DEL) failed");
+            return false;
+        }
+        return true;
+    }
+
+    int wait(IoEvent *out, int maxEvents, int timeoutMs) {
+        if(maxEvents > capacity)
+        {
+            delete[] events;
+            events = new struct epoll_event[maxEvents];
+            capacity = maxEvents;
+        }
+
+        int n = epoll_wait(epfd, events, maxEvents, timeoutMs);
+        if(n < 0)
+        {
+            // A signal interrupting the wait is not an error
+            return (errno == EINTR) ? 0 : -1;
+        }
+
+        for(int i = 0; i < n; i++)
+        {
+            uint32_t e = events[i].events;
+
+            out[i].data   = events[i].data.ptr;
+            out[i].events = ((e & EPOLLIN)  ? EV_READ  : 0) |
+                            ((e & EPOLLOUT) ? EV_WRITE : 0) |
+                            ((e & (EPOLLERR | EPOLLHUP)) ? EV_ERROR : 0);
+        }
+        return n;
+    }
+
+private:
+    bool control(int op, int fd, uint32_t flags, void *data) {
+        struct epoll_event ev;
+
+        ev.events   = ((flags & EV_READ)  ? (EPOLLIN | EPOLLRDHUP) : 0) |
+                      ((flags & EV_WRITE) ? EPOLLOUT : 0) |
+                      ((flags & EV_EDGE)  ? EPOLLET  : 0);
+        ev.data.ptr = data;
+
+        if(epoll_ctl(epfd, op, fd, &ev) < 0)
+        {
+            logError("epoll_ctl failed");
+            return false;
+        }
+        return true;
+    }
+
+    int epfd;                          // epoll instance
+    struct epoll_event *events;        // scratch array for epoll_wait()
+    int capacity;                      // number of entries in events
+};
+
+#endif
+
+// Portable poll() backend, used where epoll is not available. Level
+// triggered; EV_EDGE is accepted and ignored.
+class PollBackend : public EventBackend {
+public:
+    const char *name() const { return "poll"; }
+
+    bool add(int fd, uint32_t flags, void *data) {
+        if(fd < 0)
+            return false;
+        if((size_t)fd >= index.size())
+            index.resize(std::max((size_t)fd + 1, 2 * index.size()), -1);
+        if(index[fd] >= 0)
+            return false;
+
+        struct pollfd p;
+        p.fd      = fd;
+        p.events  = toPoll(flags);
+        p.revents = 0;
+
+        index[fd] = fds.size();
+        fds.push_back(p);
+        datas.push_back(data);
+        return true;
+    }
+
+    bool modify(int fd, uint32_t flags, void *data) {
+        if(!registered(fd))
+            return false;
+
+        fds[index[fd]].events = toPoll(flags);
+        datas[index[fd]]      = data;
+        return true;
+    }
+
+    bool remove(int fd) {
+        if(!registered(fd))
+            return false;
+
+        // Move the last entry into the hole so the arrays stay packed
+        size_t pos  = index[fd];
+        size_t last = fds.size() - 1;
+
+        if(pos != last)
+        {
+            fds[pos]   = fds[last];
+            datas[pos] = datas[last];
+            index[fds[pos].fd] = pos;
+        }
+        fds.pop_back();
+        datas.pop_back();
+        index[fd] = -1;
+        return true;
+    }
+
+    int wait(IoEvent *out, int maxEvents, int timeoutMs) {
+        int n = poll(fds.data(), fds.size(), timeoutMs);
+        if(n < 0)
+        {
+            return (errno == EINTR) ? 0 : -1;
+        }
+
+        int count = 0;
+        for(size_t i = 0; i < fds.size() && count < n && count < maxEvents; i++)
+        {
+            short r = fds[i].revents;
+            if(r == 0)
+                continue;
+
+            out[count].data   = datas[i];
+            out[count].events = ((r & POLLIN)  ? EV_READ  : 0) |
+                                ((r & POLLOUT) ? EV_WRITE : 0) |
+                                ((r & (POLLERR | POLLHUP | POLLNVAL)) ? EV_ERROR : 0);
+            count++;
+        }
+        return count;
+    }
+
+private:
+    bool registered(int fd) const {
+        return fd >= 0 && (size_t)fd < index.size() && index[fd] >= 0;
+    }
+
+    static short toPoll(uint32_t flags) {
+        return ((flags & EV_READ)  ? POLLIN  : 0) |
+               ((flags & EV_WRITE) ? POLLOUT : 0);
+    }
+
+    std::vector<struct pollfd> fds;    // array handed to poll()
+    std::vector<void *> datas;         // data pointer for each fds entry
+    std::vector<int> index;            // fd -> position in fds, -1 if none
+};
+
+EventBackend *createEventBackend()
+{
+#ifdef __linux__
+    EpollBackend *epoll = new EpollBackend();
+    if(epoll->init())
+        return epoll;
+    delete epoll;
+#endif
+    return new PollBackend();
+}
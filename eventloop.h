@@ -0,0 +1,62 @@
+//
+// Event engine for the TSAM chat server.
+//
+// EventBackend is the interface the server loop uses to wait for socket
+// readiness. Each registered socket carries a pointer to its per-connection
+// state, which is handed straight back when the socket becomes ready, so
+// the loop never has to search for the connection a descriptor belongs to.
+//
+// On Linux the backend is epoll, with sockets registered edge-triggered.
+// Other platforms (OSX) fall back to poll(), which is level-triggered;
+// the server only arms EV_WRITE while it has output pending, so it behaves
+// correctly under either model.
+//
+#ifndef TSAM_EVENTLOOP_H
+#define TSAM_EVENTLOOP_H
+
+#include <stdint.h>
+
+// Readiness / interest flags, independent of the backend in use
+enum {
+    EV_READ  = 0x01,     // data (or a connection) waiting to be read
+    EV_WRITE = 0x02,     // socket has room in its send buffer
+    EV_ERROR = 0x04,     // error or hangup reported by the kernel
+    EV_EDGE  = 0x08      // report transitions only (ignored by poll backend)
+};
+
+// One ready socket returned from EventBackend::wait()
+struct IoEvent {
+    void *data;          // pointer registered with add()/modify()
+    uint32_t events;     // EV_* flags that are ready
+};
+
+class EventBackend {
+public:
+    virtual ~EventBackend() {}
+
+    virtual const char *name() const = 0;
+
+    // Start monitoring fd for the EV_* flags in events.
+    virtual bool add(int fd, uint32_t events, void *data) = 0;
+
+    // Change the flags (and/or data pointer) for a monitored fd.
+    virtual bool modify(int fd, uint32_t events, void *data) = 0;
+
+    // Stop monitoring fd. Must be called before the fd is closed.
+    virtual bool remove(int fd) = 0;
+
+    // fd is about to be closed: stop monitoring it, as cheaply as the
+    // backend allows. fd must not be used again until it is re-added.
+    virtual void closing(int fd) { remove(fd); }
+
+    // Wait up to timeoutMs milliseconds (-1 = forever) for sockets to
+    // become ready. Returns the number of entries stored in events,
+    // 0 on timeout or -1 on error.
+    virtual int wait(IoEvent *events, int maxEvents, int timeoutMs) = 0;
+};
+
+// Create the best backend available on this platform.
+// Returns NULL if it could not be created.
+EventBackend *createEventBackend();
+
+#endif
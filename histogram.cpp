@@ -0,0 +1,120 @@
+//
+// Latency histogram with bounded relative error, in the style of HdrHistogram.
+//
+#include "histogram.h"
+
+#define EXACT_VALUES   (1u << HISTOGRAM_SUB_BITS)         // counted one per bucket
+#define HALF_BUCKETS   (1u << (HISTOGRAM_SUB_BITS - 1))   // buckets per power of two
+#define BUCKET_COUNT   (EXACT_VALUES + (64 - HISTOGRAM_SUB_BITS) * HALF_BUCKETS)
+
+Histogram::Histogram()
+    : counts(BUCKET_COUNT, 0), total(0), lowest(UINT64_MAX), highest(0), sum(0)
+{
+}
+
+// Values from 2^(SUB_BITS + k - 1) up to 2^(SUB_BITS + k) go in HALF_BUCKETS
+// buckets 2^k wide
+size_t Histogram::bucketIndex(uint64_t value)
+{
+    if(value < EXACT_VALUES)
+        return value;
+
+    int msb   = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BITS + 1;
+
+    return EXACT_VALUES + (shift - 1) * HALF_BUCKETS + ((value >> shift) - HALF_BUCKETS);
+}
+
+uint64_t Histogram::bucketTop(size_t index)
+{
+    if(index < EXACT_VALUES)
+        return index;
+
+    int shift    = (index - EXACT_VALUES) / HALF_BUCKETS + 1;
+    uint64_t sub = (index - EXACT_VALUES) % HALF_BUCKETS + HALF_BUCKETS;
+
+    return (sub << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+size_t Histogram::bucketCount()
+{
+    return BUCKET_COUNT;
+}
+
+void Histogram::record(uint64_t value)
+{
+    counts[bucketIndex(value)]++;
+    total++;
+    sum += value;
+
+    if(value < lowest)
+        lowest = value;
+    if(value > highest)
+        highest = value;
+}
+
+void Histogram::addBucket(size_t index, uint64_t count)
+{
+    if(count == 0)
+        return;
+
+    uint64_t top    = bucketTop(index);
+    uint64_t bottom = (index == 0) ? 0 : bucketTop(index - 1) + 1;
+
+    counts[index] += count;
+    total += count;
+    sum   += (long double)count * (bottom + (top - bottom) / 2);
+
+    if(bottom < lowest)
+        lowest = bottom;
+    if(top > highest)
+        highest = top;
+}
+
+void Histogram::merge(const Histogram& other)
+{
+    for(size_t i = 0; i < counts.size(); i++)
+        counts[i] += other.counts[i];
+
+    total += other.total;
+    sum   += other.sum;
+
+    if(other.lowest < lowest)
+        lowest = other.lowest;
+    if(other.highest > highest)
+        highest = other.highest;
+}
+
+void Histogram::reset()
+{
+    counts.assign(counts.size(), 0);
+    total   = 0;
+    lowest  = UINT64_MAX;
+    highest = 0;
+    sum     = 0;
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+    if(total == 0)
+        return 0;
+
+    // Rank of the value wanted, counting from 1
+    uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+    if(rank < 1)
+        rank = 1;
+    if(rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+    for(size_t i = 0; i < counts.size(); i++)
+    {
+        seen += counts[i];
+        if(seen >= rank)
+        {
+            uint64_t top = bucketTop(i);
+            return (top > highest) ? highest : top;
+        }
+    }
+    return highest;
+}
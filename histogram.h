@@ -0,0 +1,56 @@
+//
+// Latency histogram with bounded relative error, in the style of HdrHistogram.
+//
+// Values below 128 are counted exactly. Above that, every power of two
+// range is split into 64 equal buckets, so a value is never reported more
+// than about 1.6% away from what was recorded, whatever its magnitude.
+// Recording is a couple of shifts and an increment, and histograms from
+// several threads can be merged before reading percentiles.
+//
+#ifndef TSAM_HISTOGRAM_H
+#define TSAM_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define HISTOGRAM_SUB_BITS 7      // 2^7 exact values, then 2^6 buckets per power of two
+
+class Histogram {
+public:
+    Histogram();
+
+    void record(uint64_t value);
+
+    // Add the counts of other to this histogram.
+    void merge(const Histogram& other);
+
+    void reset();
+
+    // Value at or below which p percent (0..100) of the recorded values
+    // fall, rounded up to the top of its bucket. 0 if nothing recorded.
+    uint64_t percentile(double p) const;
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? lowest : 0; }
+    uint64_t max() const { return highest; }
+    double mean() const { return total ? (double)sum / total : 0.0; }
+
+    // Buckets, for histograms recorded elsewhere with the same layout:
+    // the bucket value goes in, and the largest value it holds.
+    static size_t bucketIndex(uint64_t value);
+    static uint64_t bucketTop(size_t index);
+    static size_t bucketCount();
+
+    // Add count values from bucket index, taken to be in its middle.
+    void addBucket(size_t index, uint64_t count);
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t lowest;
+    uint64_t highest;
+    long double sum;
+};
+
+#endif
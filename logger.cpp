@@ -0,0 +1,372 @@
+//
+// Asynchronous logging for the TSAM chat server.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+#include "logger.h"
+
+#define LOG_BATCH_BYTES (64 * 1024)   // Output gathered before each write()
+#define LOG_IDLE_WAIT_MS 10           // Writer wakes at least this often
+
+// One message in the ring. seq tells producers and the writer whose turn
+// the slot is (Vyukov's bounded queue).
+struct LogSlot {
+    std::atomic<size_t> seq;
+    time_t time;
+    unsigned char level;
+    unsigned char sinks;
+    unsigned short length;
+    char *longText;          // the message if it didn't fit in text, else NULL
+    char text[LOG_LINE_MAX];
+};
+
+static LogSlot ring[LOG_RING_SIZE];
+static std::atomic<size_t> tail(0);          // next slot for a producer
+static size_t head = 0;                      // next slot for the writer
+
+static std::atomic<int> minLevel(LOG_INFO);
+static LogFullPolicy fullPolicy = LOG_DROP;
+static std::atomic<unsigned long> dropped(0);
+
+static int logFd = -1;
+static std::thread writer;
+static std::atomic<bool> running(false);
+static std::atomic<bool> writerIdle(false);
+static std::mutex wakeLock;
+static std::condition_variable wake;
+
+static const char *levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+void formatTimestamp(time_t t, char *out)
+{
+    static thread_local time_t cachedTime = -1;
+    static thread_local char cached[20];
+
+    if(t != cachedTime)
+    {
+        struct tm local;
+        localtime_r(&t, &local);
+        strftime(cached, sizeof(cached), "%Y-%m-%d %H:%M:%S", &local);
+        cachedTime = t;
+    }
+    memcpy(out, cached, sizeof(cached));
+}
+
+// Write all of buffer to fd, retrying short writes
+static void writeAll(int fd, const char *buffer, size_t length)
+{
+    while(length > 0)
+    {
+        ssize_t n = write(fd, buffer, length);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        buffer += n;
+        length -= n;
+    }
+}
+
+// Batches of formatted lines waiting to be written
+struct LogBatch {
+    char console[LOG_BATCH_BYTES];
+    char file[LOG_BATCH_BYTES];
+    size_t consoleUsed;
+    size_t fileUsed;
+
+    void flush() {
+        if(consoleUsed > 0)
+            writeAll(STDOUT_FILENO, console, consoleUsed);
+        if(fileUsed > 0 && logFd >= 0)
+            writeAll(logFd, file, fileUsed);
+        consoleUsed = fileUsed = 0;
+    }
+
+    // Console lines carry the level, file lines are "[time] text" as
+    // the log file has always had them
+    void add(time_t t, int level, int sinks, const char *text, size_t length) {
+        char stamp[20];
+        formatTimestamp(t, stamp);
+
+        // Longest prefix is "[YYYY-MM-DD HH:MM:SS] ERROR " plus newline
+        if(consoleUsed + length + 32 > sizeof(console) ||
+           fileUsed + length + 32 > sizeof(file))
+            flush();
+
+        if(sinks & LOG_CONSOLE)
+        {
+            consoleUsed += sprintf(console + consoleUsed, "[%s] %s ", stamp, levelNames[level]);
+            memcpy(console + consoleUsed, text, length);
+            consoleUsed += length;
+            console[consoleUsed++] = '\n';
+        }
+        if(sinks & LOG_FILE)
+        {
+            fileUsed += sprintf(file + fileUsed, "[%s] ", stamp);
+            memcpy(file + fileUsed, text, length);
+            fileUsed += length;
+            file[fileUsed++] = '\n';
+        }
+    }
+};
+
+// Take everything currently in the ring. Returns the number of messages.
+static size_t drainRing(LogBatch *batch)
+{
+    size_t taken = 0;
+
+    for(;;)
+    {
+        LogSlot *slot = &ring[head & (LOG_RING_SIZE - 1)];
+
+        if(slot->seq.load(std::memory_order_acquire) != head + 1)
+            break;
+
+        if(slot->longText != NULL)
+        {
+            batch->add(slot->time, slot->level, slot->sinks, slot->longText, slot->length);
+            free(slot->longText);
+            slot->longText = NULL;
+        }
+        else
+        {
+            batch->add(slot->time, slot->level, slot->sinks, slot->text, slot->length);
+        }
+
+        // Hand the slot back to producers for the next lap of the ring
+        slot->seq.store(head + LOG_RING_SIZE, std::memory_order_release);
+        head++;
+        taken++;
+    }
+    return taken;
+}
+
+static void writerThread()
+{
+    static LogBatch batch;
+    unsigned long reported = 0;
+
+    batch.consoleUsed = batch.fileUsed = 0;
+
+    for(;;)
+    {
+        bool stopping = !running.load();
+        size_t taken  = drainRing(&batch);
+
+        unsigned long lost = dropped.load(std::memory_order_relaxed);
+        if(lost != reported)
+        {
+            char note[64];
+            int n = snprintf(note, sizeof(note), "%lu log messages dropped", lost - reported);
+            batch.add(time(NULL), LOG_WARN, LOG_CONSOLE, note, n);
+            reported = lost;
+        }
+
+        batch.flush();
+
+        if(stopping)
+            break;
+
+        // Nothing new: sleep until a producer wakes us or the timeout
+        // passes (a wakeup can be missed, the timeout bounds the delay)
+        if(taken == 0)
+        {
+            std::unique_lock<std::mutex> lock(wakeLock);
+            writerIdle.store(true);
+            wake.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_WAIT_MS));
+            writerIdle.store(false);
+        }
+    }
+}
+
+bool startLogger(const char *path, LogLevel level, LogFullPolicy policy)
+{
+    for(size_t i = 0; i < LOG_RING_SIZE; i++)
+    {
+        ring[i].seq.store(i, std::memory_order_relaxed);
+        ring[i].longText = NULL;
+    }
+
+    minLevel.store(level);
+    fullPolicy = policy;
+
+    logFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    running.store(true);
+    writer = std::thread(writerThread);
+
+    if(logFd < 0)
+    {
+        logError("Error: Unable to open log file for writing");
+        return false;
+    }
+    return true;
+}
+
+void stopLogger()
+{
+    if(!running.load())
+        return;
+
+    running.store(false);
+    wake.notify_one();
+    writer.join();
+
+    if(logFd >= 0)
+    {
+        close(logFd);
+        logFd = -1;
+    }
+}
+
+void setLogLevel(LogLevel level)
+{
+    minLevel.store(level, std::memory_order_relaxed);
+}
+
+bool logEnabled(LogLevel level)
+{
+    return level >= minLevel.load(std::memory_order_relaxed);
+}
+
+bool parseLogLevel(const char *name, LogLevel *level)
+{
+    for(int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+    {
+        if(strcasecmp(name, levelNames[i]) == 0)
+        {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned long logDropped()
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+// Claim a slot, format the message into it and publish it to the writer
+static void logV(int sinks, LogLevel level, const char *format, va_list args)
+{
+    if(!logEnabled(level))
+        return;
+
+    // Before the writer is running, or after it stopped, write directly
+    if(!running.load(std::memory_order_relaxed))
+    {
+        vfprintf(stdout, format, args);
+        fputc('\n', stdout);
+        return;
+    }
+
+    size_t pos = tail.load(std::memory_order_relaxed);
+    LogSlot *slot;
+
+    for(;;)
+    {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        long diff  = (long)seq - (long)pos;
+
+        if(diff == 0)
+        {
+            if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0)
+        {
+            // Ring is full
+            if(fullPolicy == LOG_DROP)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            wake.notify_one();
+            std::this_thread::yield();
+            pos = tail.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    va_list again;
+    va_copy(again, args);
+
+    int n = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    if(n < 0)
+        n = 0;
+    if(n >= (int)sizeof(slot->text))
+    {
+        // Too long for the slot: format it again on the heap, where the
+        // writer frees it. Only if that fails is it cut to the slot.
+        size_t size = std::min(n + 1, LOG_LONG_LINE_MAX);
+        char *text  = (char *)malloc(size);
+
+        if(text != NULL)
+        {
+            vsnprintf(text, size, format, again);
+            slot->longText = text;
+        }
+        else
+        {
+            text = slot->text;
+            size = sizeof(slot->text);
+        }
+
+        if(n >= (int)size)
+        {
+            n = size - 1;
+            memcpy(text + n - 3, "...", 3);
+        }
+    }
+    va_end(again);
+
+    slot->time   = time(NULL);
+    slot->level  = level;
+    slot->sinks  = sinks;
+    slot->length = n;
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    if(writerIdle.load(std::memory_order_relaxed))
+        wake.notify_one();
+}
+
+void logMessage(LogLevel level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    logV(LOG_CONSOLE, level, format, args);
+    va_end(args);
+}
+
+void logTo(int sinks, LogLevel level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    logV(sinks, level, format, args);
+    va_end(args);
+}
+
+void logError(const char *what)
+{
+    logMessage(LOG_ERROR, "%s: %s", what, strerror(errno));
+}
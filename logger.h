@@ -0,0 +1,75 @@
+//
+// Asynchronous logging for the TSAM chat server.
+//
+// Threads that log only format their message into a slot of a fixed size
+// lock-free ring and carry on. A message too long for its slot (a logged
+// SENDMSG with a long payload) is copied to the heap instead, so it is
+// written whole. A background writer thread drains the ring,
+// adds timestamps (formatted once per second, not once per line) and
+// writes whole batches to the console and the log file with one write()
+// each, so the event loop never waits on terminal or disk I/O.
+//
+// When the ring is full the configured policy either drops the message
+// (counted, and reported by the writer) or makes the caller wait for room.
+//
+#ifndef TSAM_LOGGER_H
+#define TSAM_LOGGER_H
+
+#include <stddef.h>
+#include <time.h>
+
+enum LogLevel {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+};
+
+enum LogFullPolicy {
+    LOG_DROP,            // throw the message away
+    LOG_BLOCK            // wait for the writer to make room
+};
+
+// Where a message goes
+enum {
+    LOG_CONSOLE = 0x01,  // standard output
+    LOG_FILE    = 0x02   // the log file
+};
+
+#define LOG_RING_SIZE 4096     // Messages the ring can hold, a power of two
+#define LOG_LINE_MAX  512      // Longest message kept in the ring itself
+#define LOG_LONG_LINE_MAX (16 * 1024)  // Longest message kept, longer ones are cut
+
+// Start the writer thread, appending to the file at path.
+// Returns false if the file could not be opened (console logging still works).
+bool startLogger(const char *path, LogLevel level, LogFullPolicy policy);
+
+// Flush everything logged so far and stop the writer thread.
+void stopLogger();
+
+// Messages below level are discarded without being formatted.
+void setLogLevel(LogLevel level);
+bool logEnabled(LogLevel level);
+
+// Parse "debug", "info", "warn" or "error". Returns false if not recognised.
+bool parseLogLevel(const char *name, LogLevel *level);
+
+// Log a printf style message to the console.
+void logMessage(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Log a printf style message to the given LOG_CONSOLE/LOG_FILE sinks.
+void logTo(int sinks, LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Log an error with the text for the current errno appended, like perror().
+void logError(const char *what);
+
+// Write "YYYY-MM-DD HH:MM:SS" for t into out (at least 20 bytes). The
+// result for the last second formatted is cached per thread.
+void formatTimestamp(time_t t, char *out);
+
+// Number of messages dropped because the ring was full.
+unsigned long logDropped();
+
+#endif
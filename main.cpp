@@ -0,0 +1,213 @@
+//
+// Command line of the TSAM chat server: parse the options and run it.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <thread>
+
+#include "server.h"
+#include "logger.h"
+#include "spool.h"
+#include "trace.h"
+
+static void stopOnSignal(int)
+{
+    stopServer();
+}
+
+int main(int argc, char* argv[])
+{
+    int workerCount;                // Event loop threads to run
+    int backlog = BACKLOG;          // Length of the listen queue
+    RateLimit acceptRate = { ACCEPT_RATE, ACCEPT_BURST };
+    RateLimit addrCommandRate = { ADDR_COMMAND_RATE, ADDR_COMMAND_BURST };
+    RateLimit addrByteRate    = { ADDR_BYTE_RATE, ADDR_BYTE_BURST };
+    LogLevel logLevel = LOG_INFO;   // Least important messages logged
+    LogFullPolicy logPolicy = LOG_DROP;
+    const char *spoolDir = NULL;    // Where to keep stored messages, if anywhere
+    int metricsPort = 0;            // Local port for the metrics endpoint, 0 for none
+    int spoolSyncMs = SPOOL_SYNC_INTERVAL;
+    int opt;
+
+    // One worker per core unless told otherwise
+    workerCount = std::thread::hardware_concurrency();
+    if(workerCount < 1)
+        workerCount = 1;
+
+    while((opt = getopt(argc, argv, "l:f:t:i:k:b:a:c:C:r:R:s:y:n:p:o:m:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                serverGroup = optarg;
+                if(!validGroupId(serverGroup))
+                {
+                    printf("Invalid group ID: %s\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 'p':
+            {
+                struct sockaddr_in addr;
+                const char *colon = strrchr(optarg, ':');
+                std::string ip(optarg, colon != NULL ? colon - optarg : 0);
+                int peerPort = colon != NULL ? atoi(colon + 1) : 0;
+
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                addr.sin_port   = htons(peerPort);
+                if(peerPort <= 0 || peerPort > 65535 ||
+                   inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1)
+                {
+                    printf("Invalid server address: %s\n", optarg);
+                    exit(0);
+                }
+                seedPeers.push_back(addr);
+                break;
+            }
+            case 'o':
+                maxOutbound = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                if(backlog < 1)
+                {
+                    printf("Backlog must be at least 1\n");
+                    exit(0);
+                }
+                break;
+            case 'a':
+                if(!parseRateLimit(optarg, &acceptRate))
+                {
+                    printf("Invalid accept rate: %s\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 'c':
+            case 'C':
+            case 'r':
+            case 'R':
+            {
+                RateLimit *limit = (opt == 'c') ? &connCommandLimit :
+                                   (opt == 'C') ? &connByteLimit :
+                                   (opt == 'r') ? &addrCommandRate : &addrByteRate;
+                if(!parseRateLimit(optarg, limit))
+                {
+                    printf("Invalid rate limit: %s\n", optarg);
+                    exit(0);
+                }
+                break;
+            }
+            case 's':
+                spoolDir = optarg;
+                break;
+            case 'm':
+                metricsPort = atoi(optarg);
+                if(metricsPort < 1 || metricsPort > 65535)
+                {
+                    printf("Invalid metrics port: %s\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 'y':
+                spoolSyncMs = atoi(optarg);
+                if(spoolSyncMs < 1)
+                {
+                    printf("Spool sync interval must be at least 1 ms\n");
+                    exit(0);
+                }
+                break;
+            case 'i':
+                idleTimeoutMs = (uint64_t)atoi(optarg) * 1000;
+                break;
+            case 'k':
+                keepAliveIntervalMs = (uint64_t)atoi(optarg) * 1000;
+                break;
+            case 't':
+                workerCount = atoi(optarg);
+                if(workerCount < 1 || workerCount > MAX_WORKERS)
+                {
+                    printf("Worker threads must be between 1 and %d\n", MAX_WORKERS);
+                    exit(0);
+                }
+                break;
+            case 'l':
+                if(!parseLogLevel(optarg, &logLevel))
+                {
+                    printf("Unknown log level: %s\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 'f':
+                if(strcmp(optarg, "drop") == 0)
+                    logPolicy = LOG_DROP;
+                else if(strcmp(optarg, "block") == 0)
+                    logPolicy = LOG_BLOCK;
+                else
+                {
+                    printf("Unknown log full policy: %s\n", optarg);
+                    exit(0);
+                }
+                break;
+            default:
+                optind = argc;      // fall through to the usage message
+                break;
+        }
+    }
+
+    if(argc - optind != 1)
+    {
+        printf("Usage: chat_server [-l debug|info|warn|error] [-f drop|block] [-t threads]\n"
+               "                   [-i idle seconds] [-k keepalive seconds] [-b backlog]\n"
+               "                   [-a connections per second per address[,burst]]\n"
+               "                   [-c commands per second per connection[,burst]]\n"
+               "                   [-C bytes per second per connection[,burst]]\n"
+               "                   [-r commands per second per address[,burst]]\n"
+               "                   [-R bytes per second per address[,burst]]\n"
+               "                   [-s spool directory] [-y spool sync ms] [-m metrics port]\n"
+               "                   [-n group ID] [-p server ip:port]... [-o max outbound servers]\n"
+               "                   <ip port>\n");
+        exit(0);
+    }
+
+    const char *port = argv[optind];
+
+    // Before any thread starts, so SIGUSR2 only goes to the trace dumper
+    startTracing();
+
+    startLogger("server_log.txt", logLevel, logPolicy);
+
+    // A peer disconnecting while we write to it shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Stop cleanly on Ctrl-C or kill, so the log and spool are written out
+    signal(SIGINT, stopOnSignal);
+    signal(SIGTERM, stopOnSignal);
+
+    ServerOptions options;
+
+    options.workerCount     = workerCount;
+    options.backlog         = backlog;
+    options.acceptRate      = acceptRate;
+    options.addrCommandRate = addrCommandRate;
+    options.addrByteRate    = addrByteRate;
+    options.spoolDir        = spoolDir;
+    options.spoolSyncMs     = spoolSyncMs;
+    options.metricsPort     = metricsPort;
+
+    if(!runServer(atoi(port), options))
+    {
+        stopLogger();
+        exit(0);
+    }
+
+    // Flush the log and exit
+    stopLogger();
+    return 0;
+}
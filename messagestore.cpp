@@ -0,0 +1,415 @@
+//
+// Mailbox store for messages waiting to be collected with GETMSGS.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include "messagestore.h"
+
+#define FIRST_BLOCK_SIZE 1024          // Text block for a new mailbox
+#define MAX_BLOCK_SIZE   (64 * 1024)   // Blocks double in size up to this
+#define FIRST_RING_SIZE  8             // Records for a new mailbox
+
+#define MAX_IDLE_MAILBOXES 1024        // Emptied mailboxes kept for reuse
+#define IDLE_BLOCK_SIZE  (8 * 1024)    // Largest block an idle mailbox keeps
+#define IDLE_RING_SIZE   64            // ...and largest ring
+
+MessageStore::MessageStore(const StoreLimits& storeLimits)
+    : limits(storeLimits), oldest(NULL), newest(NULL),
+      idleOldest(NULL), idleNewest(NULL), idleCount(0),
+      bytes(0), ownBudget(0), budget(&ownBudget),
+      messages(0), evicted(0), rejected(0)
+{
+}
+
+MessageStore::~MessageStore()
+{
+    while(oldest != NULL)
+    {
+        // Empty the mailbox so destroy() finds nothing to account for
+        while(oldest->count > 0)
+            popFront(oldest);
+        destroy(oldest);
+    }
+    while(idleOldest != NULL)
+        destroy(idleOldest);
+}
+
+MessageStore::Mailbox *MessageStore::find(std::string_view group) const
+{
+    auto it = directory.find(group);
+    return (it == directory.end()) ? NULL : it->second.get();
+}
+
+MessageStore::Mailbox *MessageStore::create(std::string_view group)
+{
+    std::unique_ptr<Mailbox> box(new Mailbox());
+
+    box->name  = std::string(group);
+    box->ring.resize(FIRST_RING_SIZE);
+    box->head  = 0;
+    box->count = 0;
+    box->bytes = 0;
+    box->first = box->last = NULL;
+    box->idle  = false;
+    link(box.get());
+
+    Mailbox *created = box.get();
+    directory.emplace(std::string_view(created->name), std::move(box));
+    return created;
+}
+
+// Put a mailbox at the newest end of the age list, or of the idle list if
+// it is idle
+void MessageStore::link(Mailbox *box)
+{
+    Mailbox **front = box->idle ? &idleOldest : &oldest;
+    Mailbox **back  = box->idle ? &idleNewest : &newest;
+
+    box->older = *back;
+    box->newer = NULL;
+    if(*back != NULL)
+        (*back)->newer = box;
+    else
+        *front = box;
+    *back = box;
+}
+
+// Take a mailbox off whichever list it is on
+void MessageStore::unlink(Mailbox *box)
+{
+    Mailbox **front = box->idle ? &idleOldest : &oldest;
+    Mailbox **back  = box->idle ? &idleNewest : &newest;
+
+    if(box->older != NULL)
+        box->older->newer = box->newer;
+    else
+        *front = box->newer;
+    if(box->newer != NULL)
+        box->newer->older = box->older;
+    else
+        *back = box->older;
+}
+
+// Move an emptied mailbox to the idle list, keeping its ring and last
+// block for the group's next message if they are small. The oldest idle
+// mailbox is freed if that makes too many.
+void MessageStore::retire(Mailbox *box)
+{
+    // Every block is empty, so all but the last have already gone
+    if(box->last != NULL && box->last->data->size() > IDLE_BLOCK_SIZE)
+    {
+        delete box->last;
+        box->first = box->last = NULL;
+    }
+    if(box->ring.size() > IDLE_RING_SIZE)
+        std::vector<Record>(FIRST_RING_SIZE).swap(box->ring);
+    box->head = 0;
+
+    unlink(box);
+    box->idle = true;
+    link(box);
+    idleCount++;
+
+    if(idleCount > MAX_IDLE_MAILBOXES)
+        destroy(idleOldest);
+}
+
+// Bring an idle mailbox back to hold messages, as the newest
+void MessageStore::reactivate(Mailbox *box)
+{
+    unlink(box);
+    box->idle = false;
+    link(box);
+    idleCount--;
+}
+
+void MessageStore::destroy(Mailbox *box)
+{
+    while(box->first != NULL)
+    {
+        Block *next = box->first->next;
+        delete box->first;
+        box->first = next;
+    }
+
+    unlink(box);
+    if(box->idle)
+        idleCount--;
+
+    // Erasing the entry frees the mailbox (and the name its key views)
+    directory.erase(std::string_view(box->name));
+}
+
+void MessageStore::append(Mailbox *box, std::string_view from, std::string_view content)
+{
+    size_t length = from.size() + content.size();
+    size_t framed = length + FRAME_OVERHEAD;
+    Block *block  = box->last;
+
+    // An emptied block can be written over again, once nothing is still
+    // sending from it
+    if(block != NULL && block->live == 0 && block->data.use_count() == 1)
+        block->used = 0;
+
+    // Start a new block if the message doesn't fit in the current one
+    if(block == NULL || block->data->size() - block->used < framed)
+    {
+        size_t size = block ? block->data->size() * 2 : FIRST_BLOCK_SIZE;
+        if(size > MAX_BLOCK_SIZE)
+            size = MAX_BLOCK_SIZE;
+        if(size < framed)
+            size = framed;
+
+        Block *fresh = new Block();
+        fresh->data  = std::make_shared<std::string>(size, '\0');
+        fresh->next  = NULL;
+        fresh->used  = 0;
+        fresh->live  = 0;
+
+        if(block != NULL)
+            block->next = fresh;
+        else
+            box->first = fresh;
+        box->last = block = fresh;
+    }
+
+    char *frame = &(*block->data)[block->used];
+    char *p = frame;
+
+    memcpy(p, FRAME_START, strlen(FRAME_START));
+    p += strlen(FRAME_START);
+    memcpy(p, from.data(), from.size());
+    p += from.size();
+    memcpy(p, FRAME_SEPARATOR, strlen(FRAME_SEPARATOR));
+    p += strlen(FRAME_SEPARATOR);
+    memcpy(p, content.data(), content.size());
+    p += content.size();
+    memcpy(p, FRAME_END, strlen(FRAME_END));
+
+    Record r;
+    r.block  = block;
+    r.offset = block->used;
+    r.length = framed;
+    r.fromLength = from.size();
+
+    block->used += framed;
+    block->live++;
+
+    // Double the ring when full, unwrapping it into the new space
+    if(box->count == box->ring.size())
+    {
+        std::vector<Record> bigger(box->ring.size() * 2);
+        for(size_t i = 0; i < box->count; i++)
+            bigger[i] = box->ring[(box->head + i) & (box->ring.size() - 1)];
+        box->ring.swap(bigger);
+        box->head = 0;
+    }
+
+    box->ring[(box->head + box->count) & (box->ring.size() - 1)] = r;
+
+    box->count++;
+    box->bytes += length;
+    messages++;
+    bytes += length;
+    budget->fetch_add(length, std::memory_order_relaxed);
+}
+
+void MessageStore::popFront(Mailbox *box)
+{
+    Record& r = box->ring[box->head];
+    size_t length = r.length - FRAME_OVERHEAD;
+    Block *block  = r.block;
+
+    box->head = (box->head + 1) & (box->ring.size() - 1);
+    box->count--;
+    box->bytes -= length;
+    messages--;
+    bytes -= length;
+    budget->fetch_sub(length, std::memory_order_relaxed);
+
+    block->live--;
+
+    // Free the empty blocks at the front of the chain. Usually that is
+    // just this one, but an emptied last block that a reply was still
+    // sending from when append() moved on is left at the front too. The
+    // last block is kept to write into; a reply holding its data keeps
+    // only the buffer alive, not the block.
+    while(box->first != box->last && box->first->live == 0)
+    {
+        Block *next = box->first->next;
+        delete box->first;
+        box->first = next;
+    }
+}
+
+void MessageStore::evictFront(Mailbox *box, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+        popFront(box);
+    evicted += count;
+
+    if(removed)
+        removed(std::string_view(box->name), count);
+}
+
+bool MessageStore::store(std::string_view to, std::string_view from, std::string_view content)
+{
+    size_t length = from.size() + content.size();
+
+    // Messages that could never fit are refused whatever the policy
+    if(length > limits.maxGroupBytes || length > limits.maxTotalBytes ||
+       limits.maxGroupMessages == 0)
+    {
+        rejected++;
+        return false;
+    }
+
+    Mailbox *box = find(to);
+
+    // Room for the group itself, unless it has messages waiting already
+    if((box == NULL || box->idle) && groupCount() >= limits.maxGroups)
+    {
+        if(limits.policy == REJECT_NEW || oldest == NULL)
+        {
+            rejected++;
+            return false;
+        }
+
+        evictFront(oldest, oldest->count);
+        destroy(oldest);
+    }
+
+    // Room within the group's own limits
+    while(box != NULL && box->count > 0 &&
+          (box->bytes + length > limits.maxGroupBytes ||
+           box->count >= limits.maxGroupMessages))
+    {
+        if(limits.policy == REJECT_NEW)
+        {
+            rejected++;
+            return false;
+        }
+        evictFront(box, 1);
+    }
+
+    // Room overall, taken from the group that has waited longest
+    while(budget->load(std::memory_order_relaxed) + length > limits.maxTotalBytes)
+    {
+        if(limits.policy == REJECT_NEW)
+        {
+            rejected++;
+            return false;
+        }
+
+        // The group being written to may be the oldest, already emptied.
+        // With the budget shared, this store may have nothing to evict.
+        Mailbox *victim = oldest;
+        if(box != NULL && victim == box && box->count == 0)
+            victim = box->newer;
+        if(victim == NULL)
+            break;
+
+        evictFront(victim, 1);
+
+        if(victim->count == 0 && victim != box)
+            destroy(victim);
+    }
+
+    if(box == NULL)
+        box = create(to);
+    else if(box->idle)
+        reactivate(box);
+
+    append(box, from, content);
+    return true;
+}
+
+size_t MessageStore::count(std::string_view group) const
+{
+    Mailbox *box = find(group);
+    return (box == NULL) ? 0 : box->count;
+}
+
+SharedMessageStore::SharedMessageStore(const StoreLimits& limits)
+    : heldBytes(0), spool(NULL)
+{
+    StoreLimits shardLimits = limits;
+
+    shardLimits.maxGroups = (limits.maxGroups + STORE_SHARDS - 1) / STORE_SHARDS;
+
+    for(int i = 0; i < STORE_SHARDS; i++)
+    {
+        shards.emplace_back(new Shard(shardLimits));
+        shards.back()->store.shareByteBudget(&heldBytes);
+    }
+}
+
+void SharedMessageStore::attach(MessageSpool *messageSpool)
+{
+    spool = messageSpool;
+    for(auto& shard : shards)
+    {
+        shard->store.onRemove([messageSpool](std::string_view group, size_t count) {
+            messageSpool->removed(group, count);
+        });
+    }
+}
+
+// Totals are summed shard by shard, so they are only a snapshot when
+// other threads are using the store
+
+size_t SharedMessageStore::totalBytes()
+{
+    size_t total = 0;
+    for(auto& shard : shards)
+    {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        total += shard->store.totalBytes();
+    }
+    return total;
+}
+
+size_t SharedMessageStore::totalMessages()
+{
+    size_t total = 0;
+    for(auto& shard : shards)
+    {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        total += shard->store.totalMessages();
+    }
+    return total;
+}
+
+size_t SharedMessageStore::groupCount()
+{
+    size_t total = 0;
+    for(auto& shard : shards)
+    {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        total += shard->store.groupCount();
+    }
+    return total;
+}
+
+uint64_t SharedMessageStore::evictedMessages()
+{
+    uint64_t total = 0;
+    for(auto& shard : shards)
+    {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        total += shard->store.evictedMessages();
+    }
+    return total;
+}
+
+uint64_t SharedMessageStore::rejectedMessages()
+{
+    uint64_t total = 0;
+    for(auto& shard : shards)
+    {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        total += shard->store.rejectedMessages();
+    }
+    return total;
+}
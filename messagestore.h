@@ -0,0 +1,389 @@
+//
+// Mailbox store for messages waiting to be collected with GETMSGS.
+//
+// Groups are found through a hash directory whose keys are the group IDs
+// stored once in their mailbox. A mailbox that has been emptied is kept,
+// with its ring and a small block, on a bounded list of idle mailboxes, so
+// a group whose messages are stored and collected over and over doesn't
+// allocate a new mailbox each time. The least recently emptied one is
+// freed once there are too many.
+//
+// Message text is copied once, into blocks that belong to the mailbox and
+// are filled in order. Each message is stored as the frame GETMSGS sends
+// for it, SOH "From <from>: <content>" EOT, so messages that arrived one
+// after another lie next to each other ready to send. Blocks are reference
+// counted buffers: draining a mailbox hands out runs of whole frames as
+// slices of a block, which an OutQueue can send from directly, and a block
+// is freed once the mailbox has drained it and no queue still holds it.
+// Each mailbox keeps its messages in a ring of small records, so counting
+// is O(1).
+//
+// Memory is bounded per group and overall. The overall byte limit can be
+// shared between several stores (the shards of a SharedMessageStore), each
+// counting what it holds against the same total. When a limit is hit the
+// store
+// either evicts the oldest messages (from the group being written to, or
+// from the group in the store that has waited longest) or refuses the new
+// message, depending on the configured policy.
+//
+// A MessageSpool can be attached to a SharedMessageStore to keep a copy of
+// the stored messages on disk (see spool.h).
+//
+// MessageStore itself is not thread safe. SharedMessageStore splits the
+// groups over a number of independently locked MessageStores by a hash of
+// the group ID, so worker threads storing and draining different groups
+// rarely wait for each other.
+//
+#ifndef TSAM_MESSAGESTORE_H
+#define TSAM_MESSAGESTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+#include "spool.h"
+#include "outqueue.h"
+
+#define FRAME_START    "\x01" "From "     // Stored frames: FRAME_START <from>
+#define FRAME_SEPARATOR ": "              // FRAME_SEPARATOR <content>
+#define FRAME_END      "\x04"             // FRAME_END
+#define FRAME_OVERHEAD 9                  // Bytes of framing around each message
+
+enum EvictionPolicy {
+    EVICT_OLDEST,        // make room by dropping the oldest messages
+    REJECT_NEW           // refuse messages that don't fit
+};
+
+struct StoreLimits {
+    size_t maxGroupBytes;        // message bytes held for one group
+    size_t maxGroupMessages;     // messages held for one group
+    size_t maxTotalBytes;        // message bytes held for all groups
+    size_t maxGroups;            // groups with messages waiting (idle
+                                 // mailboxes aren't counted)
+    EvictionPolicy policy;
+};
+
+class MessageStore {
+public:
+    explicit MessageStore(const StoreLimits& limits);
+    ~MessageStore();
+
+    // Store a message for group to. Returns false if the message was
+    // refused (too big, or the store is full and the policy is REJECT_NEW).
+    bool store(std::string_view to, std::string_view from, std::string_view content);
+
+    // Number of messages waiting for group.
+    size_t count(std::string_view group) const;
+
+    // Count the bytes held against a total shared with other stores,
+    // instead of this store's own, when checking maxTotalBytes. Done
+    // before the store is used.
+    void shareByteBudget(std::atomic<size_t> *total) { budget = total; }
+
+    // Remove up to max of a group's messages, oldest first, handing their
+    // frames to deliver(buffer, offset, length). Each call covers one or
+    // more whole frames lying next to each other in buffer, which deliver
+    // may keep a reference to. Stops before the frames would pass maxBytes,
+    // though the first is always delivered. Returns the number of messages
+    // delivered.
+    template <typename F>
+    size_t drain(std::string_view group, F deliver, size_t max = SIZE_MAX,
+                 size_t maxBytes = SIZE_MAX);
+
+    // As drain(), but hands each message to deliver(from, content) on its
+    // own, for passing messages on rather than sending their frames. The
+    // views are only valid while deliver runs.
+    template <typename F>
+    size_t drainMessages(std::string_view group, F deliver, size_t max = SIZE_MAX);
+
+    // Call fn(group, count) for every group with messages waiting.
+    template <typename F>
+    void forEachGroup(F fn) const;
+
+    // Have removed(group, count) called whenever the oldest count messages
+    // of a group leave the store, whether drained or evicted.
+    void onRemove(std::function<void(std::string_view group, size_t count)> fn) {
+        removed = fn;
+    }
+
+    size_t totalBytes() const { return bytes; }
+    size_t totalMessages() const { return messages; }
+    size_t groupCount() const { return directory.size() - idleCount; }
+    uint64_t evictedMessages() const { return evicted; }
+    uint64_t rejectedMessages() const { return rejected; }
+
+private:
+    MessageStore(const MessageStore&);
+    MessageStore& operator=(const MessageStore&);
+
+    // Storage for message frames, filled front to back. Output queues may
+    // still be sending from data after the block itself is gone.
+    struct Block {
+        std::shared_ptr<std::string> data;
+        Block *next;         // next (newer) block of the mailbox
+        size_t used;         // bytes of data written
+        size_t live;         // messages in the block not yet drained
+    };
+
+    // One stored message
+    struct Record {
+        Block *block;            // block holding its frame
+        uint32_t offset;         // where the frame starts in block->data
+        uint32_t length;         // bytes in the frame
+        uint32_t fromLength;     // bytes of <from> in the frame
+    };
+
+    struct Mailbox {
+        std::string name;               // group ID, key of the directory
+        std::vector<Record> ring;       // records, capacity a power of two
+        size_t head;                    // oldest record in ring
+        size_t count;                   // records in ring
+        size_t bytes;                   // message bytes held
+        Block *first;                   // oldest block
+        Block *last;                    // block being filled
+        bool idle;                      // emptied, on the idle list
+        Mailbox *older;                 // neighbours in age order (or in
+        Mailbox *newer;                 // the order they went idle), oldest
+                                        // mailbox at the front of the list
+    };
+
+    Mailbox *create(std::string_view group);
+    void destroy(Mailbox *box);
+    void retire(Mailbox *box);
+    void reactivate(Mailbox *box);
+    void link(Mailbox *box);
+    void unlink(Mailbox *box);
+    void append(Mailbox *box, std::string_view from, std::string_view content);
+    void popFront(Mailbox *box);
+    void evictFront(Mailbox *box, size_t count);
+    Mailbox *find(std::string_view group) const;
+
+    StoreLimits limits;
+    std::unordered_map<std::string_view, std::unique_ptr<Mailbox>> directory;
+    Mailbox *oldest;             // mailboxes in the order they were created
+    Mailbox *newest;
+    Mailbox *idleOldest;         // emptied mailboxes in the order they went idle
+    Mailbox *idleNewest;
+    size_t idleCount;
+    size_t bytes;                // message bytes held
+    std::atomic<size_t> ownBudget;   // bytes held, when not shared
+    std::atomic<size_t> *budget;     // bytes counted against maxTotalBytes
+    size_t messages;             // messages held
+    uint64_t evicted;            // messages dropped to make room
+    uint64_t rejected;           // messages refused
+    std::function<void(std::string_view, size_t)> removed;
+};
+
+#define STORE_SHARDS 16      // Independently locked parts of a SharedMessageStore
+
+// Progress through a drain that is done a bounded step at a time, so a
+// big mailbox can be handed out without holding everything else up.
+struct DrainCursor {
+    DrainCursor() : remaining(0) {}
+
+    bool active() const { return remaining > 0; }
+
+    std::string group;
+    size_t remaining;        // messages still to hand out
+};
+
+// A MessageStore that can be used from several threads. Each group lives
+// in one shard. The shards share the overall byte limit, so one busy shard
+// can use all of it; when it is reached a shard makes room from its own
+// groups, and holds at most one message more once it has none left. The
+// group limit is divided evenly between the shards.
+class SharedMessageStore {
+public:
+    explicit SharedMessageStore(const StoreLimits& limits);
+
+    // Log every change to spool from now on. Done before the store is used.
+    void attach(MessageSpool *spool);
+
+    bool store(std::string_view to, std::string_view from, std::string_view content) {
+        Shard& shard = shardFor(to);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if(!shard.store.store(to, from, content))
+            return false;
+        if(spool != NULL)
+            spool->added(to, from, content);
+        return true;
+    }
+
+    size_t count(std::string_view group) {
+        Shard& shard = shardFor(group);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.store.count(group);
+    }
+
+    // As MessageStore::drain(). The group's shard is locked while deliver
+    // runs, so deliver must not call back into the store.
+    template <typename F>
+    size_t drain(std::string_view group, F deliver, size_t max = SIZE_MAX,
+                 size_t maxBytes = SIZE_MAX) {
+        Shard& shard = shardFor(group);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.store.drain(group, deliver, max, maxBytes);
+    }
+
+    // As MessageStore::drainMessages(), with the shard locked as for drain().
+    template <typename F>
+    size_t drainMessages(std::string_view group, F deliver, size_t max = SIZE_MAX) {
+        Shard& shard = shardFor(group);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        return shard.store.drainMessages(group, deliver, max);
+    }
+
+    // Set cursor to hand out up to max of group's messages. Messages that
+    // arrive after this are left for the next drain.
+    void startDrain(DrainCursor& cursor, std::string_view group, size_t max) {
+        cursor.group     = std::string(group);
+        cursor.remaining = std::min(max, count(group));
+    }
+
+    // Drain the cursor's next step of at most maxMessages messages and
+    // maxBytes bytes, as drain(). Returns the number of messages delivered.
+    template <typename F>
+    size_t drainStep(DrainCursor& cursor, F deliver, size_t maxMessages, size_t maxBytes) {
+        size_t delivered = drain(cursor.group, deliver,
+                                 std::min(maxMessages, cursor.remaining), maxBytes);
+
+        // Nothing left means someone else got there first
+        cursor.remaining = (delivered == 0) ? 0 : cursor.remaining - delivered;
+        return delivered;
+    }
+
+    // As MessageStore::forEachGroup(), one shard at a time.
+    template <typename F>
+    void forEachGroup(F fn) {
+        for(auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard->lock);
+            shard->store.forEachGroup(fn);
+        }
+    }
+
+    size_t totalBytes();
+    size_t totalMessages();
+    size_t groupCount();
+    uint64_t evictedMessages();
+    uint64_t rejectedMessages();
+
+private:
+    SharedMessageStore(const SharedMessageStore&);
+    SharedMessageStore& operator=(const SharedMessageStore&);
+
+    // Shards sit on their own cache lines so their locks don't share one
+    struct alignas(64) Shard {
+        explicit Shard(const StoreLimits& limits) : store(limits) {}
+        std::mutex lock;
+        MessageStore store;
+    };
+
+    Shard& shardFor(std::string_view group) {
+        return *shards[std::hash<std::string_view>()(group) % STORE_SHARDS];
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<size_t> heldBytes;   // message bytes held by all shards
+    MessageSpool *spool;
+};
+
+template <typename F>
+size_t MessageStore::drain(std::string_view group, F deliver, size_t max, size_t maxBytes)
+{
+    Mailbox *box = find(group);
+    size_t delivered = 0;
+    size_t taken = 0;            // bytes of frames delivered
+
+    if(box == NULL)
+        return 0;
+
+    // Frames that follow on in the same block go out as one run. The run
+    // holds a reference, so its block survives popFront() freeing it.
+    SharedBuffer run;
+    size_t start = 0;
+    size_t end   = 0;
+
+    while(box->count > 0 && delivered < max)
+    {
+        const Record& r = box->ring[box->head];
+
+        if(delivered > 0 && taken + r.length > maxBytes)
+            break;
+        taken += r.length;
+
+        if(r.block->data != run || r.offset != end)
+        {
+            if(run)
+                deliver(run, start, end - start);
+            run   = r.block->data;
+            start = r.offset;
+        }
+        end = r.offset + r.length;
+
+        popFront(box);
+        delivered++;
+    }
+
+    if(run)
+        deliver(run, start, end - start);
+
+    if(delivered > 0 && removed)
+        removed(std::string_view(box->name), delivered);
+
+    if(delivered > 0 && box->count == 0)
+        retire(box);
+
+    return delivered;
+}
+
+template <typename F>
+size_t MessageStore::drainMessages(std::string_view group, F deliver, size_t max)
+{
+    Mailbox *box = find(group);
+    size_t delivered = 0;
+
+    if(box == NULL)
+        return 0;
+
+    while(box->count > 0 && delivered < max)
+    {
+        const Record& r = box->ring[box->head];
+        const char *from = r.block->data->data() + r.offset + strlen(FRAME_START);
+        size_t contentLength = r.length - FRAME_OVERHEAD - r.fromLength;
+
+        // Delivered before popFront(), which may free the block
+        deliver(std::string_view(from, r.fromLength),
+                std::string_view(from + r.fromLength + strlen(FRAME_SEPARATOR),
+                                 contentLength));
+
+        popFront(box);
+        delivered++;
+    }
+
+    if(delivered > 0 && removed)
+        removed(std::string_view(box->name), delivered);
+
+    if(delivered > 0 && box->count == 0)
+        retire(box);
+
+    return delivered;
+}
+
+template <typename F>
+void MessageStore::forEachGroup(F fn) const
+{
+    for(const Mailbox *box = oldest; box != NULL; box = box->newer)
+        fn(std::string_view(box->name), box->count);
+}
+
+#endif
@@ -0,0 +1,200 @@
+//
+// Runtime metrics for the TSAM chat server.
+//
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <thread>
+
+#include "metrics.h"
+#include "logger.h"
+
+#define METRICS_BACKLOG      16     // Scrapes waiting to be answered
+#define METRICS_IO_TIMEOUT   1      // Seconds a scraper gets to send its request and read the reply
+#define METRICS_REQUEST_MAX  4096   // Request bytes read before answering anyway
+
+uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+LatencyRecorder::~LatencyRecorder()
+{
+    delete[] counts.load();
+}
+
+void LatencyRecorder::record(uint64_t value)
+{
+    std::atomic<uint64_t> *buckets = counts.load(std::memory_order_relaxed);
+
+    if(buckets == NULL)
+    {
+        size_t n = Histogram::bucketCount();
+
+        buckets = new std::atomic<uint64_t>[n];
+        for(size_t i = 0; i < n; i++)
+            buckets[i].store(0, std::memory_order_relaxed);
+
+        // Readers see the buckets zeroed before they see the pointer
+        counts.store(buckets, std::memory_order_release);
+    }
+
+    std::atomic<uint64_t>& bucket = buckets[Histogram::bucketIndex(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    total.add();
+    valueSum.add(value);
+}
+
+void LatencyRecorder::addTo(Histogram& histogram) const
+{
+    const std::atomic<uint64_t> *buckets = counts.load(std::memory_order_acquire);
+
+    if(buckets == NULL)
+        return;
+
+    for(size_t i = 0; i < Histogram::bucketCount(); i++)
+        histogram.addBucket(i, buckets[i].load(std::memory_order_relaxed));
+}
+
+void MetricsText::family(const char *name, const char *type, const char *help)
+{
+    text += "# HELP ";
+    text += name;
+    text += " ";
+    text += help;
+    text += "\n# TYPE ";
+    text += name;
+    text += " ";
+    text += type;
+    text += "\n";
+}
+
+void MetricsText::sample(const char *name, const std::string& labels, double value)
+{
+    char number[32];
+
+    snprintf(number, sizeof(number), "%.9g", value);
+
+    text += name;
+    if(!labels.empty())
+    {
+        text += "{";
+        text += labels;
+        text += "}";
+    }
+    text += " ";
+    text += number;
+    text += "\n";
+}
+
+void MetricsText::summary(const char *name, const std::string& labels, const Histogram& histogram,
+                          uint64_t sum, double scale)
+{
+    static const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+    static const double percents[] = { 50, 90, 99, 99.9 };
+    std::string prefix = labels.empty() ? "" : labels + ",";
+
+    for(int i = 0; i < 4; i++)
+    {
+        sample(name, prefix + "quantile=\"" + quantiles[i] + "\"",
+               histogram.percentile(percents[i]) * scale);
+    }
+
+    sample((std::string(name) + "_sum").c_str(), labels, sum * scale);
+    sample((std::string(name) + "_count").c_str(), labels, histogram.count());
+}
+
+// Answer scrapes one at a time, for as long as the server runs
+static void serveMetrics(int listenSock, std::function<std::string()> render)
+{
+    for(;;)
+    {
+        int sock = accept(listenSock, NULL, NULL);
+
+        if(sock < 0)
+        {
+            if(errno != EINTR && errno != ECONNABORTED)
+            {
+                logError("Metrics accept failed");
+                sleep(1);
+            }
+            continue;
+        }
+
+        // Don't let a scraper that stops talking hold up the next one
+        struct timeval timeout = { METRICS_IO_TIMEOUT, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Whatever was asked for, once the request headers are in
+        std::string request;
+        char buffer[1024];
+
+        while(request.find("\r\n\r\n") == std::string::npos && request.size() < METRICS_REQUEST_MAX)
+        {
+            ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+            if(n <= 0)
+                break;
+            request.append(buffer, n);
+        }
+
+        std::string body = render();
+        char header[160];
+        int headerLength = snprintf(header, sizeof(header),
+                                    "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %zu\r\n"
+                                    "Connection: close\r\n\r\n", body.size());
+        std::string reply = std::string(header, headerLength) + body;
+
+        for(size_t sent = 0; sent < reply.size(); )
+        {
+            ssize_t n = send(sock, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if(n <= 0)
+                break;
+            sent += n;
+        }
+        close(sock);
+    }
+}
+
+bool startMetricsEndpoint(int port, std::function<std::string()> render)
+{
+    struct sockaddr_in addr;
+    int set = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(sock < 0)
+    {
+        logError("Failed to open metrics socket");
+        return false;
+    }
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &set, sizeof(set));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(port);
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(sock, METRICS_BACKLOG) < 0)
+    {
+        logError("Failed to open metrics port");
+        close(sock);
+        return false;
+    }
+
+    std::thread(serveMetrics, sock, render).detach();
+    logMessage(LOG_INFO, "Metrics on http://127.0.0.1:%d/metrics", port);
+    return true;
+}
@@ -0,0 +1,92 @@
+//
+// Runtime metrics for the TSAM chat server.
+//
+// Each worker thread has its own counters and latency histograms and is the
+// only thread that updates them. An update is a relaxed load and store of a
+// std::atomic: no locked instruction and no cache line shared with another
+// writer, so it costs about as much as adding to a plain integer. Readers
+// (STATUSREQ and the metrics endpoint) add up the values of every worker
+// when asked; a value read during an update is at most that update behind.
+//
+// The metrics endpoint is a thread of its own, blocked in accept() on a
+// loopback-only port until something scrapes it, so it costs the event
+// loops nothing the rest of the time. It answers each connection with the
+// current metrics in the Prometheus text format and closes it.
+//
+#ifndef TSAM_METRICS_H
+#define TSAM_METRICS_H
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <functional>
+
+#include "histogram.h"
+
+// Monotonic clock in ns, for timing
+uint64_t monotonicNs();
+
+// A count kept by one thread and read by any
+class Counter {
+public:
+    Counter() : value(0) {}
+
+    void add(uint64_t n = 1) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value;
+};
+
+// Histogram recorded by one thread and read by any, in the buckets of
+// Histogram. Its buckets are only allocated once something is recorded.
+class LatencyRecorder {
+public:
+    LatencyRecorder() : counts(NULL) {}
+    ~LatencyRecorder();
+
+    void record(uint64_t value);
+
+    // Add what has been recorded to histogram
+    void addTo(Histogram& histogram) const;
+
+    uint64_t count() const { return total.get(); }
+    uint64_t sum() const { return valueSum.get(); }
+
+private:
+    LatencyRecorder(const LatencyRecorder&);
+    LatencyRecorder& operator=(const LatencyRecorder&);
+
+    std::atomic<std::atomic<uint64_t> *> counts;
+    Counter total;
+    Counter valueSum;
+};
+
+// Builds a Prometheus text format page
+class MetricsText {
+public:
+    // Start a metric family; type is "counter", "gauge" or "summary"
+    void family(const char *name, const char *type, const char *help);
+
+    // One sample. labels is "" or like `command="HELO"`.
+    void sample(const char *name, const std::string& labels, double value);
+
+    // The median, 90th, 99th and 99.9th percentiles of histogram, with
+    // its count and the sum of the values, all times scale
+    void summary(const char *name, const std::string& labels, const Histogram& histogram,
+                 uint64_t sum, double scale);
+
+    const std::string& str() const { return text; }
+
+private:
+    std::string text;
+};
+
+// Serve the page render() returns on 127.0.0.1:port, from a thread of
+// its own. Returns false, having logged why, if the port can't be used.
+bool startMetricsEndpoint(int port, std::function<std::string()> render);
+
+#endif
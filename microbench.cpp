@@ -0,0 +1,383 @@
+//
+// Microbenchmarks for the server's building blocks.
+//
+// Command line: ./microbench [-t seconds] [-f filter] [-j file]
+//
+// Each benchmark times one operation of the server in isolation, linked
+// against the server's own code (everything but main.cpp): building
+// responses with constructCommand() and join(), splitting commands with
+// the tokenizer clientCommand() uses, storing, collecting and counting
+// messages, getTimestamp(), and building the SERVERS response.
+//
+// An operation is run in a loop whose length doubles until it takes long
+// enough to time, and the result is reported as nanoseconds and heap
+// allocations per operation. Sizes are swept over what the server sees:
+// 1 to 10000 groups and 1 to 1000 servers, payloads up to 5000 bytes.
+//
+// The target is built with -DTSAM_COUNT_ALLOCS, so operator new counts
+// its calls (see alloccount.h).
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+#include "server.h"
+#include "command.h"
+#include "registry.h"
+#include "alloccount.h"
+
+#define DEFAULT_MIN_TIME 0.2      // Seconds each benchmark runs for at least
+#define MAX_ITERATIONS   (1ull << 30)
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    double nsPerOp;
+    double allocsPerOp;
+};
+
+struct MicroConfig {
+    double minTime;
+    const char *filter;            // run only names containing this, NULL for all
+    const char *jsonPath;          // NULL for no JSON output, "-" for stdout
+};
+
+static MicroConfig cfg;
+static std::vector<BenchResult> results;
+
+// Time and allocations of the work done inside Untimed blocks this run
+static uint64_t untimedNs;
+static uint64_t untimedAllocations;
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Keep the compiler from optimizing away a value that is never used
+template <typename T>
+static void keep(const T& value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+// Leaves the time and allocations of its scope out of the benchmark
+// being run, for setup and cleanup between operations
+class Untimed {
+public:
+    Untimed() : start(nowNs()), allocations(allocationCount()) {}
+    ~Untimed() {
+        untimedNs += nowNs() - start;
+        untimedAllocations += allocationCount() - allocations;
+    }
+
+private:
+    uint64_t start;
+    uint64_t allocations;
+};
+
+// Time op(iterations), with the number of iterations doubled until a run
+// takes at least the minimum time, and print the result
+static void runBenchmark(const std::string& name, const std::function<void(uint64_t)>& op)
+{
+    if(cfg.filter != NULL && name.find(cfg.filter) == std::string::npos)
+        return;
+
+    uint64_t minNs = (uint64_t)(cfg.minTime * 1e9);
+    uint64_t iterations = 1;
+    uint64_t elapsed, allocations;
+
+    for(;;)
+    {
+        uint64_t allocsBefore = allocationCount();
+        uint64_t start = nowNs();
+
+        untimedNs = untimedAllocations = 0;
+        op(iterations);
+
+        elapsed     = nowNs() - start - untimedNs;
+        allocations = allocationCount() - allocsBefore - untimedAllocations;
+
+        if(elapsed >= minNs || iterations >= MAX_ITERATIONS)
+            break;
+
+        // Aim straight for the minimum time once a run is long enough to
+        // go by, with some room to spare
+        if(elapsed > minNs / 100)
+            iterations = std::max(iterations + 1, (uint64_t)(iterations * 1.2 * minNs / elapsed));
+        else
+            iterations *= 2;
+    }
+
+    BenchResult result = { name, iterations, (double)elapsed / iterations,
+                           (double)allocations / iterations };
+    results.push_back(result);
+
+    printf("%-36s %12llu %12.1f %12.2f\n", name.c_str(), (unsigned long long)iterations,
+           result.nsPerOp, result.allocsPerOp);
+    fflush(stdout);
+}
+
+static std::string groupName(size_t i)
+{
+    return "A5_" + std::to_string(i);
+}
+
+static std::vector<std::string> groupNames(size_t count)
+{
+    std::vector<std::string> names;
+    for(size_t i = 0; i < count; i++)
+        names.push_back(groupName(i));
+    return names;
+}
+
+// Collect every message left in the given groups
+static void emptyGroups(const std::vector<std::string>& groups)
+{
+    for(const std::string& group : groups)
+        getMessages(group, [](const SharedBuffer&, size_t, size_t) {});
+}
+
+static void benchResponses()
+{
+    static const size_t payloads[] = { 0, 64, 1000, 5000 };
+    static const size_t lists[]    = { 1, 10, 100, 1000 };
+
+    // A SENDMSG as sent to a peer
+    for(size_t size : payloads)
+    {
+        std::vector<std::string> params = { "A5_1", "A5_43", std::string(size, 'x') };
+
+        runBenchmark("constructCommand/" + std::to_string(size), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; i++)
+                keep(constructCommand("SENDMSG", params));
+        });
+    }
+
+    // Lists of SERVERS entries
+    for(size_t count : lists)
+    {
+        std::vector<std::string> entries(count, "A5_123,130.208.243.61,4021");
+
+        runBenchmark("join/" + std::to_string(count), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; i++)
+                keep(join(entries, ";"));
+        });
+    }
+
+    runBenchmark("getTimestamp", [](uint64_t n) {
+        for(uint64_t i = 0; i < n; i++)
+            keep(getTimestamp());
+    });
+}
+
+static void benchTokenizer()
+{
+    static const size_t payloads[] = { 16, 500, 5000 };
+
+    for(size_t size : payloads)
+    {
+        std::string command = "SENDMSG,A5_1,A5_43," + std::string(size, 'x');
+
+        runBenchmark("tokenize/SENDMSG/" + std::to_string(size), [&](uint64_t n) {
+            CommandTokens tokens;
+            for(uint64_t i = 0; i < n; i++)
+                keep(tokens.parse(command));
+        });
+    }
+
+    // More fields than MAX_TOKENS, as in a long STATUSRESP
+    std::string status = "STATUSRESP";
+    for(size_t i = 0; i < 100; i++)
+        status += "," + groupName(i) + ",5";
+
+    runBenchmark("tokenize/STATUSRESP/100", [&](uint64_t n) {
+        CommandTokens tokens;
+        for(uint64_t i = 0; i < n; i++)
+            keep(tokens.parse(status));
+    });
+}
+
+static void benchStore()
+{
+    static const size_t groupCounts[] = { 1, 100, 10000 };
+    static const size_t payloads[]    = { 64, 5000 };
+
+    for(size_t groups : groupCounts)
+    {
+        std::vector<std::string> names = groupNames(groups);
+
+        for(size_t size : payloads)
+        {
+            std::string content(size, 'x');
+            std::string suffix = std::to_string(groups) + "/" + std::to_string(size);
+
+            // Rounds over every group before the store would start to
+            // evict, well within both the group and the shard limits
+            size_t rounds = std::max((size_t)1, std::min(MAX_GROUP_BYTES / 4 / size,
+                                                         MAX_STORE_BYTES / 4 / (size * groups)));
+
+            // Into mailboxes that are emptied (untimed) before they fill up
+            runBenchmark("storeMessage/" + suffix, [&](uint64_t n) {
+                for(uint64_t i = 0; i < n; i++)
+                {
+                    keep(storeMessage(names[i % groups], "A5_43", content));
+                    if(i % (groups * rounds) == groups * rounds - 1)
+                    {
+                        Untimed untimed;
+                        emptyGroups(names);
+                    }
+                }
+            });
+            emptyGroups(names);
+
+            // A message stored and collected again, as GETMSG does
+            runBenchmark("storeMessage+getMessages/" + suffix, [&](uint64_t n) {
+                for(uint64_t i = 0; i < n; i++)
+                {
+                    const std::string& group = names[i % groups];
+                    storeMessage(group, "A5_43", content);
+                    keep(getMessages(group, [](const SharedBuffer& frames, size_t, size_t) {
+                        keep(frames);
+                    }, 1));
+                }
+            });
+            emptyGroups(names);
+        }
+
+        // Counting with 10 messages waiting in every group
+        for(const std::string& group : names)
+        {
+            for(int i = 0; i < 10; i++)
+                storeMessage(group, "A5_43", "hello");
+        }
+
+        runBenchmark("getMessageCount/" + std::to_string(groups), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; i++)
+                keep(getMessageCount(names[i % groups]));
+        });
+        emptyGroups(names);
+    }
+}
+
+static void benchServers()
+{
+    static const size_t serverCounts[] = { 1, 10, 100, 1000 };
+
+    for(size_t count : serverCounts)
+    {
+        ServerRegistry registry;
+        struct sockaddr_in addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        inet_pton(AF_INET, "130.208.243.61", &addr.sin_addr);
+
+        for(size_t i = 0; i < count; i++)
+            registry.add(i, groupName(i), addr, 4000 + i);
+
+        // LISTSERVERS while nothing changes: the shared copy
+        runBenchmark("serversResponse/" + std::to_string(count), [&](uint64_t n) {
+            for(uint64_t i = 0; i < n; i++)
+                keep(registry.snapshot());
+        });
+
+        // A server leaving and another joining, then the response built
+        // again, as on the first LISTSERVERS after a change
+        runBenchmark("serversResponse/changed/" + std::to_string(count), [&](uint64_t n) {
+            int next = count;
+            for(uint64_t i = 0; i < n; i++)
+            {
+                registry.remove(next - count);
+                registry.add(next, groupName(next), addr, 4000 + next % 1000);
+                next++;
+                keep(registry.snapshot());
+            }
+
+            // Back to ids 0..count-1 for the next run
+            for(size_t i = 0; i < count; i++)
+            {
+                registry.remove(next - count + i);
+                registry.add(i, groupName(i), addr, 4000 + i);
+            }
+        });
+    }
+}
+
+static void usage()
+{
+    printf("Usage: microbench [-t seconds] [-f filter] [-j file]\n");
+    printf("  -t seconds       least time each benchmark runs for (default %.1f)\n", DEFAULT_MIN_TIME);
+    printf("  -f filter        only run benchmarks whose name contains filter\n");
+    printf("  -j file          write results as JSON to file (- for stdout)\n");
+    exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    cfg.minTime  = DEFAULT_MIN_TIME;
+    cfg.filter   = NULL;
+    cfg.jsonPath = NULL;
+
+    while((opt = getopt(argc, argv, "t:f:j:")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': cfg.minTime  = atof(optarg); break;
+            case 'f': cfg.filter   = optarg;       break;
+            case 'j': cfg.jsonPath = optarg;       break;
+            default:
+                usage();
+        }
+    }
+
+    if(argc != optind || cfg.minTime <= 0)
+        usage();
+
+    if(!allocationCountingEnabled())
+        printf("Warning: built without -DTSAM_COUNT_ALLOCS, allocations are not counted\n");
+
+    printf("%-36s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+
+    benchResponses();
+    benchTokenizer();
+    benchStore();
+    benchServers();
+
+    if(cfg.jsonPath != NULL)
+    {
+        FILE *out = (strcmp(cfg.jsonPath, "-") == 0) ? stdout : fopen(cfg.jsonPath, "w");
+        if(out == NULL)
+        {
+            perror("Unable to open JSON output");
+            exit(0);
+        }
+
+        fprintf(out, "{\"min_time_s\": %.3f, \"benchmarks\": [", cfg.minTime);
+        for(size_t i = 0; i < results.size(); i++)
+        {
+            const BenchResult& r = results[i];
+            fprintf(out, "%s\n  {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, "
+                    "\"allocs_per_op\": %.3f}", i ? "," : "", r.name.c_str(),
+                    (unsigned long long)r.iterations, r.nsPerOp, r.allocsPerOp);
+        }
+        fprintf(out, "]}\n");
+
+        if(out != stdout)
+            fclose(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+//
+// Per-connection output queue for the TSAM chat server.
+//
+#include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outqueue.h"
+#include "logger.h"
+
+// Don't raise SIGPIPE when a peer has gone away (Linux); OSX ignores it
+// and relies on SIGPIPE being ignored by the server.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+void OutQueue::append(const char *data, size_t length)
+{
+    if(length == 0)
+        return;
+
+    if(!chunks.empty() && !chunks.back().shared &&
+       chunks.back().own.size() + length <= OUTPUT_COALESCE_SIZE)
+    {
+        chunks.back().own.append(data, length);
+        total += length;
+    }
+    else
+    {
+        push(std::string(data, length));
+    }
+}
+
+void OutQueue::push(std::string&& data)
+{
+    total += data.size();
+    chunks.emplace_back();
+    chunks.back().own = std::move(data);
+}
+
+void OutQueue::append(std::string&& data)
+{
+    if(data.size() < OUTPUT_COALESCE_SIZE / 4)
+    {
+        append(data.data(), data.size());
+        return;
+    }
+
+    push(std::move(data));
+}
+
+void OutQueue::append(const SharedBuffer& buffer, size_t offset, size_t length)
+{
+    if(length < OUTPUT_SHARE_MIN)
+    {
+        append(buffer->data() + offset, length);
+        return;
+    }
+
+    chunks.emplace_back();
+    Chunk& chunk = chunks.back();
+
+    chunk.shared = buffer;
+    chunk.offset = offset;
+    chunk.length = length;
+    total += length;
+}
+
+long OutQueue::flush(int sock)
+{
+    struct iovec iov[OUTPUT_MAX_IOV];
+    struct msghdr msg = {};
+
+    while(total > 0)
+    {
+        // Gather up to OUTPUT_MAX_IOV chunks into one call
+        int count = 0;
+        for(std::deque<Chunk>::iterator it = chunks.begin();
+            it != chunks.end() && count < OUTPUT_MAX_IOV; ++it, ++count)
+        {
+            size_t skip = (count == 0) ? headOffset : 0;
+
+            iov[count].iov_base = (void *)(it->data() + skip);
+            iov[count].iov_len  = it->size() - skip;
+        }
+
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = count;
+
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            logError("send failed");
+            return -1;
+        }
+
+        // Drop everything that went out
+        total -= sent;
+        while(sent > 0)
+        {
+            size_t left = chunks.front().size() - headOffset;
+
+            if((size_t)sent < left)
+            {
+                headOffset += sent;
+                break;
+            }
+            sent -= left;
+            headOffset = 0;
+            chunks.pop_front();
+        }
+    }
+    return total;
+}
@@ -0,0 +1,70 @@
+//
+// Per-connection output queue for the TSAM chat server.
+//
+// Responses are appended to the queue instead of being sent directly.
+// The queue is flushed with writev() when the event loop decides to (after
+// a batch of commands has been handled, or when the socket reports it is
+// writable again), so many small responses leave in one system call and a
+// short write or EAGAIN just leaves the rest queued for later.
+//
+// Besides bytes of its own, the queue can hold references to shared,
+// immutable buffers (such as the cached SERVERS response). Those are sent
+// straight from the shared buffer, which stays alive until the last queue
+// holding it has sent its part.
+//
+#ifndef TSAM_OUTQUEUE_H
+#define TSAM_OUTQUEUE_H
+
+#include <stddef.h>
+#include <string>
+#include <deque>
+#include <memory>
+
+#define OUTPUT_COALESCE_SIZE 4096  // Small writes are merged into chunks this big
+#define OUTPUT_MAX_IOV       64    // Chunks handed to one writev() call
+#define OUTPUT_SHARE_MIN     256   // Smaller parts of shared buffers are copied
+
+// Immutable buffer that several output queues may reference at once
+typedef std::shared_ptr<const std::string> SharedBuffer;
+
+class OutQueue {
+public:
+    OutQueue() : headOffset(0), total(0) {}
+
+    // Queue bytes to be sent. Small appends are copied onto the end of the
+    // last chunk; larger ones are moved in as a chunk of their own.
+    void append(const char *data, size_t length);
+    void append(std::string&& data);
+
+    // Queue length bytes of a shared buffer, from offset, without
+    // copying them (unless there are too few to be worth a reference).
+    void append(const SharedBuffer& buffer, size_t offset, size_t length);
+    void append(const SharedBuffer& buffer) { append(buffer, 0, buffer->size()); }
+
+    // Send as much as the socket will take. Returns the number of bytes
+    // still queued, or -1 if the connection failed.
+    long flush(int sock);
+
+    bool empty() const { return total == 0; }
+    size_t size() const { return total; }
+
+private:
+    // Queued bytes: either owned, or a slice of a shared buffer
+    struct Chunk {
+        std::string own;
+        SharedBuffer shared;
+        size_t offset;                // slice of shared, if set
+        size_t length;
+
+        const char *data() const { return shared ? shared->data() + offset : own.data(); }
+        size_t size() const { return shared ? length : own.size(); }
+    };
+
+    void push(std::string&& data);
+
+    std::deque<Chunk> chunks;         // queued data, oldest first
+    size_t headOffset;                // bytes of chunks.front() already sent
+    size_t total;                     // bytes queued and not yet sent
+};
+
+#endif
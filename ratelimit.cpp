@@ -0,0 +1,128 @@
+//
+// Token bucket rate limiting.
+//
+#include <stdlib.h>
+#include <math.h>
+
+#include "ratelimit.h"
+
+bool TokenBucket::take(const RateLimit& limit, uint64_t nowMs)
+{
+    if(nowMs > last)
+    {
+        tokens += (nowMs - last) * limit.rate / 1000.0;
+        if(tokens > limit.burst)
+            tokens = limit.burst;
+        last = nowMs;
+    }
+
+    if(tokens < 1.0)
+        return false;
+
+    tokens -= 1.0;
+    return true;
+}
+
+uint64_t TokenBucket::charge(const RateLimit& limit, uint64_t nowMs, double cost)
+{
+    if(nowMs > last)
+    {
+        tokens += (nowMs - last) * limit.rate / 1000.0;
+        if(tokens > limit.burst)
+            tokens = limit.burst;
+        last = nowMs;
+    }
+
+    tokens -= cost;
+    if(tokens >= 0)
+        return 0;
+    return (uint64_t)ceil(-tokens * 1000.0 / limit.rate);
+}
+
+bool TokenBucket::full(const RateLimit& limit, uint64_t nowMs) const
+{
+    double refill = (nowMs > last) ? (nowMs - last) * limit.rate / 1000.0 : 0;
+    return tokens + refill >= limit.burst;
+}
+
+bool parseRateLimit(const char *text, RateLimit *limit)
+{
+    char *end;
+
+    limit->rate = strtod(text, &end);
+    if(end == text || limit->rate < 0)
+        return false;
+
+    if(*end == ',')
+    {
+        const char *burst = end + 1;
+        limit->burst = strtod(burst, &end);
+        if(end == burst || limit->burst < 1)
+            return false;
+    }
+    else
+    {
+        limit->burst = (limit->rate < 1) ? 1 : limit->rate;
+    }
+    return *end == '\0';
+}
+
+// addr's bucket, made full if it has none. The shard must be locked.
+TokenBucket& AddressLimiter::bucket(Shard& shard, uint32_t addr, uint64_t nowMs)
+{
+    auto found = shard.buckets.find(addr);
+    if(found == shard.buckets.end())
+    {
+        if(shard.buckets.size() >= LIMITER_SHARD_MAX)
+            expireShard(shard, nowMs);
+
+        found = shard.buckets.emplace(addr, TokenBucket()).first;
+        found->second.reset(limit, nowMs);
+    }
+    return found->second;
+}
+
+bool AddressLimiter::allow(uint32_t addr, uint64_t nowMs)
+{
+    if(!enabled())
+        return true;
+
+    Shard& shard = shardFor(addr);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    return bucket(shard, addr, nowMs).take(limit, nowMs);
+}
+
+uint64_t AddressLimiter::charge(uint32_t addr, uint64_t nowMs, double cost)
+{
+    if(!enabled())
+        return 0;
+
+    Shard& shard = shardFor(addr);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    return bucket(shard, addr, nowMs).charge(limit, nowMs, cost);
+}
+
+void AddressLimiter::expireShard(Shard& shard, uint64_t nowMs)
+{
+    for(auto it = shard.buckets.begin(); it != shard.buckets.end(); )
+    {
+        if(it->second.full(limit, nowMs))
+            it = shard.buckets.erase(it);
+        else
+            ++it;
+    }
+}
+
+void AddressLimiter::expire(uint64_t nowMs)
+{
+    if(!enabled())
+        return;
+
+    for(int i = 0; i < LIMITER_SHARDS; i++)
+    {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        expireShard(shards[i], nowMs);
+    }
+}
@@ -0,0 +1,92 @@
+//
+// Token bucket rate limiting.
+//
+// A bucket holds up to burst tokens and refills at rate tokens per second;
+// each event takes a token and is refused when the bucket is empty. So a
+// source can do burst things at once, and rate per second after that.
+//
+// Things that have already happened (bytes received, a command run) are
+// charged instead: the bucket may go into debt, and the source is held
+// back until it has paid it off.
+//
+// AddressLimiter keeps a bucket per IPv4 source address, shared by all
+// worker threads (SO_REUSEPORT spreads one address's connections over
+// every worker). The addresses are split over independently locked shards,
+// and addresses whose bucket has refilled are forgotten, since a new full
+// bucket would behave the same, so memory follows the number of recently
+// active sources.
+//
+#ifndef TSAM_RATELIMIT_H
+#define TSAM_RATELIMIT_H
+
+#include <stdint.h>
+#include <unordered_map>
+#include <mutex>
+
+struct RateLimit {
+    double rate;             // tokens added per second, 0 = no limit
+    double burst;            // most tokens a bucket holds
+};
+
+struct TokenBucket {
+    double tokens;
+    uint64_t last;           // when tokens was last brought up to date, ms
+
+    void reset(const RateLimit& limit, uint64_t nowMs) {
+        tokens = limit.burst;
+        last   = nowMs;
+    }
+
+    // Refill for the time passed, then take one token if there is one
+    bool take(const RateLimit& limit, uint64_t nowMs);
+
+    // Refill for the time passed, then take cost tokens even if that goes
+    // into debt. Returns the ms until the debt is paid off, 0 if there is none.
+    uint64_t charge(const RateLimit& limit, uint64_t nowMs, double cost);
+
+    // True if the bucket would be full at nowMs
+    bool full(const RateLimit& limit, uint64_t nowMs) const;
+};
+
+// Parse "rate" or "rate,burst" (burst defaults to rate, at least 1).
+// Returns false if the text isn't valid.
+bool parseRateLimit(const char *text, RateLimit *limit);
+
+#define LIMITER_SHARDS      16       // Independently locked parts of an AddressLimiter
+#define LIMITER_SHARD_MAX   65536    // Addresses per shard before an early clean up
+
+class AddressLimiter {
+public:
+    AddressLimiter() : limit(RateLimit { 0, 0 }) {}
+
+    // Set the limit. Must be done before the workers start.
+    void configure(const RateLimit& newLimit) { limit = newLimit; }
+    bool enabled() const { return limit.rate > 0; }
+
+    // Take a token for addr (IPv4, network order). False if it has none left.
+    bool allow(uint32_t addr, uint64_t nowMs);
+
+    // Charge cost tokens to addr, as TokenBucket::charge().
+    uint64_t charge(uint32_t addr, uint64_t nowMs, double cost);
+
+    // Forget addresses whose buckets have refilled.
+    void expire(uint64_t nowMs);
+
+private:
+    AddressLimiter(const AddressLimiter&);
+    AddressLimiter& operator=(const AddressLimiter&);
+
+    struct alignas(64) Shard {
+        std::mutex lock;
+        std::unordered_map<uint32_t, TokenBucket> buckets;
+    };
+
+    TokenBucket& bucket(Shard& shard, uint32_t addr, uint64_t nowMs);
+    Shard& shardFor(uint32_t addr) { return shards[((addr * 2654435761u) >> 16) % LIMITER_SHARDS]; }
+    void expireShard(Shard& shard, uint64_t nowMs);
+
+    RateLimit limit;
+    Shard shards[LIMITER_SHARDS];
+};
+
+#endif
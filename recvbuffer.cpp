@@ -0,0 +1,125 @@
+//
+// Per-connection receive buffer and SOH/EOT frame scanner.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include "recvbuffer.h"
+
+RecvBuffer::RecvBuffer()
+    : data(0), capacity(0), begin(0), scan(0), end(0), dropped(0)
+{
+}
+
+RecvBuffer::~RecvBuffer()
+{
+    free(data);
+}
+
+char *RecvBuffer::writePtr()
+{
+    writable();
+    return data + end;
+}
+
+size_t RecvBuffer::writable()
+{
+    if(end < capacity)
+    {
+        return capacity - end;
+    }
+
+    // Slide the partial frame down to the start of the buffer
+    if(begin > 0)
+    {
+        memmove(data, data + begin, end - begin);
+        scan -= begin;
+        end  -= begin;
+        begin = 0;
+        return capacity - end;
+    }
+
+    // Buffer is full of one partial frame, so grow it. The limit is a
+    // little over MAX_FRAME_SIZE so an over-long frame can be detected.
+    if(capacity < 2 * MAX_FRAME_SIZE)
+    {
+        size_t grown = capacity ? capacity * 2 : RECV_INITIAL_SIZE;
+        char *bigger = (char *)realloc(data, grown);
+
+        if(bigger != NULL)
+        {
+            data     = bigger;
+            capacity = grown;
+        }
+    }
+    return capacity - end;
+}
+
+bool RecvBuffer::nextFrame(const char **frame, size_t *length)
+{
+    while(begin < end)
+    {
+        // Skip anything in front of the start of the frame
+        if(data[begin] != SOH)
+        {
+            const char *soh = (const char *)memchr(data + begin, SOH, end - begin);
+            size_t skip = soh ? (size_t)(soh - data) - begin : end - begin;
+
+            dropped += skip;
+            begin   += skip;
+            scan     = begin;
+            continue;
+        }
+
+        // Look for the end of the frame, starting where the last search
+        // stopped. A new SOH before the EOT means the earlier frame was
+        // truncated, so restart from there. (memchr is vectorised in libc.)
+        if(scan <= begin)
+            scan = begin + 1;
+
+        const char *eot = (const char *)memchr(data + scan, EOT, end - scan);
+        const char *soh = (const char *)memchr(data + scan, SOH,
+                                               (eot ? eot - data : end) - scan);
+        if(soh != NULL)
+        {
+            dropped += (soh - data) - begin;
+            begin = scan = soh - data;
+            continue;
+        }
+
+        if(eot == NULL)
+        {
+            scan = end;
+            if(end - begin > MAX_FRAME_SIZE)
+            {
+                // Too long to ever be a valid frame, throw it away
+                dropped += end - begin;
+                begin = scan = end;
+            }
+            break;
+        }
+
+        size_t frameEnd = (eot - data) + 1;
+
+        *frame  = data + begin;
+        *length = frameEnd - begin;
+        begin = scan = frameEnd;
+        return true;
+    }
+
+    if(begin == end)
+    {
+        begin = scan = end = 0;
+    }
+    return false;
+}
+
+void RecvBuffer::shrink()
+{
+    if(begin == end && capacity > RECV_INITIAL_SIZE)
+    {
+        free(data);
+        data = 0;
+        capacity = begin = scan = end = 0;
+    }
+}
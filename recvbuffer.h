@@ -0,0 +1,65 @@
+//
+// Per-connection receive buffer and SOH/EOT frame scanner.
+//
+// Bytes are recv()'d straight into the free space at the end of the buffer
+// and complete frames are handed out as pointers into it, so a frame is
+// never copied on its way to the command handler. The buffer grows on
+// demand up to a fixed limit; consumed bytes at the front are reclaimed by
+// sliding the (at most one) partial frame down, which keeps every frame
+// contiguous. That is cheaper than wrapping like a true ring buffer and
+// stitching frames back together when they straddle the end.
+//
+#ifndef TSAM_RECVBUFFER_H
+#define TSAM_RECVBUFFER_H
+
+#include <stddef.h>
+
+const char SOH = '\x01'; // Start of Header character
+const char EOT = '\x04'; // End of Transmission character
+
+#define RECV_INITIAL_SIZE 1024     // Buffer allocated for a new connection
+#define MAX_FRAME_SIZE    8192     // Longest frame (SOH..EOT) accepted
+
+class RecvBuffer {
+public:
+    RecvBuffer();
+    ~RecvBuffer();
+
+    // Free space at the end of the buffer to recv() into. Makes room
+    // first, so this only returns 0 bytes once MAX_FRAME_SIZE worth of
+    // unterminated data is buffered.
+    char *writePtr();
+    size_t writable();
+
+    // Record that n bytes were written at writePtr().
+    void commit(size_t n) { end += n; }
+
+    // Find the next complete frame. On success frame/length describe it,
+    // including the SOH and EOT bytes, and stay valid until the next call
+    // to writePtr()/writable(). Bytes before an SOH are skipped, and an
+    // unterminated frame longer than MAX_FRAME_SIZE is dropped so the
+    // stream can resynchronise on the next SOH.
+    bool nextFrame(const char **frame, size_t *length);
+
+    // Number of bytes dropped because they were not part of a valid frame.
+    size_t discarded() const { return dropped; }
+
+    // Bytes buffered waiting for the rest of their frame.
+    size_t pending() const { return end - begin; }
+
+    // Give memory back when nothing is buffered.
+    void shrink();
+
+private:
+    RecvBuffer(const RecvBuffer&);
+    RecvBuffer& operator=(const RecvBuffer&);
+
+    char *data;          // buffer storage
+    size_t capacity;     // size of data
+    size_t begin;        // first byte not yet handed out
+    size_t scan;         // where the search for EOT resumes
+    size_t end;          // one past the last byte received
+    size_t dropped;      // count of bytes discarded while resyncing
+};
+
+#endif
@@ -0,0 +1,135 @@
+//
+// Registry of the servers connected to us, shared by all worker threads.
+//
+#include <stdio.h>
+#include <arpa/inet.h>
+
+#include "registry.h"
+#include "recvbuffer.h"
+
+void formatServerEntry(std::string_view group, const struct sockaddr_in& addr, int listenPort,
+                       std::string *out)
+{
+    char ip[INET_ADDRSTRLEN];
+    char rest[INET_ADDRSTRLEN + 16];
+
+    // inet_ntoa() uses a static buffer, not safe with several workers
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    int length = (listenPort > 0) ? snprintf(rest, sizeof(rest), ",%s,%d", ip, listenPort)
+                                  : snprintf(rest, sizeof(rest), ",%s,", ip);
+    out->assign(group.data(), group.size());
+    out->append(rest, length);
+}
+
+ServerRegistry::ServerRegistry()
+    : generation(0), publishedGeneration(UINT64_MAX)
+{
+    text += SOH;
+    text += "SERVERS,";
+    text += EOT;
+}
+
+// Entries are separated by ';'. The text always ends in EOT, which each
+// change takes off and puts back.
+
+void ServerRegistry::add(int id, std::string_view group, const struct sockaddr_in& addr,
+                         int listenPort)
+{
+    std::string entry;
+    formatServerEntry(group, addr, listenPort, &entry);
+
+    std::unique_lock<std::shared_mutex> guard(lock);
+
+    removeEntry(id);
+
+    text.pop_back();
+    if(!entries.empty())
+        text += ';';
+
+    byId[id] = entries.size();
+    entries.push_back(Entry { id, text.size(), entry.size() });
+
+    text += entry;
+    text += EOT;
+    generation++;
+}
+
+void ServerRegistry::remove(int id)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    removeEntry(id);
+}
+
+void ServerRegistry::removeEntry(int id)
+{
+    auto it = byId.find(id);
+    if(it == byId.end())
+        return;
+
+    size_t pos = it->second;
+    byId.erase(it);
+
+    Entry hole = entries[pos];
+    Entry last = entries.back();
+
+    if(pos != entries.size() - 1)
+    {
+        // Move the last entry into the hole, in entries and in text
+        std::string moved = text.substr(last.offset, last.length);
+        text.replace(hole.offset, hole.length, moved);
+
+        // Entries after the hole shift if the lengths differ
+        long delta = (long)last.length - (long)hole.length;
+        if(delta != 0)
+        {
+            for(size_t i = pos + 1; i < entries.size(); i++)
+                entries[i].offset += delta;
+        }
+
+        entries[pos] = Entry { last.id, hole.offset, last.length };
+        byId[last.id] = pos;
+        last = entries.back();
+    }
+
+    // Cut the (now duplicate) last entry and the ';' before it
+    size_t cut = (entries.size() > 1) ? last.offset - 1 : last.offset;
+    text.resize(cut);
+    text += EOT;
+    entries.pop_back();
+    generation++;
+}
+
+ServersSnapshot ServerRegistry::snapshot(int id) const
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    ServersSnapshot snap;
+
+    {
+        std::lock_guard<std::mutex> publishGuard(publishLock);
+
+        if(publishedGeneration != generation)
+        {
+            published = std::make_shared<const std::string>(text);
+            publishedGeneration = generation;
+        }
+        snap.frame = published;
+    }
+
+    snap.generation  = generation;
+    snap.entryOffset = 0;
+    snap.entryLength = 0;
+
+    auto it = byId.find(id);
+    if(it != byId.end())
+    {
+        snap.entryOffset = entries[it->second].offset;
+        snap.entryLength = entries[it->second].length;
+    }
+    return snap;
+}
+
+size_t ServerRegistry::size() const
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return entries.size();
+}
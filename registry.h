@@ -0,0 +1,91 @@
+//
+// Registry of the servers connected to us, shared by all worker threads.
+//
+// Every server connection whose group ID we know is listed with the entry
+// that HELO and LISTSERVERS send for it, "<group>,<ip>,<port>", formatted
+// once when the server is identified. The port is the one the server
+// listens on, which we only know for servers we connected to; for servers
+// that connected to us it is left empty ("<group>,<ip>,"). Clients and
+// servers that haven't said who they are aren't listed. The registry
+// also keeps the complete, framed SERVERS response listing every entry,
+// edited in place as servers come and go, so a response never has to be
+// built from the individual entries.
+//
+// Each change bumps a generation number. Readers get an immutable copy of
+// the response, which is only made the first time it is asked for after
+// a change; until the next change every reader shares that same copy and
+// can queue it for sending without copying it again.
+//
+#ifndef TSAM_REGISTRY_H
+#define TSAM_REGISTRY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <shared_mutex>
+#include <mutex>
+
+#include "outqueue.h"
+
+// The SERVERS response as of one generation of the registry
+struct ServersSnapshot {
+    SharedBuffer frame;          // SOH "SERVERS,<entry>;<entry>;..." EOT
+    uint64_t generation;
+    size_t entryOffset;          // where the entry asked for is in frame,
+    size_t entryLength;          // entryLength 0 if it isn't listed
+};
+
+#define SERVERS_PREFIX_LENGTH 9  // SOH "SERVERS,"
+
+class ServerRegistry {
+public:
+    ServerRegistry();
+
+    // List the server connection with the given (unique) id as group at
+    // addr's IP and listenPort (host order), 0 if we don't know it. An id
+    // already listed is listed again with the new details.
+    void add(int id, std::string_view group, const struct sockaddr_in& addr, int listenPort);
+
+    // Remove the connection with the given id, if listed.
+    void remove(int id);
+
+    // The current SERVERS response. If id is listed, the position of its
+    // entry in the response is filled in as well.
+    ServersSnapshot snapshot(int id = -1) const;
+
+    size_t size() const;
+
+private:
+    ServerRegistry(const ServerRegistry&);
+    ServerRegistry& operator=(const ServerRegistry&);
+
+    // remove() with the lock held
+    void removeEntry(int id);
+
+    struct Entry {
+        int id;
+        size_t offset;           // start of the entry in text
+        size_t length;
+    };
+
+    mutable std::shared_mutex lock;
+    std::vector<Entry> entries;                // in the order they appear in text
+    std::unordered_map<int, size_t> byId;      // id -> position in entries
+    std::string text;                          // the response being maintained
+    uint64_t generation;                       // bumped by every change
+
+    // Last copy of text handed out, replaced when the generation moves on
+    mutable std::mutex publishLock;
+    mutable SharedBuffer published;
+    mutable uint64_t publishedGeneration;
+};
+
+// Format the SERVERS entry for a server into out: "<group>,<ip>,<port>",
+// or "<group>,<ip>," if listenPort is 0.
+void formatServerEntry(std::string_view group, const struct sockaddr_in& addr, int listenPort,
+                       std::string *out);
+
+#endif
@@ -0,0 +1,1117 @@
+//
+// Replays recorded client traffic against the TSAM chat server.
+//
+// Command line: ./replay [options] <recording> <ip> <port>
+//
+// The recording is either a packet capture (classic pcap, such as
+// client_server_trace.pcap) or a log written by the server's logCommand()
+// (such as server_log.txt). From a capture, every TCP connection to the
+// server's port is a session, and its client to server bytes are put back
+// together and cut into SOH..EOT frames. From a log, every "Client <n>:"
+// line is one command of session n. Each command keeps the time it was
+// sent, relative to the start of the recording.
+//
+// Every session gets its own connection, and -c runs that many copies of
+// each. By default the commands are sent at the times they were recorded;
+// -x plays the recording that many times faster, and -f flat out: each
+// session sends its next command as soon as the last one is answered.
+//
+// Most commands have no reply that marks their end, so each is followed by
+// a KEEPALIVE, as in bench; the command completes when the KEEPALIVE reply
+// arrives. When paced, latency is counted from the time the command was
+// due rather than when it went out, so the replay falling behind shows up
+// in the results instead of hiding it.
+//
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <queue>
+#include <thread>
+#include <algorithm>
+
+#include "eventloop.h"
+#include "histogram.h"
+
+#define DEFAULT_SPEED       1.0    // Times the recorded pace
+#define DEFAULT_COPIES      1      // Connections per recorded session
+#define DEFAULT_THREADS     1      // Threads sharing the connections
+#define DEFAULT_LOOPS       1      // Times the recording is played
+#define CAPTURE_PORT        4021   // Server port in the capture
+#define FENCE_GROUP         "REPLAY"   // Group named by the KEEPALIVE after each command
+#define MAX_NAME            16     // Longest command name given its own results
+#define DRAIN_TIMEOUT       2.0    // Seconds to wait for replies after the last command
+#define READ_CHUNK          65536  // Bytes read per recv()
+#define MAX_EVENTS          256
+
+const char SOH = '\x01'; // Start of Header character
+const char EOT = '\x04'; // End of Transmission character
+
+// A command as recorded
+struct Step {
+    uint64_t at;                   // nanoseconds from the start of the recording
+    std::string frame;             // SOH..EOT, fence included
+    std::string name;              // command name, for the results
+};
+
+typedef std::vector<Step> Script;
+
+struct Recording {
+    std::vector<Script> sessions;
+    uint64_t span;                 // nanoseconds from first command to last
+    const char *format;
+};
+
+struct ReplayConfig {
+    struct sockaddr_in server;
+    double speed;                  // 0 for flat out
+    int copies;
+    int threads;
+    int loops;
+    double maxGap;                 // seconds, 0 to keep every pause
+    int capturePort;
+    const char *jsonPath;          // NULL for no JSON output, "-" for stdout
+};
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//
+// Reading recordings
+//
+
+// Add a command (the bytes between SOH and EOT) to a session
+static void addStep(Script& script, uint64_t at, std::string_view command)
+{
+    while(!command.empty() && (command.back() == '\r' || command.back() == '\n'))
+        command.remove_suffix(1);
+    if(command.empty())
+        return;
+
+    Step step;
+    step.at = at;
+    step.name.assign(command.substr(0, std::min(command.find(','), (size_t)MAX_NAME)));
+
+    step.frame += SOH;
+    step.frame.append(command.data(), command.size());
+    step.frame += EOT;
+
+    // A KEEPALIVE is its own fence, anything else gets one
+    bool fenced = step.name == "KEEPALIVE" &&
+                  std::count(command.begin(), command.end(), ',') == 1;
+    if(!fenced)
+    {
+        step.frame += SOH;
+        step.frame += "KEEPALIVE," FENCE_GROUP;
+        step.frame += EOT;
+    }
+
+    script.push_back(std::move(step));
+}
+
+// One direction of a TCP connection to the server
+struct Flow {
+    size_t session;                // index in the recording
+    uint32_t nextSeq;              // sequence number expected next
+    bool haveSeq;
+    std::string pending;           // bytes of a frame not yet complete
+};
+
+static uint16_t get16(const unsigned char *p) { return (p[0] << 8) | p[1]; }
+static uint32_t get32(const unsigned char *p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+static uint32_t swap32(uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+// Bytes before the IP header for a pcap link type, -1 if unsupported
+static int linkHeaderLength(uint32_t linkType, const unsigned char *packet, size_t length)
+{
+    switch(linkType)
+    {
+        case 0:                    // BSD loopback, address family in host order
+        case 108:                  // OpenBSD loopback
+            return 4;
+        case 1:                    // Ethernet, possibly with one VLAN tag
+            if(length >= 18 && get16(packet + 12) == 0x8100)
+                return 18;
+            return 14;
+        case 12:                   // raw IP
+        case 14:
+        case 101:
+            return 0;
+        case 113:                  // Linux cooked capture
+            return 16;
+        case 276:                  // Linux cooked capture v2
+            return 20;
+    }
+    return -1;
+}
+
+// Take a TCP segment sent to the server: append its payload to the flow
+// and cut off every frame completed
+static void addSegment(Recording& recording, std::map<std::string, Flow>& flows,
+                       const std::string& key, uint64_t at, uint32_t seq, uint8_t flags,
+                       const unsigned char *data, size_t length)
+{
+    const uint8_t SYN = 0x02;
+    auto it = flows.find(key);
+
+    // A new connection, or the same ports used again
+    if(it == flows.end() || (flags & SYN))
+    {
+        Flow flow;
+        flow.session = recording.sessions.size();
+        flow.haveSeq = false;
+        flow.nextSeq = 0;
+        recording.sessions.emplace_back();
+        it = flows.insert_or_assign(key, flow).first;
+    }
+
+    Flow& flow = it->second;
+    if(flags & SYN)
+    {
+        flow.nextSeq = seq + 1;
+        flow.haveSeq = true;
+        return;
+    }
+    if(length == 0)
+        return;
+
+    // Skip what was retransmitted, keep going over what was lost
+    if(flow.haveSeq)
+    {
+        int32_t ahead = (int32_t)(flow.nextSeq - seq);
+        if(ahead > 0)
+        {
+            if((size_t)ahead >= length)
+                return;
+            data   += ahead;
+            length -= ahead;
+            seq    += ahead;
+        }
+    }
+    flow.nextSeq = seq + length;
+    flow.haveSeq = true;
+    flow.pending.append((const char *)data, length);
+
+    size_t start = 0;
+    size_t eot;
+    while((eot = flow.pending.find(EOT, start)) != std::string::npos)
+    {
+        std::string_view frame(flow.pending.data() + start, eot - start);
+        size_t soh = frame.rfind(SOH);
+        if(soh != std::string_view::npos)
+            frame.remove_prefix(soh + 1);
+
+        addStep(recording.sessions[flow.session], at, frame);
+        start = eot + 1;
+    }
+    flow.pending.erase(0, start);
+}
+
+static bool loadPcap(FILE *file, const char *path, int port, Recording& recording)
+{
+    unsigned char header[24];
+    if(fread(header, 1, sizeof(header), file) != sizeof(header))
+    {
+        printf("%s: truncated pcap header\n", path);
+        return false;
+    }
+
+    // The magic number gives the byte order and the timestamp resolution
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    bool swapped = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+    if(swapped)
+        magic = swap32(magic);
+    uint64_t fractionNs = (magic == 0xa1b23c4d) ? 1 : 1000;
+
+    uint32_t linkType;
+    memcpy(&linkType, header + 20, 4);
+    if(swapped)
+        linkType = swap32(linkType);
+    linkType &= 0xffff;
+
+    std::map<std::string, Flow> flows;
+    std::vector<unsigned char> packet;
+    uint64_t skipped = 0;
+
+    for(;;)
+    {
+        unsigned char record[16];
+        size_t got = fread(record, 1, sizeof(record), file);
+        if(got == 0)
+            break;
+        if(got != sizeof(record))
+        {
+            printf("%s: truncated packet record\n", path);
+            break;
+        }
+
+        uint32_t fields[4];
+        memcpy(fields, record, sizeof(fields));
+        for(int i = 0; swapped && i < 4; i++)
+            fields[i] = swap32(fields[i]);
+
+        uint64_t at = fields[0] * 1000000000ull + fields[1] * fractionNs;
+        size_t captured = fields[2];
+
+        packet.resize(captured);
+        if(fread(packet.data(), 1, captured, file) != captured)
+        {
+            printf("%s: truncated packet\n", path);
+            break;
+        }
+
+        const unsigned char *p = packet.data();
+        size_t length = captured;
+        int linkLength = linkHeaderLength(linkType, p, length);
+        if(linkLength < 0)
+        {
+            printf("%s: unsupported link type %u\n", path, linkType);
+            return false;
+        }
+        if(length < (size_t)linkLength + 20)
+        {
+            skipped++;
+            continue;
+        }
+        p += linkLength;
+        length -= linkLength;
+
+        // IP: the addresses make up the flow's key, along with the port
+        std::string key;
+        size_t ipLength;
+        int protocol;
+
+        if((p[0] >> 4) == 4)
+        {
+            ipLength = (p[0] & 0x0f) * 4;
+            protocol = p[9];
+            size_t total = get16(p + 2);
+            if((get16(p + 6) & 0x3fff) != 0 || total < ipLength || total > length)
+            {
+                skipped++;           // fragment, or cut short
+                continue;
+            }
+            length = total;
+            key.assign((const char *)p + 12, 4);
+        }
+        else if((p[0] >> 4) == 6 && length >= 40)
+        {
+            ipLength = 40;
+            protocol = p[6];
+            size_t total = 40 + get16(p + 4);
+            if(total > length)
+            {
+                skipped++;
+                continue;
+            }
+            length = total;
+            key.assign((const char *)p + 8, 16);
+        }
+        else
+        {
+            continue;
+        }
+
+        if(protocol != IPPROTO_TCP || length < ipLength + 20)
+            continue;
+
+        const unsigned char *tcp = p + ipLength;
+        size_t tcpLength = (tcp[12] >> 4) * 4;
+        if(get16(tcp + 2) != port || tcpLength < 20 || ipLength + tcpLength > length)
+            continue;
+
+        key.append((const char *)tcp, 2);          // client port
+        addSegment(recording, flows, key, at, get32(tcp + 4), tcp[13],
+                   tcp + tcpLength, length - ipLength - tcpLength);
+    }
+
+    if(skipped > 0)
+        printf("%s: skipped %llu damaged or fragmented packets\n", path, (unsigned long long)skipped);
+
+    recording.format = "pcap";
+    return true;
+}
+
+// Log lines are "[YYYY-MM-DD HH:MM:SS] Client <n>: <command>", or on the
+// console "[...] INFO Client <n>: <command>"
+static bool loadLog(FILE *file, Recording& recording)
+{
+    std::map<int, size_t> sessions;     // client socket -> index in the recording
+    char line[65536];
+
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        struct tm when;
+        int used = 0;
+
+        memset(&when, 0, sizeof(when));
+        if(sscanf(line, "[%d-%d-%d %d:%d:%d]%n", &when.tm_year, &when.tm_mon, &when.tm_mday,
+                  &when.tm_hour, &when.tm_min, &when.tm_sec, &used) != 6 || used == 0)
+            continue;
+
+        const char *client = strstr(line + used, "Client ");
+        if(client == NULL)
+            continue;
+
+        char *colon;
+        int sock = strtol(client + 7, &colon, 10);
+        if(colon == client + 7 || colon[0] != ':' || colon[1] != ' ')
+            continue;
+
+        when.tm_year -= 1900;
+        when.tm_mon  -= 1;
+        when.tm_isdst = -1;
+        uint64_t at = (uint64_t)mktime(&when) * 1000000000ull;
+
+        auto it = sessions.find(sock);
+        if(it == sessions.end())
+        {
+            it = sessions.emplace(sock, recording.sessions.size()).first;
+            recording.sessions.emplace_back();
+        }
+
+        // The server logs the frame as received, SOH and EOT included
+        std::string_view command(colon + 2);
+        while(!command.empty() && (command.back() == '\n' || command.back() == '\r'))
+            command.remove_suffix(1);
+        if(!command.empty() && command.front() == SOH)
+            command.remove_prefix(1);
+        if(!command.empty() && command.back() == EOT)
+            command.remove_suffix(1);
+
+        addStep(recording.sessions[it->second], at, command);
+    }
+
+    recording.format = "log";
+    return true;
+}
+
+// Read a recording of either kind, with its times made relative to its
+// first command and pauses longer than maxGap seconds shortened to it
+static bool loadRecording(const char *path, const ReplayConfig& cfg, Recording& recording)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == NULL)
+    {
+        perror(path);
+        return false;
+    }
+
+    uint32_t magic = 0;
+    size_t got = fread(&magic, 1, sizeof(magic), file);
+    rewind(file);
+
+    bool loaded;
+    if(got == sizeof(magic) && (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 ||
+                                magic == 0xa1b23c4d || magic == 0x4d3cb2a1))
+    {
+        loaded = loadPcap(file, path, cfg.capturePort, recording);
+    }
+    else if(got == sizeof(magic) && magic == 0x0a0d0d0a)
+    {
+        printf("%s: pcapng is not supported, save the capture as pcap\n", path);
+        loaded = false;
+    }
+    else
+    {
+        loaded = loadLog(file, recording);
+    }
+    fclose(file);
+
+    if(!loaded)
+        return false;
+
+    // Drop sessions that never sent a whole command
+    recording.sessions.erase(std::remove_if(recording.sessions.begin(), recording.sessions.end(),
+                                            [](const Script& s) { return s.empty(); }),
+                             recording.sessions.end());
+    if(recording.sessions.empty())
+    {
+        printf("%s: no commands found\n", path);
+        return false;
+    }
+
+    // Every time a command was sent, in order, and when to send it now
+    std::vector<uint64_t> times;
+    for(const Script& script : recording.sessions)
+    {
+        for(const Step& step : script)
+            times.push_back(step.at);
+    }
+    std::sort(times.begin(), times.end());
+    times.erase(std::unique(times.begin(), times.end()), times.end());
+
+    uint64_t maxGap = (uint64_t)(cfg.maxGap * 1e9);
+    std::vector<uint64_t> shifted(times.size());
+    shifted[0] = 0;
+    for(size_t i = 1; i < times.size(); i++)
+    {
+        uint64_t gap = times[i] - times[i - 1];
+        shifted[i] = shifted[i - 1] + ((maxGap > 0 && gap > maxGap) ? maxGap : gap);
+    }
+
+    for(Script& script : recording.sessions)
+    {
+        std::stable_sort(script.begin(), script.end(),
+                         [](const Step& a, const Step& b) { return a.at < b.at; });
+        for(Step& step : script)
+            step.at = shifted[std::lower_bound(times.begin(), times.end(), step.at) - times.begin()];
+    }
+    recording.span = shifted.back();
+    return true;
+}
+
+//
+// Replaying
+//
+
+// A command sent and waiting for its fence
+struct PendingStep {
+    uint64_t start;                // nanoseconds, when it was due (or sent, flat out)
+    const Step *step;
+};
+
+// One copy of a recorded session
+struct Session {
+    const Script *script;
+    size_t next;                   // step to send next
+    int loop;                      // times through the script so far
+    int sock;
+    std::string output;            // bytes not yet taken by the socket
+    size_t outputSent;             // ...starting at this offset
+    std::vector<char> input;       // bytes received, not yet a whole frame
+    std::deque<PendingStep> pending;
+    bool writeArmed;
+};
+
+struct ThreadResult {
+    Histogram all;
+    std::map<std::string, Histogram> perCommand;
+    uint64_t connectErrors;
+    uint64_t errorReplies;         // replies starting "Error"
+    uint64_t lost;                 // connections closed before the end
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t sent;
+    uint64_t lastReply;            // nanoseconds
+
+    ThreadResult() : connectErrors(0), errorReplies(0), lost(0), bytesSent(0),
+                     bytesReceived(0), sent(0), lastReply(0) {}
+};
+
+class ReplayThread {
+public:
+    ReplayThread(const ReplayConfig& config, const Recording& recording)
+        : cfg(config), rec(recording), backend(NULL) {}
+
+    ~ReplayThread() {
+        for(Session *s : sessions)
+        {
+            if(s->sock >= 0)
+                close(s->sock);
+            delete s;
+        }
+        delete backend;
+    }
+
+    // Give this thread a copy of a recorded session to play
+    void addSession(const Script *script);
+
+    // Open a connection for each session. Returns false if none could be made.
+    bool connectAll();
+
+    void run(uint64_t start);
+
+    ThreadResult result;
+
+private:
+    uint64_t dueTime(const Session *s) const;
+    void sendStep(Session *s, uint64_t start);
+    void flush(Session *s);
+    void receive(Session *s, uint64_t now);
+    void drop(Session *s);
+
+    const ReplayConfig& cfg;
+    const Recording& rec;
+    EventBackend *backend;
+    std::vector<Session *> sessions;
+    int open = 0;
+    uint64_t origin = 0;           // when the replay started
+    uint64_t stepsLeft = 0;        // steps not sent yet, over all sessions
+    uint64_t waiting = 0;          // steps sent and not answered yet
+};
+
+void ReplayThread::addSession(const Script *script)
+{
+    Session *s    = new Session();
+    s->script     = script;
+    s->next       = 0;
+    s->loop       = 0;
+    s->sock       = -1;
+    s->outputSent = 0;
+    s->writeArmed = false;
+    sessions.push_back(s);
+}
+
+bool ReplayThread::connectAll()
+{
+    if((backend = createEventBackend()) == NULL)
+        return false;
+
+    for(Session *s : sessions)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if(sock < 0)
+        {
+            perror("socket failed");
+            result.connectErrors++;
+            continue;
+        }
+
+        if(connect(sock, (struct sockaddr *)&cfg.server, sizeof(cfg.server)) < 0)
+        {
+            close(sock);
+            result.connectErrors++;
+            continue;
+        }
+
+        int set = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &set, sizeof(set));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+        if(!backend->add(sock, EV_READ, s))
+        {
+            close(sock);
+            result.connectErrors++;
+            continue;
+        }
+        s->sock = sock;
+        open++;
+        stepsLeft += s->script->size() * cfg.loops;
+    }
+
+    return open > 0;
+}
+
+// When a session's next step is to be sent, when paced
+uint64_t ReplayThread::dueTime(const Session *s) const
+{
+    double loopSpan = rec.span / cfg.speed;
+    double at = (*s->script)[s->next].at / cfg.speed;
+
+    return origin + (uint64_t)(s->loop * loopSpan + at);
+}
+
+// Queue the session's next step, and move on to the one after
+void ReplayThread::sendStep(Session *s, uint64_t start)
+{
+    const Step& step = (*s->script)[s->next];
+
+    s->output += step.frame;
+    s->pending.push_back(PendingStep { start, &step });
+    result.sent++;
+    stepsLeft--;
+    waiting++;
+
+    if(++s->next == s->script->size())
+    {
+        s->next = 0;
+        s->loop++;
+    }
+}
+
+void ReplayThread::drop(Session *s)
+{
+    if(s->sock < 0)
+        return;
+
+    backend->remove(s->sock);
+    close(s->sock);
+    s->sock = -1;
+    waiting -= s->pending.size();
+    s->pending.clear();
+    open--;
+
+    // Its remaining steps will never be sent
+    if(s->loop < cfg.loops)
+        stepsLeft -= (cfg.loops - s->loop) * s->script->size() - s->next;
+
+    result.lost++;
+}
+
+// Send as much of the session's output as the socket will take
+void ReplayThread::flush(Session *s)
+{
+    while(s->outputSent < s->output.size())
+    {
+        ssize_t n = send(s->sock, s->output.data() + s->outputSent,
+                         s->output.size() - s->outputSent, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                drop(s);
+                return;
+            }
+            break;
+        }
+        s->outputSent += n;
+        result.bytesSent += n;
+    }
+
+    if(s->outputSent == s->output.size())
+    {
+        s->output.clear();
+        s->outputSent = 0;
+    }
+
+    // Only ask to hear about room in the socket while output is waiting
+    bool wantWrite = !s->output.empty();
+    if(wantWrite != s->writeArmed)
+    {
+        backend->modify(s->sock, EV_READ | (wantWrite ? EV_WRITE : 0), s);
+        s->writeArmed = wantWrite;
+    }
+}
+
+// Read the server's replies, completing a step for every KEEPALIVE reply,
+// and when flat out send the session's next step in its place
+void ReplayThread::receive(Session *s, uint64_t now)
+{
+    char chunk[READ_CHUNK];
+
+    for(;;)
+    {
+        ssize_t n = recv(s->sock, chunk, sizeof(chunk), 0);
+        if(n == 0)
+        {
+            drop(s);
+            return;
+        }
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                drop(s);
+            break;
+        }
+
+        result.bytesReceived += n;
+        s->input.insert(s->input.end(), chunk, chunk + n);
+        if(n < (ssize_t)sizeof(chunk))
+            break;
+    }
+
+    if(s->sock < 0)
+        return;
+
+    size_t start = 0;
+    size_t used  = s->input.size();
+    const char *data = s->input.data();
+
+    for(;;)
+    {
+        const char *eot = (const char *)memchr(data + start, EOT, used - start);
+        if(eot == NULL)
+            break;
+
+        const char *frame = data + start;
+        size_t length = eot - frame;
+        start = eot - data + 1;
+
+        if(length > 0 && frame[0] == SOH)
+        {
+            frame++;
+            length--;
+        }
+
+        if(length >= 5 && memcmp(frame, "Error", 5) == 0)
+            result.errorReplies++;
+
+        if(length < 10 || memcmp(frame, "KEEPALIVE,", 10) != 0 || s->pending.empty())
+            continue;
+
+        PendingStep done = s->pending.front();
+        s->pending.pop_front();
+        waiting--;
+
+        uint64_t latency = now > done.start ? now - done.start : 0;
+        result.all.record(latency);
+        result.perCommand[done.step->name].record(latency);
+        result.lastReply = now;
+
+        if(cfg.speed == 0 && s->pending.empty() && s->loop < cfg.loops)
+            sendStep(s, now);
+    }
+
+    s->input.erase(s->input.begin(), s->input.begin() + start);
+}
+
+void ReplayThread::run(uint64_t start)
+{
+    typedef std::pair<uint64_t, Session *> Due;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due;
+    IoEvent events[MAX_EVENTS];
+    uint64_t lastSend = 0;
+
+    origin = start;
+
+    // Every thread starts at the same moment
+    uint64_t now = nowNs();
+    if(now < start)
+        usleep((start - now) / 1000);
+
+    for(Session *s : sessions)
+    {
+        if(s->sock < 0)
+            continue;
+        if(cfg.speed == 0)
+        {
+            sendStep(s, start);
+            flush(s);
+        }
+        else
+        {
+            due.push(Due(dueTime(s), s));
+        }
+    }
+
+    for(;;)
+    {
+        now = nowNs();
+
+        // Send every step whose time has come
+        while(!due.empty() && due.top().first <= now)
+        {
+            Session *s = due.top().second;
+            uint64_t at = due.top().first;
+            due.pop();
+
+            if(s->sock < 0)
+                continue;
+
+            sendStep(s, at);
+            if(s->loop < cfg.loops)
+                due.push(Due(dueTime(s), s));
+            flush(s);
+        }
+
+        // Once everything is sent, stop as soon as every reply is in
+        if(stepsLeft > 0)
+            lastSend = now;
+        else if(waiting == 0 || now - lastSend >= (uint64_t)(DRAIN_TIMEOUT * 1e9))
+            break;
+
+        int timeout = 100;
+        if(!due.empty())
+            timeout = std::min<uint64_t>(timeout, (due.top().first - now + 999999) / 1000000);
+
+        int n = backend->wait(events, MAX_EVENTS, timeout);
+        if(n < 0)
+            break;
+
+        now = nowNs();
+        for(int i = 0; i < n; i++)
+        {
+            Session *s = (Session *)events[i].data;
+
+            if(s->sock >= 0 && (events[i].events & (EV_READ | EV_ERROR)))
+                receive(s, now);
+            if(s->sock >= 0)
+                flush(s);
+        }
+    }
+}
+
+// Allow enough open files for the connections asked for
+static void raiseFileLimit(int connections)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return;
+
+    rlim_t needed = connections + 64;
+    if(limit.rlim_cur >= needed)
+        return;
+
+    limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > needed)
+                     ? needed : limit.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < needed)
+        printf("Warning: open file limit %lu is below %lu\n",
+               (unsigned long)limit.rlim_cur, (unsigned long)needed);
+}
+
+static void printRow(FILE *out, const char *name, const Histogram& h)
+{
+    fprintf(out, "%-16s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long)h.count(),
+            h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+            h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+            h.max() / 1000.0);
+}
+
+static void jsonLatency(FILE *out, const Histogram& h)
+{
+    fprintf(out, "{\"count\": %llu, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+            "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+            (unsigned long long)h.count(), h.mean() / 1000.0,
+            h.percentile(50) / 1000.0, h.percentile(90) / 1000.0,
+            h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+            h.max() / 1000.0);
+}
+
+// Command names come from the recording, so keep them valid JSON
+static void jsonString(FILE *out, const std::string& text)
+{
+    fputc('"', out);
+    for(unsigned char c : text)
+    {
+        if(c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if(c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void usage()
+{
+    printf("Usage: replay [options] <recording> <ip> <port>\n");
+    printf("  <recording>      pcap capture, or log written by the server\n");
+    printf("  -x speed         play at speed times the recorded pace (default %.0f)\n", DEFAULT_SPEED);
+    printf("  -f               flat out: send each command when the last is answered\n");
+    printf("  -c copies        concurrent copies of each recorded session (default %d)\n", DEFAULT_COPIES);
+    printf("  -t threads       threads driving the connections (default %d)\n", DEFAULT_THREADS);
+    printf("  -n loops         times to play the recording (default %d)\n", DEFAULT_LOOPS);
+    printf("  -g seconds       shorten recorded pauses longer than this\n");
+    printf("  -P port          server port in the capture (default %d)\n", CAPTURE_PORT);
+    printf("  -j file          write results as JSON to file (- for stdout)\n");
+    exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+    ReplayConfig cfg;
+    int opt;
+
+    cfg.speed       = DEFAULT_SPEED;
+    cfg.copies      = DEFAULT_COPIES;
+    cfg.threads     = DEFAULT_THREADS;
+    cfg.loops       = DEFAULT_LOOPS;
+    cfg.maxGap      = 0;
+    cfg.capturePort = CAPTURE_PORT;
+    cfg.jsonPath    = NULL;
+
+    bool flatOut = false;
+
+    while((opt = getopt(argc, argv, "x:fc:t:n:g:P:j:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'x': cfg.speed       = atof(optarg); break;
+            case 'f': flatOut         = true;         break;
+            case 'c': cfg.copies      = atoi(optarg); break;
+            case 't': cfg.threads     = atoi(optarg); break;
+            case 'n': cfg.loops       = atoi(optarg); break;
+            case 'g': cfg.maxGap      = atof(optarg); break;
+            case 'P': cfg.capturePort = atoi(optarg); break;
+            case 'j': cfg.jsonPath    = optarg;       break;
+            default:
+                usage();
+        }
+    }
+
+    if(argc - optind != 3 || cfg.speed <= 0 || cfg.copies < 1 || cfg.threads < 1 ||
+       cfg.loops < 1 || cfg.maxGap < 0 || cfg.capturePort < 1 || cfg.capturePort > 65535)
+    {
+        usage();
+    }
+
+    if(flatOut)
+        cfg.speed = 0;
+
+    Recording recording;
+    if(!loadRecording(argv[optind], cfg, recording))
+        exit(0);
+
+    struct addrinfo hints, *svr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;            // IPv4 only addresses
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &svr) != 0)
+    {
+        printf("Unable to resolve %s\n", argv[optind + 1]);
+        exit(0);
+    }
+    memcpy(&cfg.server, svr->ai_addr, sizeof(cfg.server));
+    freeaddrinfo(svr);
+
+    size_t commands = 0;
+    for(const Script& script : recording.sessions)
+        commands += script.size();
+
+    int connections = recording.sessions.size() * cfg.copies;
+    if(cfg.threads > connections)
+        cfg.threads = connections;
+
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit(connections);
+
+    // Deal the copies out to the threads, and connect them all before the
+    // clock starts
+    std::vector<ReplayThread *> threads;
+    for(int i = 0; i < cfg.threads; i++)
+        threads.push_back(new ReplayThread(cfg, recording));
+
+    int next = 0;
+    for(int copy = 0; copy < cfg.copies; copy++)
+    {
+        for(const Script& script : recording.sessions)
+            threads[next++ % cfg.threads]->addSession(&script);
+    }
+
+    std::vector<std::thread> connecting;
+    for(ReplayThread *t : threads)
+        connecting.emplace_back(&ReplayThread::connectAll, t);
+    for(auto& c : connecting)
+        c.join();
+
+    int connected = 0;
+    uint64_t connectErrors = 0;
+    for(ReplayThread *t : threads)
+        connectErrors += t->result.connectErrors;
+    connected = connections - connectErrors;
+
+    if(connected == 0)
+    {
+        printf("No connections could be made\n");
+        exit(0);
+    }
+
+    uint64_t start = nowNs() + 10000000;    // give every thread time to start
+    std::vector<std::thread> running;
+    for(ReplayThread *t : threads)
+        running.emplace_back(&ReplayThread::run, t, start);
+    for(auto& r : running)
+        r.join();
+
+    // Combine the threads' results
+    ThreadResult total;
+    for(ReplayThread *t : threads)
+    {
+        total.all.merge(t->result.all);
+        for(const auto& entry : t->result.perCommand)
+            total.perCommand[entry.first].merge(entry.second);
+        total.errorReplies  += t->result.errorReplies;
+        total.lost          += t->result.lost;
+        total.bytesSent     += t->result.bytesSent;
+        total.bytesReceived += t->result.bytesReceived;
+        total.sent          += t->result.sent;
+        total.lastReply      = std::max(total.lastReply, t->result.lastReply);
+        delete t;
+    }
+
+    double seconds = total.lastReply > start ? (total.lastReply - start) / 1e9 : 0;
+    double perSecond = seconds > 0 ? total.all.count() / seconds : 0;
+
+    printf("Recording:   %s, %zu session%s, %zu commands over %.1fs\n",
+           recording.format, recording.sessions.size(),
+           recording.sessions.size() > 1 ? "s" : "", commands, recording.span / 1e9);
+    if(cfg.speed == 0)
+        printf("Replay:      flat out");
+    else
+        printf("Replay:      %gx speed", cfg.speed);
+    printf(", %d cop%s, %d loop%s\n", cfg.copies, cfg.copies > 1 ? "ies" : "y",
+           cfg.loops, cfg.loops > 1 ? "s" : "");
+    printf("Connections: %d of %d (%d thread%s), %llu failed, %llu lost\n",
+           connected, connections, cfg.threads, cfg.threads > 1 ? "s" : "",
+           (unsigned long long)connectErrors, (unsigned long long)total.lost);
+    printf("Commands:    %llu sent, %llu answered in %.2fs (%.0f/s), %llu error replies\n",
+           (unsigned long long)total.sent, (unsigned long long)total.all.count(),
+           seconds, perSecond, (unsigned long long)total.errorReplies);
+    printf("Traffic:     %.1f MB sent, %.1f MB received\n\n",
+           total.bytesSent / 1e6, total.bytesReceived / 1e6);
+
+    printf("%-16s %10s %10s %10s %10s %10s %10s\n",
+           "latency(us)", "count", "p50", "p90", "p99", "p99.9", "max");
+    printRow(stdout, "all", total.all);
+    for(const auto& entry : total.perCommand)
+        printRow(stdout, entry.first.c_str(), entry.second);
+
+    if(cfg.jsonPath != NULL)
+    {
+        FILE *out = (strcmp(cfg.jsonPath, "-") == 0) ? stdout : fopen(cfg.jsonPath, "w");
+        if(out == NULL)
+        {
+            perror("Unable to open JSON output");
+            exit(0);
+        }
+
+        fprintf(out, "{\"recording\": ");
+        jsonString(out, argv[optind]);
+        fprintf(out, ", \"format\": \"%s\", \"sessions\": %zu, \"commands\": %zu, "
+                "\"span_s\": %.3f,\n", recording.format, recording.sessions.size(),
+                commands, recording.span / 1e9);
+        fprintf(out, " \"speed\": %g, \"copies\": %d, \"loops\": %d, \"threads\": %d, "
+                "\"connections\": %d, \"connect_errors\": %llu, \"lost\": %llu,\n",
+                cfg.speed, cfg.copies, cfg.loops, cfg.threads, connected,
+                (unsigned long long)connectErrors, (unsigned long long)total.lost);
+        fprintf(out, " \"sent\": %llu, \"answered\": %llu, \"duration_s\": %.3f, "
+                "\"commands_per_sec\": %.1f, \"error_replies\": %llu, "
+                "\"bytes_sent\": %llu, \"bytes_received\": %llu,\n",
+                (unsigned long long)total.sent, (unsigned long long)total.all.count(),
+                seconds, perSecond, (unsigned long long)total.errorReplies,
+                (unsigned long long)total.bytesSent, (unsigned long long)total.bytesReceived);
+        fprintf(out, " \"latency_us\": ");
+        jsonLatency(out, total.all);
+        fprintf(out, ",\n \"commands_by_name\": {");
+
+        bool first = true;
+        for(const auto& entry : total.perCommand)
+        {
+            fprintf(out, "%s\n  ", first ? "" : ",");
+            jsonString(out, entry.first);
+            fprintf(out, ": ");
+            jsonLatency(out, entry.second);
+            first = false;
+        }
+        fprintf(out, "}}\n");
+
+        if(out != stdout)
+            fclose(out);
+    }
+
+    return 0;
+}
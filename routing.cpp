@@ -0,0 +1,222 @@
+//
+// Routing table: where to send messages for groups on other servers.
+//
+#include <algorithm>
+#include <mutex>
+
+#include "routing.h"
+
+// Remove value from a short list, if it is in it
+template <typename T>
+static void eraseValue(std::vector<T>& list, T value)
+{
+    auto it = std::find(list.begin(), list.end(), value);
+    if(it != list.end())
+        list.erase(it);
+}
+
+// The node for group, created if need be. NO_NODE if the table is full.
+uint32_t RouteTable::intern(std::string_view group)
+{
+    auto it = index.find(group);
+    if(it != index.end())
+        return it->second;
+
+    uint32_t node;
+
+    if(!freeNodes.empty())
+    {
+        node = freeNodes.back();
+        freeNodes.pop_back();
+    }
+    else if(nodes.size() < ROUTE_MAX_NODES)
+    {
+        node = nodes.size();
+        nodes.emplace_back();
+    }
+    else
+    {
+        return NO_NODE;
+    }
+
+    Node& n = nodes[node];
+    n.name.assign(group.data(), group.size());
+    n.hops = 0;
+    index.emplace(std::string_view(n.name), node);
+    return node;
+}
+
+// Pick a node's next hop again after its lists of links changed, and free
+// it if nothing leads to it any more
+void RouteTable::settle(uint32_t node)
+{
+    Node& n = nodes[node];
+    int hops = 0;
+
+    if(!n.direct.empty())
+    {
+        n.hop = linkTable[n.direct.front()].hop;
+        hops  = 1;
+    }
+    else if(!n.via.empty())
+    {
+        n.hop = linkTable[n.via.front()].hop;
+        hops  = 2;
+    }
+
+    if(n.hops == 0 && hops > 0)
+        reachable++;
+    else if(n.hops > 0 && hops == 0)
+        reachable--;
+    n.hops = hops;
+
+    if(hops == 0)
+    {
+        index.erase(std::string_view(n.name));
+        n.name.clear();
+        n.name.shrink_to_fit();
+        freeNodes.push_back(node);
+    }
+}
+
+RouteTable::Link& RouteTable::linkFor(const NextHop& hop)
+{
+    auto it = linkTable.find(hop.id);
+    if(it == linkTable.end())
+        it = linkTable.emplace(hop.id, Link { hop, NO_NODE, std::vector<uint32_t>() }).first;
+    return it->second;
+}
+
+bool RouteTable::addPeer(std::string_view group, const NextHop& hop)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+
+    // A second connection claiming to be a group's own server
+    auto named = index.find(group);
+    if(named != index.end() && !nodes[named->second].direct.empty() &&
+       nodes[named->second].direct[0] != hop.id)
+        return false;
+
+    Link& link = linkFor(hop);
+
+    if(link.node != NO_NODE)
+    {
+        if(nodes[link.node].name == group)
+            return true;
+
+        uint32_t old = link.node;
+        link.node = NO_NODE;
+        eraseValue(nodes[old].direct, hop.id);
+        settle(old);
+    }
+
+    uint32_t node = intern(group);
+    if(node == NO_NODE)
+        return false;
+
+    link.node = node;
+    nodes[node].direct.push_back(hop.id);
+    settle(node);
+    return true;
+}
+
+void RouteTable::advertise(const NextHop& hop, const std::vector<std::string_view>& groups)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+    Link& link = linkFor(hop);
+    std::vector<uint32_t> fresh;
+
+    fresh.reserve(std::min(groups.size(), (size_t)ROUTE_MAX_ADVERTISED));
+    for(std::string_view group : groups)
+    {
+        if(fresh.size() >= ROUTE_MAX_ADVERTISED)
+            break;
+
+        uint32_t node = intern(group);
+        if(node != NO_NODE && node != link.node)
+            fresh.push_back(node);
+    }
+    std::sort(fresh.begin(), fresh.end());
+    fresh.erase(std::unique(fresh.begin(), fresh.end()), fresh.end());
+
+    // Walk the old and new lists together, touching only what changed
+    std::vector<uint32_t>& old = link.advertised;
+    size_t i = 0, j = 0;
+
+    while(i < old.size() || j < fresh.size())
+    {
+        if(j == fresh.size() || (i < old.size() && old[i] < fresh[j]))
+        {
+            eraseValue(nodes[old[i]].via, hop.id);
+            settle(old[i]);
+            i++;
+        }
+        else if(i == old.size() || fresh[j] < old[i])
+        {
+            nodes[fresh[j]].via.push_back(hop.id);
+            settle(fresh[j]);
+            j++;
+        }
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+
+    link.advertised.swap(fresh);
+}
+
+void RouteTable::removePeer(int id)
+{
+    std::unique_lock<std::shared_mutex> guard(lock);
+
+    auto it = linkTable.find(id);
+    if(it == linkTable.end())
+        return;
+
+    // Off the table first, so no node settles on it again
+    Link link = std::move(it->second);
+    linkTable.erase(it);
+
+    if(link.node != NO_NODE)
+    {
+        eraseValue(nodes[link.node].direct, id);
+        settle(link.node);
+    }
+    for(uint32_t node : link.advertised)
+    {
+        eraseValue(nodes[node].via, id);
+        settle(node);
+    }
+}
+
+bool RouteTable::lookup(std::string_view group, NextHop *hop, int *hops) const
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+
+    auto it = index.find(group);
+    if(it == index.end())
+        return false;
+
+    const Node& n = nodes[it->second];
+    if(n.hops == 0)
+        return false;
+
+    *hop = n.hop;
+    if(hops != NULL)
+        *hops = n.hops;
+    return true;
+}
+
+size_t RouteTable::size() const
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return reachable;
+}
+
+size_t RouteTable::links() const
+{
+    std::shared_lock<std::shared_mutex> guard(lock);
+    return linkTable.size();
+}
@@ -0,0 +1,107 @@
+//
+// Routing table: where to send messages for groups on other servers.
+//
+// Every connection to another server is a link. A link has a name once the
+// server on it has told us its group ID (HELO from a server that connected
+// to us, or the first entry of the SERVERS reply to our HELO). The rest of
+// a SERVERS reply lists the servers it is connected to in turn, which the
+// link advertises as reachable through it.
+//
+// Each group known either way is a node with a hop count: 1 if a link to
+// its own server is up, 2 if it is only reachable through a server that
+// advertises it. Messages for it go to the first of the links at the best
+// distance. SERVERS replies don't carry distances of their own, so nothing
+// further away than 2 hops is known.
+//
+// Changes are incremental: a link coming up, going down or sending a new
+// SERVERS list only touches the nodes it names or used to name, and each
+// of those picks its next hop again from its own short list of links.
+//
+// Group IDs are interned once into nodes, which the lookup index refers to
+// without copying the name, so looking up a route is one hash probe and
+// never allocates. The table is bounded: at most ROUTE_MAX_NODES groups,
+// and ROUTE_MAX_ADVERTISED listed per link. Nodes no link names or
+// advertises any more are freed for reuse.
+//
+// The table is shared by all workers. SENDMSG looks routes up for every
+// message, so lookups only take a shared lock.
+//
+#ifndef TSAM_ROUTING_H
+#define TSAM_ROUTING_H
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <shared_mutex>
+
+#define ROUTE_MAX_NODES      16384   // Groups the table will hold
+#define ROUTE_MAX_ADVERTISED 1024    // Groups taken from one SERVERS reply
+
+// The connection to send a group's messages over
+struct NextHop {
+    int worker;              // index of the worker holding the connection
+    int sock;                // its socket in that worker
+    int id;                  // connection ID, since socket numbers are reused
+};
+
+class RouteTable {
+public:
+    RouteTable() : reachable(0) {}
+
+    // The server for group is connected through hop. Replaces any earlier
+    // name of the link. Returns false, changing nothing, if another link
+    // already names group or the table is full.
+    bool addPeer(std::string_view group, const NextHop& hop);
+
+    // The server on hop is connected to groups. Replaces the list from its
+    // previous SERVERS reply.
+    void advertise(const NextHop& hop, const std::vector<std::string_view>& groups);
+
+    // Connection id has closed; forget the link and what it advertised.
+    void removePeer(int id);
+
+    // Find the route for group, and how many hops away it is. Returns
+    // false if there is none.
+    bool lookup(std::string_view group, NextHop *hop, int *hops = NULL) const;
+
+    size_t size() const;                 // Groups with a route
+    size_t links() const;
+
+private:
+    RouteTable(const RouteTable&);
+    RouteTable& operator=(const RouteTable&);
+
+    // A group, and the links that lead to it
+    struct Node {
+        std::string name;
+        NextHop hop;                     // best route, if hops > 0
+        int hops;                        // 0 if unreachable
+        std::vector<int> direct;         // links to its own server
+        std::vector<int> via;            // links advertising it
+    };
+
+    // A connection to another server
+    struct Link {
+        NextHop hop;
+        uint32_t node;                   // its own group, or NO_NODE
+        std::vector<uint32_t> advertised;   // sorted
+    };
+
+    static const uint32_t NO_NODE = UINT32_MAX;
+
+    uint32_t intern(std::string_view group);
+    void settle(uint32_t node);
+    Link& linkFor(const NextHop& hop);
+
+    mutable std::shared_mutex lock;
+    std::deque<Node> nodes;              // never moved, so index keys stay valid
+    std::vector<uint32_t> freeNodes;
+    std::unordered_map<std::string_view, uint32_t> index;   // name -> node
+    std::unordered_map<int, Link> linkTable;                // connection id -> link
+    size_t reachable;                    // nodes with hops > 0
+};
+
+#endif
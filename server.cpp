@@ -13,72 +13,206 @@
 #include <algorithm>
 #include <map>
 #include <vector>
-#include <list>
 #include <iostream>
 #include <sstream>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
 #include <map>
 #include <chrono>
 #include <iomanip>
 #include <ctime>
 #include <unistd.h>
 #include <fstream>
+#include <string_view>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "eventloop.h"
+#include "recvbuffer.h"
+#include "outqueue.h"
+#include "command.h"
+#include "slab.h"
+#include "messagestore.h"
+#include "logger.h"
+#include "registry.h"
+#include "timerwheel.h"
+#include "ratelimit.h"
+#include "routing.h"
+#include "metrics.h"
+#include "trace.h"
+#include "server.h"
 
 // fix SOCK_NONBLOCK for OSX
 #ifndef SOCK_NONBLOCK
-#include <fcntl.h>
 #define SOCK_NONBLOCK O_NONBLOCK
 #endif
 
-#define BACKLOG  5          // Allowed length of queue of waiting connections
+#define MAX_EVENTS 256      // Ready sockets handled per event loop wakeup
+
+#define HOUSEKEEPING_INTERVAL 10   // Seconds between housekeeping runs
+#define FLOOD_TIMEOUT         10   // Seconds a connection may stay over its limits
+
+#define OUTPUT_HIGH_WATER (1024 * 1024)  // Stop reading from a client with this much unsent
+#define OUTPUT_LOW_WATER  (256 * 1024)   // ...and start again once it drains below this
 
-const char SOH = '\x01'; // Start of Header character
-const char EOT = '\x04'; // End of Transmission character
+#define DRAIN_STEP_MESSAGES 256          // Most messages a GETMSGS sends in one step
+#define DRAIN_STEP_BYTES    (64 * 1024)  // ...and bytes, before other clients get a turn
 
 
+struct Worker;
+
 // Simple class for handling connections from clients.
 // Client(int socket) - socket to send/receive traffic from client.
 class Client {
 public:
+    Worker *worker;                  // worker thread that owns the connection
     int sock;                        // socket of client connection
     std::string name;                // Client's user name
     struct sockaddr_in addr;         // Client's address information
     int id; 
-    Client(int socket, struct sockaddr_in address) : sock(socket), addr(address) {}
+    uint32_t interest;               // EV_* flags registered with the event backend
+    RecvBuffer input;                // Bytes received but not yet parsed into frames
+    OutQueue output;                 // Responses waiting to be sent
+    bool readPaused;                 // Reading stopped until output drains
+    Client *nextClosed;              // Next in the worker's list of closed clients
+    uint64_t lastActive;             // When data last arrived, ms
+    Timer idleTimer;                 // Closes the connection once idle too long
+    Timer keepAliveTimer;            // Sends our KEEPALIVE to peers that said HELO
+    TokenBucket commandBucket;       // Rate limits on what it sends us
+    TokenBucket byteBucket;
+    Timer throttleTimer;             // Resumes reading once it is within them again
+    bool throttled;                  // Reading stopped for going over a limit
+    uint64_t throttledSince;         // Over its limits without a break since, ms; 0 if not
+    DrainCursor drain;               // GETMSGS still being sent
+    Client *drainPrev;               // Neighbours in the worker's drain queue
+    Client *drainNext;
+    bool drainQueued;
+    bool outbound;                   // We connected to this server
+    bool connecting;                 // ...and the connection isn't up yet
+    bool routed;                     // Is a link in the routing table
+    bool flushQueued;                // Has forwarded messages waiting to be sent
+    Client *nextFlush;               // Next in the worker's list of those
+    Client(Worker *owner, int socket, struct sockaddr_in address)
+        : worker(owner), sock(socket), addr(address), interest(0), readPaused(false),
+          nextClosed(NULL), throttled(false), throttledSince(0), drainPrev(NULL), drainNext(NULL),
+          drainQueued(false), outbound(false), connecting(false), routed(false), flushQueued(false), nextFlush(NULL) {}
 
     ~Client() {}                     // Destructor for cleanup
 };
 
 struct sockaddr_in clientAddress;
 
-// Message struct to store messages for groups
-struct Message {
-    std::string fromGroupID;
-    std::string content;
+// Mailboxes of messages waiting for each group, shared by all workers.
+// When full, the oldest messages are dropped to make room for new ones.
+SharedMessageStore messageQueue(StoreLimits { MAX_GROUP_BYTES, MAX_GROUP_MESSAGES,
+                                              MAX_STORE_BYTES, MAX_STORE_GROUPS,
+                                              EVICT_OLDEST });
 
-    Message(const std::string& from, const std::string& msg) 
-        : fromGroupID(from), content(msg) {}
-};
+// Copy of the mailboxes on disk, if a spool directory is given
+MessageSpool spool;
+
+// Every connected server, across all workers, for the SERVERS responses
+ServerRegistry registry;
+
+std::atomic<int> serverIDcounter(1);    // Next ID to give a connecting server
 
-// Map to store messages for each group
-std::map<std::string, std::queue<Message>> messageQueue;
+// Timeouts from the command line, in ms; 0 turns the timer off
+uint64_t idleTimeoutMs       = IDLE_TIMEOUT * 1000;
+uint64_t keepAliveIntervalMs = KEEPALIVE_INTERVAL * 1000;
 
+// Limit on how fast one source address can open connections
+AddressLimiter acceptLimiter;
 
+// Limits on the commands and bytes each connection, and all connections
+// from one address, can send us
+RateLimit connCommandLimit = { CONN_COMMAND_RATE, CONN_COMMAND_BURST };
+RateLimit connByteLimit    = { CONN_BYTE_RATE, CONN_BYTE_BURST };
+AddressLimiter addrCommandLimiter;
+AddressLimiter addrByteLimiter;
 
-// Note: map is not necessarily the most efficient method to use here,
-// especially for a server with large numbers of simulataneous connections,
-// where performance is also expected to be an issue.
+// Where messages for groups on other servers go
+RouteTable routes;
+
+std::string serverGroup = SERVER_GROUP;   // Our own group ID
+
+// Outbound connections to other servers: those given on the command line
+// (kept up), and those learned from SERVERS replies (up to maxOutbound).
+// outboundPeers has the address of each one open or being opened.
+std::vector<struct sockaddr_in> seedPeers;
+size_t maxOutbound = MAX_OUTBOUND;
+std::mutex peerLock;
+std::unordered_set<uint64_t> outboundPeers;
+
+// Messages forwarded to a peer held by another worker
+struct Forward {
+    int sock;                       // The peer's connection
+    int id;
+    std::string frames;             // SENDMSG frames for it
+};
+
+// Metrics a worker keeps about itself (see metrics.h)
+struct WorkerMetrics {
+    Counter commands[COMMAND_SLOTS];        // Handled, by position in commandTable
+    LatencyRecorder commandTime[COMMAND_SLOTS];   // ...and ns spent in the handler
+    Counter unknownCommands;
+    Counter bytesReceived;
+    Counter bytesSent;
+    Counter accepted;               // Connections accepted
+    Counter refused;                // ...and refused by the rate limit
+    Counter throttled;              // Times a connection went over its limits
+    Counter flooded;                // ...and was closed for staying over them
+    Counter connections;            // Open now
+    LatencyRecorder loopTime;       // ns handling each batch of events
+};
+
+// Each worker thread runs its own event loop with its own listening
+// socket. The listening sockets share the port with SO_REUSEPORT, so
+// the kernel spreads new connections over the workers, and a connection
+// stays with the worker that accepted it for its whole life.
 //
-// Quite often a simple array can be used as a lookup table, 
-// (indexed on socket no.) sacrificing memory for speed.
+// A worker's clients are kept in a slab indexed on socket no., which
+// gives O(1) lookup and reuses the memory of closed connections. Only
+// the worker's own thread touches them.
+struct Worker {
+    int index;                      // Worker number, for logging
+    int listenSock;                 // This worker's listening socket
+    EventBackend *backend;          // Event engine watching its sockets
+    FdSlab<Client> clients;         // Lookup table for per Client information
+    Client *closed;                 // Closed during this batch of events
+    Client *drainHead;              // Clients with a GETMSGS waiting for its next step
+    Client *drainTail;
+    Client *flushHead;              // Peers with forwarded messages to send
+    int wakeRead;                   // Pipe other workers wake us through
+    int wakeWrite;
+    std::mutex inboxLock;
+    std::vector<Forward> inbox;     // Forwarded to our peers by other workers
+    std::vector<std::vector<Forward>> outbox;   // For other workers' peers, by worker
+    TimerWheel *timers;             // Idle, KEEPALIVE and housekeeping timers
+    Timer housekeeping;
+    uint64_t now;                   // Time the current batch of events started, ms
+    int spareFd;                    // Held in reserve for when we run out of fds
+    WorkerMetrics metrics;
+    std::thread thread;
+};
 
-std::map<int, Client*> clients; // Lookup table for per Client information
+Worker *workerPool;                 // Every worker, for handing work between them
+std::atomic<int> workerPoolSize(0); // Read by signal handlers and the metrics thread
+std::atomic<bool> stopRequested(false);   // Workers finish once this is set
+
+// Defined with the event loop below
+void flushClient(Client *client);
+bool connectPeer(Worker *worker, const struct sockaddr_in& addr, bool seed);
+void connectSeeds(Worker *worker);
 
 // Open socket for specified port.
 //
 // Returns -1 if unable to create the socket for any reason.
 
-int open_socket(int portno)
+// reusePort lets several sockets (one per worker) bind the same port.
+
+int open_socket(int portno, bool reusePort)
 {
    struct sockaddr_in sk_addr;   // address settings for bind()
    int sock;                     // socket opened for this port
@@ -89,13 +223,13 @@ int open_socket(int portno)
 #ifdef __APPLE__     
    if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
    {
-      perror("Failed to open socket");
+      logError("Failed to open socket");
       return(-1);
    }
 #else
    if((sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
    {
-     perror("Failed to open socket");
+     logError("Failed to open socket");
     return(-1);
    }
 #endif
@@ -105,13 +239,24 @@ int open_socket(int portno)
 
    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &set, sizeof(set)) < 0)
    {
-      perror("Failed to set SO_REUSEADDR:");
+      logError("Failed to set SO_REUSEADDR");
+   }
+
+   // Turn on SO_REUSEPORT so every worker can listen on the port
+   // itself; the kernel balances incoming connections between them.
+
+   set = 1;
+   if(reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &set, sizeof(set)) < 0)
+   {
+      logError("Failed to set SO_REUSEPORT");
+      close(sock);
+      return(-1);
    }
    set = 1;
 #ifdef __APPLE__     
    if(setsockopt(sock, SOL_SOCKET, SOCK_NONBLOCK, &set, sizeof(set)) < 0)
    {
-     perror("Failed to set SOCK_NOBBLOCK");
+     logError("Failed to set SOCK_NOBBLOCK");
    }
 #endif
    memset(&sk_addr, 0, sizeof(sk_addr));
@@ -124,7 +269,7 @@ int open_socket(int portno)
 
    if(bind(sock, (struct sockaddr *)&sk_addr, sizeof(sk_addr)) < 0)
    {
-      perror("Failed to bind to socket:");
+      logError("Failed to bind to socket");
       return(-1);
    }
    else
@@ -134,103 +279,153 @@ int open_socket(int portno)
 }
 
 
-// Close a client's connection, remove it from the client list, and
-// tidy up select sockets afterwards.
-void closeClient(int clientSocket, fd_set *openSockets, int *maxfds)
+// Key for a server's address in outboundPeers
+uint64_t peerKey(const struct sockaddr_in& addr)
 {
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+// Reserve addr for an outbound connection. Fails if there already is one
+// to it, or if it was learned (not a seed) and we have enough of those.
+bool claimPeer(const struct sockaddr_in& addr, bool seed)
+{
+    std::lock_guard<std::mutex> guard(peerLock);
+
+    if(!seed && outboundPeers.size() >= maxOutbound + seedPeers.size())
+        return false;
+    return outboundPeers.insert(peerKey(addr)).second;
+}
 
-     printf("Client closed connection: %d\n", clientSocket);
+void releasePeer(const struct sockaddr_in& addr)
+{
+    std::lock_guard<std::mutex> guard(peerLock);
+    outboundPeers.erase(peerKey(addr));
+}
 
-     // If this client's socket is maxfds then the next lowest
-     // one has to be determined. Socket fd's can be reused by the Kernel,
-     // so there aren't any nice ways to do this.
+// Add a client to the end of its worker's drain queue, if not already in it
+void queueDrain(Client *client)
+{
+    Worker *worker = client->worker;
+
+    if(client->drainQueued)
+        return;
+
+    client->drainPrev = worker->drainTail;
+    client->drainNext = NULL;
+    if(worker->drainTail != NULL)
+        worker->drainTail->drainNext = client;
+    else
+        worker->drainHead = client;
+    worker->drainTail = client;
+    client->drainQueued = true;
+}
 
-     close(clientSocket);      
+// Take a client out of its worker's drain queue, if it is in it
+void unqueueDrain(Client *client)
+{
+    Worker *worker = client->worker;
+
+    if(!client->drainQueued)
+        return;
+
+    if(client->drainPrev != NULL)
+        client->drainPrev->drainNext = client->drainNext;
+    else
+        worker->drainHead = client->drainNext;
+    if(client->drainNext != NULL)
+        client->drainNext->drainPrev = client->drainPrev;
+    else
+        worker->drainTail = client->drainPrev;
+    client->drainQueued = false;
+}
 
-     if(*maxfds == clientSocket)
+// Close a client's connection and remove it from the client list.
+// The Client object itself is released by the event loop once the
+// current batch of events has been handled, since later events in the
+// batch may still point at it. Everything here is constant time.
+void closeClient(Client *client)
+{
+     if(client->sock < 0)
      {
-        for(auto const& p : clients)
-        {
-            *maxfds = std::max(*maxfds, p.second->sock);
-        }
+         return;                // already closed earlier in this batch
      }
 
-     // And remove from the list of open sockets.
+     logMessage(LOG_INFO, "Client closed connection: %d", client->sock);
 
-     FD_CLR(clientSocket, openSockets);
+     // Stop monitoring the socket before closing it, then drop it
+     // from the list of clients.
 
-}
+     Worker *worker = client->worker;
 
-// Store a message in the message queue for a group
-void storeMessage(const std::string& toGroupID, const std::string& fromGroupID, const std::string& content) {
-    Message newMessage(fromGroupID, content);
-    messageQueue[toGroupID].push(newMessage);
-    std::cout << "Stored message for group " << toGroupID << ": " << content << std::endl;
-}
+     worker->backend->closing(client->sock);
+     close(client->sock);
 
-// Get all messages for a group from the message queue
-std::vector<Message> getMessages(const std::string& groupID) {
-    std::vector<Message> messages;
+     worker->timers->cancel(&client->idleTimer);
+     worker->timers->cancel(&client->keepAliveTimer);
+     worker->timers->cancel(&client->throttleTimer);
+     unqueueDrain(client);
 
-    // Check if the group has any messages in the queue and add them to the messages vector
-    if(messageQueue.find(groupID) != messageQueue.end()) {
-        while(!messageQueue[groupID].empty()) {
-            messages.push_back(messageQueue[groupID].front());
-            messageQueue[groupID].pop();
-        }
-    }
-    return messages;
+     worker->clients.unlink(client->sock);
+     registry.remove(client->id);
+     if(client->routed)
+         routes.removePeer(client->id);
+     if(client->outbound)
+         releasePeer(client->addr);
+     client->sock = -1;
+
+     // Queue it for release at the end of the batch
+     client->nextClosed = worker->closed;
+     worker->closed = client;
 }
 
-// Get the number of messages in the message queue for a group
-int getMessageCount(const std::string& groupID) {
-    if(messageQueue.find(groupID) != messageQueue.end()) {
-        return messageQueue[groupID].size();
+// Put a socket into non-blocking mode.
+//
+// Returns -1 if the flags could not be changed.
+int setNonBlocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    if(flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        logError("Failed to set O_NONBLOCK");
+        return(-1);
     }
-    return 0;
+    return(0);
 }
 
-// Get the current timestamp in the format "YYYY-MM-DD HH:MM:SS"
-std::string getTimestamp() {
-    auto now = std::chrono::system_clock::now();
-    std::time_t now_time = std::chrono::system_clock::to_time_t(now);
-
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&now_time), "%Y-%m-%d %H:%M:%S");
-    return ss.str();
+// Store a message in the message queue for a group.
+// Returns false if the store refused it.
+bool storeMessage(std::string_view toGroupID, std::string_view fromGroupID, std::string_view content) {
+    TRACE_SPAN("storeMessage");
+    if(!messageQueue.store(toGroupID, fromGroupID, content)) {
+        logMessage(LOG_WARN, "Message store refused message for group %.*s",
+                   (int)toGroupID.size(), toGroupID.data());
+        return false;
+    }
+    logMessage(LOG_DEBUG, "Stored message for group %.*s: %.*s",
+               (int)toGroupID.size(), toGroupID.data(), (int)content.size(), content.data());
+    return true;
 }
 
-// Get the log file stream for writing log messages
-std::ofstream& getLogFileStream() {
-    static std::ofstream logFile("server_log.txt", std::ios_base::app); // Appends to log file
-    return logFile;
+// Get the number of messages in the message queue for a group
+int getMessageCount(std::string_view groupID) {
+    return messageQueue.count(groupID);
 }
 
-// Log the command received from a client
-void logCommand(int clientSocket, const std::string& command) {
-    std::string timestamp = getTimestamp();
-    
-    // Prepare the log message
-    std::string logMessage = "[" + timestamp + "] Client " + std::to_string(clientSocket) + ": " + command;
+// Get the current timestamp in the format "YYYY-MM-DD HH:MM:SS"
+std::string getTimestamp() {
+    char timestamp[20];
 
-    // Output to console
-    std::cout << logMessage << std::endl;
-    
-    // Output to log file
-    std::ofstream& logFile = getLogFileStream();
-    if (logFile.is_open()) {
-        logFile << logMessage << std::endl;
-    } else {
-        std::cerr << "Error: Unable to open log file for writing." << std::endl;
-    }
+    formatTimestamp(time(NULL), timestamp);
+    return timestamp;
 }
 
-// Close the log file stream
-void closeLogFile() {
-    std::ofstream& logFile = getLogFileStream();
-    if (logFile.is_open()) {
-        logFile.close();
-    }
+// Log the command received from a client, to the console and to the
+// log file. The logger's writer thread does the actual I/O.
+void logCommand(int clientSocket, std::string_view command) {
+    TRACE_SPAN("logCommand");
+    logTo(LOG_CONSOLE | LOG_FILE, LOG_INFO, "Client %d: %.*s",
+          clientSocket, (int)command.size(), command.data());
 }
 
 // Join a vector of strings into a single string
@@ -259,121 +454,344 @@ std::string constructCommand(const std::string& command, const std::vector<std::
 
 
 
-// Process command from client on the server
-void clientCommand(int clientSocket, fd_set *openSockets, int *maxfds, 
-                  char *buffer) 
-{
-  if (buffer[0] != SOH || buffer[strlen(buffer) - 1] != EOT) {
-      std::cerr << "Invalid command format: missing SOH or EOT." << std::endl;
-      return; // Exit if the format is incorrect
-  }  
-  
-  std::cout << "Received buffer from client: " << buffer << std::endl;
-  
-  
-
-  // Create a string from the buffer and remove SOH and EOT
-  std::string command(buffer + 1, strlen(buffer) - 2); // Exclude SOH and EOT
-  std::vector<std::string> tokens;
-  std::string token;  
-
-
-
-  // Split command into tokens for parsing
-  std::stringstream stream(command);
-  while (std::getline(stream, token, ',')) {
-      tokens.push_back(token); // Split by comma
-  }
-
-  std::cout << "Command: " << tokens[0] << std::endl;
-  std::cout << "Token size: " << tokens.size() << std::endl;
-
-  // Log command
-  logCommand(clientSocket, buffer);
-
-
-  // Close the socket
-  if (tokens[0].compare("LEAVE") == 0)
-  {
-      // Close the socket, and leave the socket handling
-      // code to deal with tidying up clients etc. when
-      // select() detects the OS has torn down the connection.
- 
-      closeClient(clientSocket, openSockets, maxfds);
-  }
- 
-
-  // First message sent by server after it connects
-  else if(tokens[0].compare("HELO") == 0 && tokens.size() == 2)
-  {
-    // Check if the client exists
-    auto it = clients.find(clientSocket);
-    if (it != clients.end()) {
-        // Client found, get the client info
-        Client* client = it->second;
-
-        std::string response = "SERVERS,";
-        
-        // Add the server sending the command first
-        response += "A5_" + std::to_string(client->id) + "," +  // Include ID of this server with underscore
-                    inet_ntoa(client->addr.sin_addr) + "," + 
-                    std::to_string(ntohs(client->addr.sin_port)); // Port needs to be converted
-
-        // Append additional 1-hop server connections
-        bool first = true; // To handle the first entry differently
-        for (auto const& pair : clients)
-        {
-            if (pair.second->sock != client->sock) // Don't include the calling client
-            {
-                if (!first)
-                {
-                    response += ";"; 
-                }
-                first = false;
+// Queue a response for a client, framed with SOH and EOT. It is sent
+// when the event loop next flushes the client's output queue.
+void sendResponse(Client *client, std::string_view response)
+{
+    if(client->sock < 0)
+        return;
 
-                response += "A5_" + std::to_string(pair.second->id) + "," +  // Use underscore
-                            inet_ntoa(pair.second->addr.sin_addr) + "," + 
-                            std::to_string(ntohs(pair.second->addr.sin_port)); // Convert port
-            }
+    client->output.append(&SOH, 1);
+    client->output.append(response.data(), response.length());
+    client->output.append(&EOT, 1);
+}
+
+
+
+// Queue stored messages for a client. The store keeps them already framed
+// as "From <group>: <content>", so they are sent straight from its buffer.
+void sendStoredMessages(Client *client, const SharedBuffer& frames, size_t offset, size_t length)
+{
+    if(client->sock < 0)
+        return;
+
+    client->output.append(frames, offset, length);
+}
+
+// Frame "SENDMSG,<to>,<from>,<content>" onto the end of out (a string or
+// an OutQueue)
+template <typename Out>
+void frameSendMsg(Out& out, std::string_view to, std::string_view from, std::string_view content)
+{
+    out.append(&SOH, 1);
+    out.append("SENDMSG,", 8);
+    out.append(to.data(), to.size());
+    out.append(",", 1);
+    out.append(from.data(), from.size());
+    out.append(",", 1);
+    out.append(content.data(), content.size());
+    out.append(&EOT, 1);
+}
+
+// Store the messages in a run of SENDMSG frames here, for ones that
+// couldn't be forwarded after all
+void storeFrames(std::string_view frames)
+{
+    CommandTokens tokens;
+
+    while(!frames.empty())
+    {
+        size_t end = frames.find(EOT);
+        std::string_view frame = frames.substr(1, end - 1);
+
+        if(tokens.parse(frame) >= 4)
+            storeMessage(tokens[1], tokens[2], tokens.rest(3));
+        frames.remove_prefix(end + 1);
+    }
+}
+
+// Have a peer's queued output sent once the current batch of events is
+// done, so everything forwarded to it in the batch goes out together
+void queueFlush(Client *peer)
+{
+    if(peer->flushQueued)
+        return;
+
+    peer->flushQueued = true;
+    peer->nextFlush = peer->worker->flushHead;
+    peer->worker->flushHead = peer;
+}
+
+void flushForwarded(Worker *worker)
+{
+    TRACE_SPAN("flushForwarded");
+    while(worker->flushHead != NULL)
+    {
+        Client *peer = worker->flushHead;
+        worker->flushHead = peer->nextFlush;
+        peer->flushQueued = false;
+        flushClient(peer);
+    }
+}
+
+// Send a message on towards the server for its group, if we know a
+// route there. Returns false if it should be stored here instead.
+//
+// Messages from other servers only go on to the group's own server, not
+// through a second one, so a message never takes more than two hops
+// whatever state the routing tables are in.
+//
+// A peer served by this worker gets it on its output queue straight
+// away. One served by another worker gets it in a batch handed over
+// at the end of this batch of events (see postForwards()).
+bool forwardMessage(Client *sender, std::string_view to, std::string_view from,
+                    std::string_view content)
+{
+    Worker *worker = sender->worker;
+    NextHop hop;
+    int hops;
+
+    if(to == serverGroup || !routes.lookup(to, &hop, &hops) || hop.id == sender->id ||
+       (hops > 1 && !sender->name.empty()))
+        return false;
+
+    if(hop.worker == worker->index)
+    {
+        Client *peer = worker->clients.find(hop.sock);
+        if(peer == NULL || peer->id != hop.id)
+            return false;
+
+        frameSendMsg(peer->output, to, from, content);
+        queueFlush(peer);
+    }
+    else
+    {
+        std::vector<Forward>& box = worker->outbox[hop.worker];
+
+        if(box.empty() || box.back().sock != hop.sock || box.back().id != hop.id)
+            box.push_back(Forward { hop.sock, hop.id, std::string() });
+        frameSendMsg(box.back().frames, to, from, content);
+    }
+
+    logMessage(LOG_DEBUG, "Forwarded message for %.*s", (int)to.size(), to.data());
+    return true;
+}
+
+// Hand the messages forwarded during this batch of events to the workers
+// holding their peers, one lock and at most one wakeup per worker
+void postForwards(Worker *worker)
+{
+    TRACE_SPAN("postForwards");
+    int workerCount = workerPoolSize.load(std::memory_order_relaxed);
+
+    for(int i = 0; i < workerCount; i++)
+    {
+        std::vector<Forward>& box = worker->outbox[i];
+        Worker *target = &workerPool[i];
+        bool wake;
+
+        if(box.empty())
+            continue;
+
+        {
+            std::lock_guard<std::mutex> guard(target->inboxLock);
+            wake = target->inbox.empty();
+            for(Forward& forward : box)
+                target->inbox.push_back(std::move(forward));
         }
+        box.clear();
 
-        send(clientSocket, response.c_str(), response.length(), 0);
-    } else {
-        std::cerr << "Client not found for HELO response." << std::endl;
+        // Not woken yet since it last emptied its inbox
+        char c = 1;
+        if(wake && write(target->wakeWrite, &c, 1) < 0 && errno != EAGAIN)
+            logError("Failed to wake worker");
     }
-  }
+}
 
+// Other workers have handed us messages for our peers. The wakeup pipe
+// is emptied before the inbox, so a batch posted in between wakes us again.
+void receiveForwards(Worker *worker)
+{
+    TRACE_SPAN("receiveForwards");
+    std::vector<Forward> batch;
+    char buffer[64];
+
+    while(read(worker->wakeRead, buffer, sizeof(buffer)) > 0)
+        ;
 
-  // List all connected servers
-  else if(tokens[0].compare("LISTSERVERS") == 0)
-  {
-    std::string response = "SERVERS,";
-    bool first = true; // To handle the first entry differently
+    {
+        std::lock_guard<std::mutex> guard(worker->inboxLock);
+        batch.swap(worker->inbox);
+    }
 
-    // Append all server connections 
-    for (auto const& pair : clients)
+    for(Forward& forward : batch)
     {
-        if (!first)
+        Client *peer = worker->clients.find(forward.sock);
+
+        if(peer != NULL && peer->id == forward.id)
+        {
+            peer->output.append(std::move(forward.frames));
+            flushClient(peer);
+        }
+        else
         {
-            response += ";"; 
+            // The peer went away while the messages were on their way
+            storeFrames(forward.frames);
         }
-        first = false;
+    }
+}
+
+// Send a peer the messages that were stored for its group before it
+// connected, as SENDMSG commands, instead of waiting for it to ask
+void pushStored(Client *peer)
+{
+    std::string_view group = peer->name;
+    std::string frames;
+
+    messageQueue.drainMessages(group, [&](std::string_view from, std::string_view content) {
+        frameSendMsg(frames, group, from, content);
+    });
+
+    if(!frames.empty())
+    {
+        logMessage(LOG_INFO, "Pushed stored messages to %.*s", (int)group.size(), group.data());
+        peer->output.append(std::move(frames));
+        queueFlush(peer);
+    }
+}
+
+// The port a peer listens on, for its SERVERS entry: the one we connected
+// to for servers we connected to, unknown (0) for servers that connected
+// to us
+int listenPort(const Client *peer)
+{
+    return peer->outbound ? ntohs(peer->addr.sin_port) : 0;
+}
+
+bool validGroupId(std::string_view name)
+{
+    return !name.empty() && name.find_first_of(",;") == std::string_view::npos;
+}
+
+// A connected server has told us its group ID: list it in the registry
+// and route its group's messages to it from now on. The caller then
+// pushes the messages already waiting with pushStored(). Returns false,
+// leaving the connection unnamed, if the ID isn't valid or another
+// connection already has it.
+bool identifyPeer(Client *peer, std::string_view name)
+{
+    if(!validGroupId(name))
+    {
+        logMessage(LOG_WARN, "Client %d sent an invalid group ID", peer->id);
+        return false;
+    }
+
+    if(name == serverGroup)
+    {
+        peer->name = name;
+        return true;
+    }
+
+    if(!routes.addPeer(name, NextHop { peer->worker->index, peer->sock, peer->id }))
+    {
+        logMessage(LOG_WARN, "Client %d claims group %.*s, which is already connected",
+                   peer->id, (int)name.size(), name.data());
+        return false;
+    }
+
+    peer->name = name;
+    peer->routed = true;
+    registry.add(peer->id, peer->name, peer->addr, listenPort(peer));
+    return true;
+}
+
+
+
+// Command handlers. Each one is called with the client that sent the
+// command and its tokens, after the dispatch table has checked that the
+// number of tokens is within the range declared for the command.
+
+// Close the socket
+void cmdLeave(Client *sender, const CommandTokens& tokens)
+{
+    // Close the socket, and leave the event loop to release
+    // the client once this batch of events is done.
+
+    closeClient(sender);
+}
+
+// Tell a server that connected to us which group we are, so it can route
+// messages for us over the connection. Servers we connected to already
+// know from the HELO we sent them.
+void introduce(Client *peer)
+{
+    if(!peer->outbound)
+        sendResponse(peer, "HELO," + serverGroup);
+}
+
+// First message sent by server after it connects. From now on the
+// server gets a KEEPALIVE from us every so often, and the messages for
+// its group.
+//
+// The reply is the registry's cached SERVERS response with the sender's
+// entry at the front. Only that entry is copied; the rest of the list is
+// queued as references to the cached response. A sender whose group ID is
+// refused isn't listed, and just gets the cached list.
+void cmdHelo(Client *sender, const CommandTokens& tokens)
+{
+    if (keepAliveIntervalMs > 0 && !sender->keepAliveTimer.pending())
+    {
+        sender->worker->timers->schedule(&sender->keepAliveTimer, sender->worker->now,
+                                         keepAliveIntervalMs);
+    }
+
+    bool identified = identifyPeer(sender, tokens[1]);
+    ServersSnapshot snap = registry.snapshot(sender->id);
+    const std::string& frame = *snap.frame;
+    OutQueue& out = sender->output;
+
+    if (snap.entryLength == 0) // Ourselves, or refused
+    {
+        out.append(snap.frame);
+        if (identified)
+            introduce(sender);
+        return;
+    }
 
-        response += "A5_" + std::to_string(pair.second->id) + "," + 
-                    inet_ntoa(pair.second->addr.sin_addr) + "," + 
-                    std::to_string(ntohs(pair.second->addr.sin_port)); // Convert port
+    // Add the server sending the command first
+    out.append(frame.data(), SERVERS_PREFIX_LENGTH);
+    out.append(frame.data() + snap.entryOffset, snap.entryLength);
+
+    // Then the 1-hop connections listed before it, without the ';' that
+    // separated them from it...
+    size_t before = snap.entryOffset - 1;
+    if (before > SERVERS_PREFIX_LENGTH)
+    {
+        out.append(";", 1);
+        out.append(snap.frame, SERVERS_PREFIX_LENGTH, before - SERVERS_PREFIX_LENGTH);
     }
 
-    send(clientSocket, response.c_str(), response.length(), 0);
-  }
+    // ...and the ones after it, which already start with ';', and EOT
+    size_t after = snap.entryOffset + snap.entryLength;
+    out.append(snap.frame, after, frame.size() - after);
 
+    pushStored(sender);
+    introduce(sender);
+}
+
+// List all connected servers
+// (the registry's cached response, shared rather than copied)
+void cmdListServers(Client *sender, const CommandTokens& tokens)
+{
+    sender->output.append(registry.snapshot().frame);
+}
 
-  // Send a message to a group
-  else if(tokens[0].compare("SENDMSG") == 0) 
+// Send a message to a group
+void cmdSendMsg(Client *sender, const CommandTokens& tokens)
 {
-    std::string toGroupID;
-    std::string fromGroupID;
-    std::string message;
+    std::string_view toGroupID;
+    std::string_view fromGroupID;
+    std::string_view message;
 
     // Check if it's the 3-token format: "SENDMSG,<GROUP ID>,<message contents>"
     if (tokens.size() == 3) {
@@ -384,210 +802,1314 @@ void clientCommand(int clientSocket, fd_set *openSockets, int *maxfds,
         message = tokens[2];
     } 
     // Else, use the 4-token format: "SENDMSG,<TO GROUP ID>,<FROM GROUP ID>,<message content>"
-    else if (tokens.size() >= 4) {
+    else {
         toGroupID = tokens[1];
         fromGroupID = tokens[2];
 
-        // Construct the message content starting from the 4th token
-        for(auto i = tokens.begin() + 3; i != tokens.end(); i++) {
-            message += *i + " ";
-        }
-
-        // Remove trailing space from message
-        if (!message.empty()) {
-            message.pop_back();
-        }
-    }
-    else {
-        // Invalid format, send an error response
-        std::string errorMsg = "Error: Invalid SENDMSG command format.";
-        send(clientSocket, errorMsg.c_str(), errorMsg.length(), 0);
-        return; 
+        // The message content is everything from the 4th token on,
+        // including any commas in it
+        message = tokens.rest(3);
     }
 
-    // Construct the full SENDMSG command to check size
-    std::string sendMsgCommand = "SENDMSG," + toGroupID + "," + fromGroupID + "," + message;
+    // Size of the full "SENDMSG,<TO>,<FROM>,<message>" command
+    size_t sendMsgLength = strlen("SENDMSG,") + toGroupID.size() + 1 +
+                           fromGroupID.size() + 1 + message.size();
 
     // Check if the command exceeds the 5000-byte limit
-    if (sendMsgCommand.length() > 5000) {
-        std::cerr << "SENDMSG command exceeds the 5000-byte limit." << std::endl;
+    if (sendMsgLength > 5000) {
+        logMessage(LOG_WARN, "SENDMSG command exceeds the 5000-byte limit.");
 
         // Send an error message back to the client
-        std::string errorMsg = "Error: Message exceeds the 5000-byte limit.";
-        send(clientSocket, errorMsg.c_str(), errorMsg.length(), 0);
+        sendResponse(sender, "Error: Message exceeds the 5000-byte limit.");
         return; 
     }
 
-    // Store the message for the target group if within limits
-    storeMessage(toGroupID, fromGroupID, message);
+    // Pass it on if the group is on a server we're connected to,
+    // otherwise store the message for the target group if within limits
+    if (forwardMessage(sender, toGroupID, fromGroupID, message))
+        return;
+    if (!storeMessage(toGroupID, fromGroupID, message)) {
+        sendResponse(sender, "Error: Message store full.");
+    }
+}
+
+// Send the next step of a client's GETMSGS. Returns true once it is done.
+bool drainStep(Client *client)
+{
+    TRACE_SPAN("drainStep");
+    messageQueue.drainStep(client->drain,
+                           [client](const SharedBuffer& frames, size_t offset, size_t length) {
+        sendStoredMessages(client, frames, offset, length);
+    }, DRAIN_STEP_MESSAGES, DRAIN_STEP_BYTES);
+
+    return !client->drain.active();
 }
-  // Get messages for a group
-  else if(tokens[0].compare("GETMSGS") == 0 && tokens.size() == 2)
-  {
-    std::string groupID = tokens[1];
-    std::vector<Message> messages = getMessages(groupID);
 
-    // Send the messages back to the client
-    for(const auto& msg : messages)
+// Get messages for a group: "GETMSGS,<group>[,<max>]"
+void cmdGetMsgs(Client *sender, const CommandTokens& tokens)
+{
+    size_t max = SIZE_MAX;
+
+    if(tokens.size() > 2)
     {
-        std::string response = "From " + msg.fromGroupID + ": " + msg.content;
-        send(clientSocket, response.c_str(), response.length(), 0);
+        std::string text(tokens[2]);
+        char *end;
+
+        max = strtoul(text.c_str(), &end, 10);
+        if(text.empty() || *end != '\0' || text[0] == '-' || max == 0)
+        {
+            sendResponse(sender, "Error: Invalid GETMSGS command format.");
+            return;
+        }
     }
-  }
 
-  else if (tokens[0].compare("GETMSG") == 0 && tokens.size() == 2)
-  {
-    std::string groupID = tokens[1];
-    
-    // Retrieve a single message, for example, the latest or first in the list
-    std::vector<Message> messages = getMessages(groupID);
-    
-    if (!messages.empty()) {
-        const Message& msg = messages.front();  // Get the first message or define criteria for "latest"
-        std::string response = "From " + msg.fromGroupID + ": " + msg.content;
-        send(clientSocket, response.c_str(), response.length(), 0);
-    } else {
+    // Most mailboxes go in one step. A bigger one carries on from the event
+    // loop, a step at a time taking turns with other clients, and the
+    // client's next commands wait until it is done.
+    messageQueue.startDrain(sender->drain, tokens[1], max);
+    if(sender->drain.active() && !drainStep(sender))
+        queueDrain(sender);
+}
+
+void cmdGetMsg(Client *sender, const CommandTokens& tokens)
+{
+    std::string_view groupID = tokens[1];
+
+    // Retrieve a single message, the first in the list
+    size_t found = getMessages(groupID, [sender](const SharedBuffer& frames, size_t offset, size_t length) {
+        sendStoredMessages(sender, frames, offset, length);
+    }, 1);
+
+    if (found == 0) {
         // Send a message if no messages are found for the group
-        std::string response = "No messages found for group " + groupID;
-        send(clientSocket, response.c_str(), response.length(), 0);
+        std::string response = "No messages found for group " + std::string(groupID);
+        sendResponse(sender, response);
     }
-  }
+}
+
+// Keep alive command
+void cmdKeepAlive(Client *sender, const CommandTokens& tokens)
+{
+    int pendingCount = getMessageCount(tokens[1]);
 
+    char response[32];
+    int responseLength = snprintf(response, sizeof(response), "KEEPALIVE,%d", pendingCount);
+    sendResponse(sender, std::string_view(response, responseLength));
+}
 
-  // Keep alive command
-  else if(tokens[0].compare("KEEPALIVE") == 0 && tokens.size() == 2)
-  {
-    std::string toGroupID = tokens[1];
-    int pendingCount = getMessageCount(toGroupID);
+std::string statusMetrics();        // below, with the command table
 
-    std::string response = "KEEPALIVE," + std::to_string(pendingCount);
-    send(clientSocket, response.c_str(), response.length(), 0);
-  }
+// Status request: reply with the groups we hold messages for and how
+// many, "STATUSRESP,<group>,<count>,<group>,<count>,..."
+// "STATUSREQ,METRICS" gets the server's own metrics instead.
+void cmdStatusReq(Client *sender, const CommandTokens& tokens)
+{
+    std::string response = "STATUSRESP";
 
-  // Unknown command
-  else
-  {
-      std::cout << "Unknown command from client:" << buffer << std::endl;
-  }
-     
-}
+    if(tokens.size() > 1 && tokens[1] == "METRICS")
+    {
+        sendResponse(sender, statusMetrics());
+        return;
+    }
 
+    messageQueue.forEachGroup([&response](std::string_view group, size_t count) {
+        response += ",";
+        response += group;
+        response += "," + std::to_string(count);
+    });
 
+    sendResponse(sender, response);
+}
 
+// Reply to a STATUSREQ we sent; nothing to do with it beyond logging
+void cmdStatusResp(Client *sender, const CommandTokens& tokens)
+{
+}
 
-int main(int argc, char* argv[])
+// Reply to a HELO we sent: "SERVERS,<group>,<ip>,<port>;<group>,<ip>,<port>;..."
+// The first entry is normally the server that replied, which gives us the
+// name of an outbound peer; servers that list the HELO sender first instead
+// send us a HELO of their own (see cmdHelo()). Entries with our group ID, or
+// the address this connection reaches us on, are us.
+//
+// The others are servers it is connected to. Those listed with the port
+// they listen on become reachable through it in the routing table, and we
+// connect to those we had no route to at all, up to maxOutbound of them.
+// Entries without a port (servers that connected to it) are left out, as
+// there is nowhere to connect to.
+void cmdServers(Client *sender, const CommandTokens& tokens)
 {
-    bool finished;
-    int listenSock;                 // Socket for connections to server
-    int clientSock;                 // Socket of connecting client
-    fd_set openSockets;             // Current open sockets 
-    fd_set readSockets;             // Socket list for select()        
-    fd_set exceptSockets;           // Exception socket list
-    int maxfds;                     // Passed to select() as max fd in set
-    struct sockaddr_in client;
-    socklen_t clientLen;
-    char buffer[1025];              // buffer for reading from clients
+    std::string_view list = tokens.rest(1);
+    std::vector<std::string_view> neighbours;
+    bool first = true;
+    struct sockaddr_in self;
+    socklen_t selfLength = sizeof(self);
+
+    if(getsockname(sender->sock, (struct sockaddr *)&self, &selfLength) < 0)
+        memset(&self, 0, sizeof(self));
 
-    if(argc != 2)
+    while(!list.empty())
     {
-        printf("Usage: chat_server <ip port>\n");
-        exit(0);
+        size_t end = list.find(';');
+        std::string_view entry = list.substr(0, end);
+        list.remove_prefix(end == std::string_view::npos ? list.size() : end + 1);
+
+        size_t comma1 = entry.find(',');
+        if(comma1 == std::string_view::npos)
+            continue;
+        size_t comma2 = entry.find(',', comma1 + 1);
+        if(comma2 == std::string_view::npos)
+            continue;
+
+        std::string_view group = entry.substr(0, comma1);
+        std::string ip(entry.substr(comma1 + 1, comma2 - comma1 - 1));
+        int port = atoi(std::string(entry.substr(comma2 + 1)).c_str());
+
+        struct sockaddr_in addr;
+        NextHop hop;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(port);
+        bool located = port > 0 && port <= 65535 &&
+                       inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) == 1;
+
+        if(group.empty() || group == serverGroup ||
+           (located && addr.sin_addr.s_addr == self.sin_addr.s_addr &&
+            addr.sin_port == self.sin_port))
+        {
+            first = false;
+            continue;
+        }
+
+        if(first)
+        {
+            first = false;
+            if(sender->outbound && sender->name.empty())
+            {
+                if(identifyPeer(sender, group))
+                    pushStored(sender);
+                continue;
+            }
+        }
+
+        if(!located)
+            continue;
+
+        if(!routes.lookup(group, &hop))
+            connectPeer(sender->worker, addr, false);
+        neighbours.push_back(group);
     }
 
-    // Setup socket for server to listen to
+    if(sender->sock < 0)
+        return;
+
+    routes.advertise(NextHop { sender->worker->index, sender->sock, sender->id }, neighbours);
+    sender->routed = true;
+}
+
+typedef void (*CommandHandler)(Client *sender, const CommandTokens& tokens);
+
+// Dispatch table: command name, allowed number of tokens (including the
+// command itself) and handler. Commands outside their token range get an
+// "Invalid <command> command format" error.
+struct CommandSpec {
+    std::string_view name;
+    size_t minTokens;
+    size_t maxTokens;
+    CommandHandler handler;
+};
+
+constexpr CommandSpec commandTable[] = {
+    { "LEAVE",        1, MAX_TOKENS, cmdLeave       },
+    { "HELO",         2, 2,          cmdHelo        },
+    { "LISTSERVERS",  1, MAX_TOKENS, cmdListServers },
+    { "SENDMSG",      3, MAX_TOKENS, cmdSendMsg     },
+    { "GETMSGS",      2, 3,          cmdGetMsgs     },
+    { "GETMSG",       2, 2,          cmdGetMsg      },
+    { "KEEPALIVE",    2, 2,          cmdKeepAlive   },
+    { "STATUSREQ",    1, 2,          cmdStatusReq   },
+    { "STATUSRESP",   1, MAX_TOKENS, cmdStatusResp  },
+    { "SERVERS",      1, MAX_TOKENS, cmdServers     },
+};
+
+constexpr CommandIndex commandIndex = buildCommandIndex(commandTable);
+
+// Process command from client on the server
+// frame points at one complete SOH..EOT frame of length bytes.
+void clientCommand(Client *sender, const char *frame, size_t length) 
+{
+    TRACE_SPAN("command");
+
+    if (length < 2 || frame[0] != SOH || frame[length - 1] != EOT) {
+        logMessage(LOG_WARN, "Invalid command format: missing SOH or EOT.");
+        return; // Exit if the format is incorrect
+    }  
+
+    std::string_view buffer(frame, length);
+    logMessage(LOG_DEBUG, "Received buffer from client: %.*s", (int)length, frame);
 
-    listenSock = open_socket(atoi(argv[1])); 
-    printf("Listening on port: %d\n", atoi(argv[1]));
+    // Split the command (without SOH and EOT) into tokens for parsing.
+    // The tokens point into the client's receive buffer.
+    CommandTokens tokens;
+    size_t count;
 
-    if(listen(listenSock, BACKLOG) < 0)
     {
-        printf("Listen failed on port %s\n", argv[1]);
-        exit(0);
+        TRACE_SPAN("parse");
+        count = tokens.parse(buffer.substr(1, length - 2));
+    }
+
+    if (count == 0) {
+        logMessage(LOG_WARN, "Invalid command format: empty command.");
+        return;
     }
-    else 
-    // Add listen socket to socket set we are monitoring
+
+    logMessage(LOG_DEBUG, "Command: %.*s, token size: %zu",
+               (int)tokens[0].size(), tokens[0].data(), tokens.size());
+
+    // Log command
+    logCommand(sender->sock, buffer);
+
+    int index = commandIndex.find(tokens[0]);
+
+    // Unknown command
+    if (index < 0 || commandTable[index].name != tokens[0])
     {
-        FD_ZERO(&openSockets);
-        FD_SET(listenSock, &openSockets);
-        maxfds = listenSock;
+        logMessage(LOG_INFO, "Unknown command from client: %.*s", (int)length, frame);
+        sender->worker->metrics.unknownCommands.add();
+        return;
     }
 
-    finished = false;
+    const CommandSpec& spec = commandTable[index];
 
-    while(!finished)
+    if (tokens.size() < spec.minTokens || tokens.size() > spec.maxTokens)
     {
-        // Get modifiable copy of readSockets
-        readSockets = exceptSockets = openSockets;
-        memset(buffer, 0, sizeof(buffer));
+        std::string errorMsg = "Error: Invalid " + std::string(spec.name) + " command format.";
+        sendResponse(sender, errorMsg);
+        return;
+    }
 
-        // Look at sockets and see which ones have something to be read()
-        int n = select(maxfds + 1, &readSockets, NULL, &exceptSockets, NULL);
+    // The handler may close the sender, but the Client (and its worker
+    // pointer) stays until the end of the batch
+    WorkerMetrics& metrics = sender->worker->metrics;
+    uint64_t started = monotonicNs();
 
-        if(n < 0)
-        {
-            perror("select failed - closing down\n");
-            finished = true;
-        }
-        else
-        {
-            int serverIDcounter = 1;
-            // First, accept  any new connections to the server on the listening socket
-            if(FD_ISSET(listenSock, &readSockets))
-            {
-               clientLen = sizeof(client);  
-               clientSock = accept(listenSock, (struct sockaddr *)&client,
-                                   &clientLen);
-               printf("accept***\n");
-               // Add new client to the list of open sockets
-               FD_SET(clientSock, &openSockets);
+    {
+        TRACE_SPAN(spec.name.data());   // the table's names are string literals
+        spec.handler(sender, tokens);
+    }
+
+    metrics.commands[index].add();
+    metrics.commandTime[index].record(monotonicNs() - started);
+}
 
-               // And update the maximum file descriptor
-               maxfds = std::max(maxfds, clientSock) ;
+// Every worker's metrics added up
+struct MetricsTotals {
+    std::vector<uint64_t> commands;
+    std::vector<uint64_t> commandSum;
+    std::vector<Histogram> commandTime;
+    uint64_t unknownCommands = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t bytesSent = 0;
+    uint64_t accepted = 0;
+    uint64_t refused = 0;
+    uint64_t throttled = 0;
+    uint64_t flooded = 0;
+    uint64_t connections = 0;
+    uint64_t loops = 0;
+    uint64_t loopSum = 0;
+    Histogram loopTime;
+    double uptime;                  // seconds
+    int workers = 0;                // Workers the totals were collected from
+};
 
-               // create a new client to store information.
-               clients[clientSock] = new Client(clientSock, client);
+const size_t commandCount = sizeof(commandTable) / sizeof(commandTable[0]);
+uint64_t startedAt;                 // When the server started, ms
 
-               // Assign a unique ID to the client
-               clients[clientSock]->id = serverIDcounter;
+void collectMetrics(MetricsTotals& totals)
+{
+    totals.commands.assign(commandCount, 0);
+    totals.commandSum.assign(commandCount, 0);
+    totals.commandTime.assign(commandCount, Histogram());
+    totals.uptime = (monotonicMs() - startedAt) / 1000.0;
+    totals.workers = workerPoolSize.load();
 
-               // Decrement the number of sockets waiting to be dealt with
-               n--;
+    for(int i = 0; i < totals.workers; i++)
+    {
+        const WorkerMetrics& m = workerPool[i].metrics;
 
-               printf("Client connected on server: %d\n", clientSock);
-            }
-            // Now check for commands from clients
-            std::list<Client *> disconnectedClients;  
-            while(n-- > 0)
-            {
-               for(auto const& pair : clients)
-               {
-                  Client *client = pair.second;
-
-                  if(FD_ISSET(client->sock, &readSockets))
-                  {
-                      // recv() == 0 means client has closed connection
-                      if(recv(client->sock, buffer, sizeof(buffer), MSG_DONTWAIT) == 0)
-                      {
-                          disconnectedClients.push_back(client);
-                          closeClient(client->sock, &openSockets, &maxfds);
-
-                      }
-                      // We don't check for -1 (nothing received) because select()
-                      // only triggers if there is something on the socket for us.
-                      else
-                      {
-                          std::cout << buffer << std::endl;
-                          clientCommand(client->sock, &openSockets, &maxfds, buffer);
-                      }
-                  }
-               }
-               // Remove client from the clients list
-               for(auto const& c : disconnectedClients)
-                  clients.erase(c->sock);
-            }
+        for(size_t c = 0; c < commandCount; c++)
+        {
+            totals.commands[c]   += m.commands[c].get();
+            totals.commandSum[c] += m.commandTime[c].sum();
+            m.commandTime[c].addTo(totals.commandTime[c]);
         }
+        totals.unknownCommands += m.unknownCommands.get();
+        totals.bytesReceived   += m.bytesReceived.get();
+        totals.bytesSent       += m.bytesSent.get();
+        totals.accepted        += m.accepted.get();
+        totals.refused         += m.refused.get();
+        totals.throttled       += m.throttled.get();
+        totals.flooded         += m.flooded.get();
+        totals.connections     += m.connections.get();
+        totals.loops           += m.loopTime.count();
+        totals.loopSum         += m.loopTime.sum();
+        m.loopTime.addTo(totals.loopTime);
+    }
+}
+
+// Share of the time since startup the workers spent handling events
+double busyPercent(const MetricsTotals& totals)
+{
+    if(totals.uptime <= 0 || totals.workers == 0)
+        return 0;
+    return totals.loopSum / 1e7 / (totals.uptime * totals.workers);
+}
+
+// Reply to "STATUSREQ,METRICS": "STATUSRESP,<name>,<value>,<name>,<value>,..."
+// with times in microseconds
+std::string statusMetrics()
+{
+    MetricsTotals totals;
+    char buffer[256];
+
+    collectMetrics(totals);
+
+    snprintf(buffer, sizeof(buffer),
+             "STATUSRESP,uptime,%.0f,connections,%llu,busy_percent,%.1f,"
+             "received_bytes,%llu,sent_bytes,%llu,loop_p99_us,%.1f,stored,%zu,groups,%zu,routes,%zu",
+             totals.uptime, (unsigned long long)totals.connections, busyPercent(totals),
+             (unsigned long long)totals.bytesReceived, (unsigned long long)totals.bytesSent,
+             totals.loopTime.percentile(99) / 1000.0, messageQueue.totalMessages(),
+             messageQueue.groupCount(), routes.size());
+
+    std::string response = buffer;
+
+    for(size_t c = 0; c < commandCount; c++)
+    {
+        if(totals.commands[c] == 0)
+            continue;
+
+        std::string name(commandTable[c].name);
+        snprintf(buffer, sizeof(buffer), ",%s,%llu,%s_p99_us,%.1f",
+                 name.c_str(), (unsigned long long)totals.commands[c], name.c_str(),
+                 totals.commandTime[c].percentile(99) / 1000.0);
+        response += buffer;
+    }
+    return response;
+}
+
+// The metrics endpoint's page, in the Prometheus text format
+std::string renderMetrics()
+{
+    MetricsTotals totals;
+    MetricsText page;
+
+    collectMetrics(totals);
+
+    page.family("tsam_uptime_seconds", "gauge", "Time since the server started.");
+    page.sample("tsam_uptime_seconds", "", totals.uptime);
+
+    page.family("tsam_commands_total", "counter", "Commands handled.");
+    for(size_t c = 0; c < commandCount; c++)
+    {
+        page.sample("tsam_commands_total",
+                    "command=\"" + std::string(commandTable[c].name) + "\"", totals.commands[c]);
+    }
+    page.family("tsam_command_duration_seconds", "summary", "Time spent handling a command.");
+    for(size_t c = 0; c < commandCount; c++)
+    {
+        page.summary("tsam_command_duration_seconds",
+                     "command=\"" + std::string(commandTable[c].name) + "\"",
+                     totals.commandTime[c], totals.commandSum[c], 1e-9);
+    }
+    page.family("tsam_unknown_commands_total", "counter", "Commands not recognised.");
+    page.sample("tsam_unknown_commands_total", "", totals.unknownCommands);
+
+    page.family("tsam_received_bytes_total", "counter", "Bytes read from connections.");
+    page.sample("tsam_received_bytes_total", "", totals.bytesReceived);
+    page.family("tsam_sent_bytes_total", "counter", "Bytes written to connections.");
+    page.sample("tsam_sent_bytes_total", "", totals.bytesSent);
+
+    page.family("tsam_connections", "gauge", "Open connections.");
+    page.sample("tsam_connections", "", totals.connections);
+    page.family("tsam_accepted_total", "counter", "Connections accepted.");
+    page.sample("tsam_accepted_total", "", totals.accepted);
+    page.family("tsam_refused_total", "counter", "Connections refused by the accept rate limit.");
+    page.sample("tsam_refused_total", "", totals.refused);
+    page.family("tsam_throttled_total", "counter", "Times a connection went over its rate limits.");
+    page.sample("tsam_throttled_total", "", totals.throttled);
+    page.family("tsam_flooding_closed_total", "counter",
+                "Connections closed for staying over their rate limits.");
+    page.sample("tsam_flooding_closed_total", "", totals.flooded);
+
+    page.family("tsam_loop_duration_seconds", "summary",
+                "Time a worker spent handling one batch of events.");
+    page.summary("tsam_loop_duration_seconds", "", totals.loopTime, totals.loopSum, 1e-9);
+    page.family("tsam_busy_ratio", "gauge", "Share of the time workers spent handling events.");
+    page.sample("tsam_busy_ratio", "", busyPercent(totals) / 100);
+
+    page.family("tsam_stored_messages", "gauge", "Messages waiting in mailboxes.");
+    page.sample("tsam_stored_messages", "", messageQueue.totalMessages());
+    page.family("tsam_stored_bytes", "gauge", "Bytes of messages waiting in mailboxes.");
+    page.sample("tsam_stored_bytes", "", messageQueue.totalBytes());
+    page.family("tsam_stored_groups", "gauge", "Groups with messages waiting.");
+    page.sample("tsam_stored_groups", "", messageQueue.groupCount());
+    page.family("tsam_evicted_messages_total", "counter", "Messages dropped to make room.");
+    page.sample("tsam_evicted_messages_total", "", messageQueue.evictedMessages());
+    page.family("tsam_rejected_messages_total", "counter", "Messages the store refused.");
+    page.sample("tsam_rejected_messages_total", "", messageQueue.rejectedMessages());
+    page.family("tsam_spool_segments", "gauge", "Segment files in the spool.");
+    page.sample("tsam_spool_segments", "", spool.segmentCount());
+
+    page.family("tsam_routes", "gauge", "Groups we have a route to.");
+    page.sample("tsam_routes", "", routes.size());
+    page.family("tsam_servers", "gauge", "Servers listed in SERVERS replies.");
+    page.sample("tsam_servers", "", registry.size());
+
+    page.family("tsam_log_dropped_total", "counter", "Log messages dropped.");
+    page.sample("tsam_log_dropped_total", "", logDropped());
+
+    return page.str();
+}
+
+
+
+
+// Register the events a client currently needs with the event backend:
+// reads unless paused for backpressure, writes only while output is queued.
+void updateInterest(Client *client)
+{
+    uint32_t wanted = EV_EDGE;
+
+    if(!client->readPaused && !client->throttled)
+        wanted |= EV_READ;
+    if(!client->output.empty())
+        wanted |= EV_WRITE;
+
+    if(wanted != client->interest && client->sock >= 0)
+    {
+        if(!client->worker->backend->modify(client->sock, wanted, client))
+        {
+            closeClient(client);
+            return;
+        }
+        client->interest = wanted;
+    }
+}
+
+// Send what the client's socket will take from its output queue.
+// Returns false if the connection failed.
+bool sendOutput(Client *client)
+{
+    TRACE_SPAN("send");
+    size_t queued = client->output.size();
+    long left = client->output.flush(client->sock);
+
+    if(left < 0)
+        return false;
+
+    client->worker->metrics.bytesSent.add(queued - left);
+    return true;
+}
+
+// Send whatever the client's socket will take from its output queue.
+void flushClient(Client *client)
+{
+    if(client->sock < 0)
+        return;
+
+    if(!client->output.empty() && !sendOutput(client))
+    {
+        closeClient(client);
+        return;
+    }
+    updateInterest(client);
+}
+
+// Charge cost to a client's own bucket and its address's for limit.
+// Returns the ms until it is within both again, 0 if it is.
+uint64_t chargeClient(Client *client, const RateLimit& limit, TokenBucket& bucket,
+                      AddressLimiter& addrLimiter, double cost)
+{
+    uint64_t now  = client->worker->now;
+    uint64_t wait = (limit.rate > 0) ? bucket.charge(limit, now, cost) : 0;
+
+    return std::max(wait, addrLimiter.charge(client->addr.sin_addr.s_addr, now, cost));
+}
+
+// A client has gone over its rate limits. Stop reading from it for waitMs,
+// leaving what it sends in the socket buffers so TCP slows it down, and
+// the other clients don't pay for its commands. One still over its limits
+// after FLOOD_TIMEOUT seconds is disconnected.
+void throttleClient(Client *client, uint64_t waitMs)
+{
+    Worker *worker = client->worker;
+
+    if(client->throttled)
+        return;
+
+    if(client->throttledSince == 0)
+    {
+        client->throttledSince = worker->now;
+    }
+    else if(worker->now - client->throttledSince > FLOOD_TIMEOUT * 1000)
+    {
+        logMessage(LOG_WARN, "Client %d over its rate limits for %ds, closing connection",
+                   client->sock, FLOOD_TIMEOUT);
+        worker->metrics.flooded.add();
+        closeClient(client);
+        return;
+    }
+
+    client->throttled = true;
+    worker->metrics.throttled.add();
+    worker->timers->schedule(&client->throttleTimer, worker->now, waitMs);
+}
+
+// Run the complete frames buffered for a client. Stops early if the
+// client has too much output queued, or goes over its command rate,
+// leaving the rest for later.
+void processFrames(Client *client)
+{
+    const char *frame;
+    size_t length;
+
+    // A command may close the client, so check before each one
+    while(client->sock >= 0 && !client->readPaused && !client->throttled)
+    {
+        if(client->output.size() > OUTPUT_HIGH_WATER || client->drain.active())
+        {
+            client->readPaused = true;
+            break;
+        }
+        if(!client->input.nextFrame(&frame, &length))
+            break;
+
+        clientCommand(client, frame, length);
+
+        uint64_t wait = chargeClient(client, connCommandLimit, client->commandBucket,
+                                     addrCommandLimiter, 1);
+        if(wait > 0 && client->sock >= 0)
+            throttleClient(client, wait);
+    }
+}
+
+// Read everything waiting on a client's socket and run every complete
+// command frame in it. Sockets are registered edge-triggered, so keep
+// reading until the kernel reports there is nothing left, unless the
+// client stops reading our responses. A frame split over several reads
+// stays in the client's buffer until its EOT arrives.
+void readClient(Client *client)
+{
+    do
+    {
+        if(client->output.size() <= OUTPUT_LOW_WATER && !client->drain.active())
+            client->readPaused = false;
+
+        // Frames left over from before a pause come first
+        processFrames(client);
+
+        while(client->sock >= 0 && !client->readPaused && !client->throttled)
+        {
+            size_t room = client->input.writable();
+            if(room == 0)
+            {
+                logMessage(LOG_WARN, "Out of buffer space for client %d", client->sock);
+                closeClient(client);
+                break;
+            }
+
+            ssize_t n;
+            {
+                TRACE_SPAN("recv");
+                n = recv(client->sock, client->input.writePtr(), room, MSG_DONTWAIT);
+            }
+
+            // recv() == 0 means client has closed connection
+            if(n == 0)
+            {
+                closeClient(client);
+            }
+            else if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    logError("recv failed");
+                    closeClient(client);
+                }
+                else
+                {
+                    client->throttledSince = 0;     // caught up with it
+                }
+                break;
+            }
+            else
+            {
+                client->input.commit(n);
+                client->lastActive = client->worker->now;
+                client->worker->metrics.bytesReceived.add(n);
+
+                uint64_t wait = chargeClient(client, connByteLimit, client->byteBucket,
+                                             addrByteLimiter, n);
+                processFrames(client);
+                if(wait > 0 && client->sock >= 0)
+                    throttleClient(client, wait);
+            }
+        }
+
+        if(client->sock < 0)
+            return;
+
+        // Everything the commands produced goes out in one go
+        if(!client->output.empty() && !sendOutput(client))
+        {
+            closeClient(client);
+            return;
+        }
+
+        // If the peer took the whole backlog straight away there is
+        // no reason to stay paused
+    } while(client->readPaused && client->output.size() <= OUTPUT_LOW_WATER &&
+            !client->drain.active());
+
+    if(!client->readPaused)
+        client->input.shrink();
+
+    updateInterest(client);
+}
+
+// The client's socket can take more data. Once enough of its backlog has
+// gone, resume reading from it if it was paused.
+void writeClient(Client *client)
+{
+    flushClient(client);
+
+    if(client->sock < 0 || client->output.size() > OUTPUT_LOW_WATER)
+        return;
+
+    if(client->drain.active())
+        queueDrain(client);          // its GETMSGS can go on
+    else if(client->readPaused)
+        readClient(client);
+}
+
+// Give each client in the drain queue one step of its GETMSGS. A client
+// whose output is backing up leaves the queue until writeClient() finds
+// it has gone down again, so a drain never holds more than a step past
+// the low water mark in memory.
+void runDrains(Worker *worker)
+{
+    TRACE_SPAN("runDrains");
+    Client *last = worker->drainTail;   // later arrivals wait for the next round
+    Client *client;
+
+    while((client = worker->drainHead) != NULL)
+    {
+        bool lastOne = (client == last);
+        unqueueDrain(client);
+
+        if(client->output.size() <= OUTPUT_LOW_WATER)
+        {
+            if(drainStep(client))
+            {
+                // Carry on with the commands that came after it
+                readClient(client);
+            }
+            else
+            {
+                flushClient(client);
+                if(client->sock >= 0 && client->output.size() <= OUTPUT_LOW_WATER)
+                    queueDrain(client);
+            }
+        }
+
+        if(lastOne)
+            break;
+    }
+}
+
+// Idle timer: close the connection if nothing has arrived on it for
+// idleTimeoutMs. Traffic only records the time it arrived, so a busy
+// connection costs one timer firing per timeout period, not a timer
+// update per command.
+void idleExpired(Timer *timer)
+{
+    Client *client = (Client *)timer->data;
+    uint64_t idle  = client->worker->now - client->lastActive;
+
+    if(idle >= idleTimeoutMs)
+    {
+        logMessage(LOG_INFO, "Client %d idle for %llus, closing connection",
+                   client->sock, (unsigned long long)(idle / 1000));
+        closeClient(client);
+        return;
+    }
+
+    client->worker->timers->schedule(timer, client->worker->now, idleTimeoutMs - idle);
+}
+
+// Throttle timer: a client that went over its rate limits may send again
+void throttleExpired(Timer *timer)
+{
+    Client *client = (Client *)timer->data;
+
+    client->throttled = false;
+    readClient(client);
+}
+
+// KEEPALIVE timer: tell a peer how many messages we hold for it,
+// "KEEPALIVE,<count>"
+void sendKeepAlive(Timer *timer)
+{
+    Client *client = (Client *)timer->data;
+    int pendingCount = getMessageCount(client->name);
+
+    char message[32];
+    int messageLength = snprintf(message, sizeof(message), "KEEPALIVE,%d", pendingCount);
+    sendResponse(client, std::string_view(message, messageLength));
+    flushClient(client);
+
+    if(client->sock >= 0)
+        client->worker->timers->schedule(timer, client->worker->now, keepAliveIntervalMs);
+}
+
+// Housekeeping timer: periodic per-worker upkeep and statistics
+void housekeeping(Timer *timer)
+{
+    Worker *worker = (Worker *)timer->data;
+
+    logMessage(LOG_DEBUG, "Worker %d: %zu clients, %zu slots, %zu timers, "
+               "%llu accepted, %llu refused, %llu throttled, %llu flooding",
+               worker->index, worker->clients.size(), worker->clients.capacity(),
+               worker->timers->size(), (unsigned long long)worker->metrics.accepted.get(),
+               (unsigned long long)worker->metrics.refused.get(),
+               (unsigned long long)worker->metrics.throttled.get(),
+               (unsigned long long)worker->metrics.flooded.get());
+
+    if(worker->index == 0)
+    {
+        acceptLimiter.expire(worker->now);
+        addrCommandLimiter.expire(worker->now);
+        addrByteLimiter.expire(worker->now);
+        connectSeeds(worker);
+
+        logMessage(LOG_DEBUG, "Store: %zu messages, %zu bytes in %zu groups, "
+                   "%llu evicted, %llu rejected, %zu spool segments, "
+                   "%lu log messages dropped",
+                   messageQueue.totalMessages(), messageQueue.totalBytes(),
+                   messageQueue.groupCount(),
+                   (unsigned long long)messageQueue.evictedMessages(),
+                   (unsigned long long)messageQueue.rejectedMessages(),
+                   spool.segmentCount(), logDropped());
+        logMessage(LOG_DEBUG, "Routes: %zu groups over %zu links",
+                   routes.size(), routes.links());
+    }
+
+    worker->timers->schedule(timer, worker->now, HOUSEKEEPING_INTERVAL * 1000);
+}
+
+// Set up the timers and rate limits of a new connection, and start the
+// idle timer
+void startClient(Client *client)
+{
+    Worker *worker = client->worker;
+
+    client->lastActive = worker->now;
+    client->idleTimer.callback      = idleExpired;
+    client->idleTimer.data          = client;
+    client->keepAliveTimer.callback = sendKeepAlive;
+    client->keepAliveTimer.data     = client;
+    client->throttleTimer.callback  = throttleExpired;
+    client->throttleTimer.data      = client;
+    client->commandBucket.reset(connCommandLimit, worker->now);
+    client->byteBucket.reset(connByteLimit, worker->now);
+
+    if(idleTimeoutMs > 0)
+        worker->timers->schedule(&client->idleTimer, worker->now, idleTimeoutMs);
+}
+
+// Set up a newly accepted (non-blocking) connection and register it with
+// the worker's event backend.
+void addClient(Worker *worker, int clientSock, const struct sockaddr_in& client)
+{
+    // Responses are already batched per connection, don't let Nagle
+    // hold them back waiting for ACKs
+    int set = 1;
+    if(setsockopt(clientSock, IPPROTO_TCP, TCP_NODELAY, &set, sizeof(set)) < 0)
+    {
+        logError("Failed to set TCP_NODELAY");
+    }
+
+    // create a new client to store information.
+    Client *newClient = worker->clients.create(clientSock, worker, clientSock, client);
+
+    // Assign a unique ID to the client
+    newClient->id = serverIDcounter.fetch_add(1, std::memory_order_relaxed);
+
+    // Monitor the client's socket; the Client pointer comes back
+    // with every event for it.
+    newClient->interest = EV_READ | EV_EDGE;
+    if(!worker->backend->add(clientSock, newClient->interest, newClient))
+    {
+        close(clientSock);
+        worker->clients.release(newClient);
+        return;
+    }
+
+    startClient(newClient);
+
+    worker->metrics.accepted.add();
+    logMessage(LOG_INFO, "Client connected on server: %d (worker %d)", clientSock, worker->index);
+}
+
+// Open a non-blocking connection to another server. The connect finishes
+// in the event loop (see finishConnect()), which then sends our HELO.
+// Returns false if it couldn't be started, or addr is already connected.
+bool connectPeer(Worker *worker, const struct sockaddr_in& addr, bool seed)
+{
+    char ip[INET_ADDRSTRLEN];
+
+    if(!claimPeer(addr, seed))
+        return false;
+
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0 || setNonBlocking(sock) < 0)
+    {
+        logError("Failed to open socket for server connection");
+        if(sock >= 0)
+            close(sock);
+        releasePeer(addr);
+        return false;
+    }
+
+    int set = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &set, sizeof(set));
+
+    if(connect(sock, (const struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        logMessage(LOG_WARN, "Connecting to server %s:%d failed: %s",
+                   ip, ntohs(addr.sin_port), strerror(errno));
+        close(sock);
+        releasePeer(addr);
+        return false;
+    }
+
+    Client *peer = worker->clients.create(sock, worker, sock, addr);
+
+    peer->id         = serverIDcounter.fetch_add(1, std::memory_order_relaxed);
+    peer->outbound   = true;
+    peer->connecting = true;
+
+    // Writable once the connection is up (or has failed)
+    peer->interest = EV_WRITE | EV_EDGE;
+    if(!worker->backend->add(sock, peer->interest, peer))
+    {
+        close(sock);
+        worker->clients.release(peer);
+        releasePeer(addr);
+        return false;
+    }
+
+    // The idle timer also covers a connect that never completes
+    startClient(peer);
+
+    logMessage(LOG_INFO, "Connecting to server %s:%d on %d (worker %d)",
+               ip, ntohs(addr.sin_port), sock, worker->index);
+    return true;
+}
+
+// An outbound connection has finished connecting. Introduce ourselves;
+// the SERVERS reply tells us the peer's group ID.
+void finishConnect(Client *peer)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if(getsockopt(peer->sock, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        error = errno;
+    if(error == EINPROGRESS)
+        return;
+    if(error != 0)
+    {
+        logMessage(LOG_WARN, "Connection %d to server failed: %s", peer->sock, strerror(error));
+        closeClient(peer);
+        return;
+    }
+
+    peer->connecting = false;
+
+    sendResponse(peer, "HELO," + serverGroup);
+    if(keepAliveIntervalMs > 0)
+        peer->worker->timers->schedule(&peer->keepAliveTimer, peer->worker->now,
+                                       keepAliveIntervalMs);
+    flushClient(peer);
+}
+
+// Connect to each server given on the command line that we aren't
+// connected to, so dropped seed connections come back
+void connectSeeds(Worker *worker)
+{
+    for(const struct sockaddr_in& addr : seedPeers)
+        connectPeer(worker, addr, true);
+}
+
+// Out of file descriptors: accept the next waiting connection on the
+// spare descriptor and close it straight away, so it doesn't sit in the
+// queue making the listening socket permanently readable.
+// Returns false if there was nothing to accept.
+bool shedConnection(Worker *worker)
+{
+    if(worker->spareFd < 0)
+        return false;
+
+    close(worker->spareFd);
+    int sock = accept(worker->listenSock, NULL, NULL);
+    if(sock >= 0)
+        close(sock);
+    worker->spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if(sock < 0)
+        return false;
+
+    logMessage(LOG_WARN, "Out of file descriptors, connection dropped");
+    return true;
+}
+
+// Accept every connection waiting on a worker's listening socket, until
+// the kernel reports the queue is empty, so a burst of connections is
+// taken in one wakeup rather than one per trip round the event loop.
+void acceptClients(Worker *worker)
+{
+    TRACE_SPAN("accept");
+    for(;;)
+    {
+        struct sockaddr_in client;
+        socklen_t clientLen = sizeof(client);
+
+#ifdef __linux__
+        int clientSock = accept4(worker->listenSock, (struct sockaddr *)&client, &clientLen,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int clientSock = accept(worker->listenSock, (struct sockaddr *)&client, &clientLen);
+        if(clientSock >= 0 && setNonBlocking(clientSock) < 0)
+        {
+            close(clientSock);
+            continue;
+        }
+#endif
+
+        if(clientSock < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if((errno == EMFILE || errno == ENFILE) && shedConnection(worker))
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                logError("accept failed");
+            return;
+        }
+
+        if(!acceptLimiter.allow(client.sin_addr.s_addr, worker->now))
+        {
+            char ip[INET_ADDRSTRLEN];
+
+            worker->metrics.refused.add();
+            inet_ntop(AF_INET, &client.sin_addr, ip, sizeof(ip));
+            logMessage(LOG_DEBUG, "Connection rate limit exceeded, refusing %s", ip);
+            close(clientSock);
+            continue;
+        }
+
+        addClient(worker, clientSock, client);
+    }
+}
+
+// Release the clients closed since the last call, and the buffers they
+// still held
+void releaseClosed(Worker *worker)
+{
+    while(worker->closed != NULL)
+    {
+        Client *client = worker->closed;
+        worker->closed = client->nextClosed;
+        worker->clients.release(client);
+    }
+}
+
+// Event loop of one worker thread: accept connections on its own
+// listening socket and serve the clients it accepted.
+void runWorker(Worker *worker)
+{
+    bool finished;
+    IoEvent events[MAX_EVENTS];     // Ready sockets returned by the backend
+
+    finished = false;
+
+    char threadName[32];
+    snprintf(threadName, sizeof(threadName), "worker %d", worker->index);
+    traceThread(threadName);
+
+    worker->now = monotonicMs();
+    worker->housekeeping.callback = housekeeping;
+    worker->housekeeping.data     = worker;
+    worker->timers->schedule(&worker->housekeeping, worker->now, HOUSEKEEPING_INTERVAL * 1000);
+
+    while(!finished && !stopRequested.load(std::memory_order_relaxed))
+    {
+        // Wait for sockets that have something to be read(), or until
+        // the next timer is due. Don't wait if there are drains to step.
+        int timeout = worker->timers->nextTimeout(monotonicMs());
+        if(worker->drainHead != NULL)
+            timeout = 0;
+
+        int n;
+        {
+            TRACE_SPAN("wait");
+            n = worker->backend->wait(events, MAX_EVENTS, timeout);
+        }
+
+        // The rest of the pass, until the next wait
+        TRACE_SPAN("batch");
+        uint64_t started = monotonicNs();
+        worker->now = started / 1000000;
+
+        if(n < 0)
+        {
+            // This worker's share of the connections can't be served any
+            // more, so stop the whole server rather than run without it
+            logError("event wait failed - closing down");
+            stopServer();
+            finished = true;
+        }
+
+        for(int i = 0; i < n; i++)
+        {
+            // First, accept any new connections to the server on the listening socket
+            if(events[i].data == NULL)
+            {
+                acceptClients(worker);
+                continue;
+            }
+
+            // Messages for our peers from other workers
+            if(events[i].data == worker)
+            {
+                receiveForwards(worker);
+                continue;
+            }
+
+            // Now handle commands from the client the event belongs to
+            Client *client = (Client *)events[i].data;
+
+            if(client->sock >= 0 && client->connecting)
+            {
+                if(events[i].events & (EV_WRITE | EV_ERROR))
+                    finishConnect(client);
+                if(client->sock < 0 || client->connecting)
+                    continue;
+            }
+
+            if(client->sock >= 0 && (events[i].events & EV_WRITE))
+            {
+                writeClient(client);
+            }
+
+            if(client->sock >= 0 && (events[i].events & (EV_READ | EV_ERROR)))
+            {
+                readClient(client);
+            }
+        }
+
+        runDrains(worker);
+
+        // Send what was forwarded during the batch
+        flushForwarded(worker);
+        postForwards(worker);
+
+        // Run the timers that are due; they may close clients too
+        {
+            TRACE_SPAN("timers");
+            worker->timers->advance(worker->now);
+        }
+
+        // Release clients that closed during this batch, and the buffers
+        // they still held. No further events in the batch can refer to them.
+        releaseClosed(worker);
+
+        worker->metrics.connections.set(worker->clients.size());
+        worker->metrics.loopTime.record(monotonicNs() - started);
+    }
+}
+
+// Open a worker's listening socket and event backend.
+// Returns false if either could not be set up.
+bool startWorker(Worker *worker, int portno, bool reusePort, int backlog)
+{
+    if((worker->listenSock = open_socket(portno, reusePort)) < 0)
+        return false;
+
+    if(listen(worker->listenSock, backlog) < 0)
+    {
+        logError("Listen failed");
+        return false;
+    }
+
+    if((worker->backend = createEventBackend()) == NULL)
+    {
+        logMessage(LOG_ERROR, "Unable to create event backend");
+        return false;
+    }
+
+    worker->timers   = new TimerWheel(monotonicMs());
+    worker->spareFd  = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // Other workers wake us through a pipe when they forward us messages
+    int wake[2];
+    if(pipe(wake) < 0 || setNonBlocking(wake[0]) < 0 || setNonBlocking(wake[1]) < 0)
+    {
+        logError("Failed to create wakeup pipe");
+        return false;
+    }
+    worker->wakeRead  = wake[0];
+    worker->wakeWrite = wake[1];
+
+    // Add listen socket to the sockets we are monitoring. Its data pointer
+    // is NULL, which is how the loop tells it apart from clients; the
+    // wakeup pipe's is the worker itself.
+    return worker->backend->add(worker->listenSock, EV_READ, NULL) &&
+           worker->backend->add(worker->wakeRead, EV_READ | EV_EDGE, worker);
+}
+
+// Free what startWorker() set up, once the worker's thread has finished,
+// closing the connections it still has. Also works on a worker that
+// startWorker() only got part way through.
+void stopWorker(Worker *worker)
+{
+    // closeClient() takes each one off the list and out of the registry
+    // and routing table
+    while(worker->clients.size() > 0)
+        closeClient(*worker->clients.begin());
+    releaseClosed(worker);
+
+    delete worker->timers;
+    delete worker->backend;
+    if(worker->listenSock >= 0)
+        close(worker->listenSock);
+    if(worker->wakeRead >= 0)
+        close(worker->wakeRead);
+    if(worker->wakeWrite >= 0)
+        close(worker->wakeWrite);
+    if(worker->spareFd >= 0)
+        close(worker->spareFd);
+}
+
+// Stop the first count workers and forget the pool, when runServer()
+// is done with them
+static void stopWorkers(std::vector<Worker>& workers, int count)
+{
+    workerPoolSize = 0;
+    workerPool     = NULL;
+    for(int i = 0; i < count; i++)
+        stopWorker(&workers[i]);
+}
+
+// Set up a worker per thread, then run the first one on this thread
+bool runServer(int portno, const ServerOptions& options)
+{
+    int workerCount = options.workerCount;
+
+    // Put back the messages stored before a restart
+    if(options.spoolDir != NULL && !spool.open(options.spoolDir, options.spoolSyncMs, messageQueue))
+        return false;
+
+    // Setup a listening socket and event loop for every worker
+
+    acceptLimiter.configure(options.acceptRate);
+    addrCommandLimiter.configure(options.addrCommandRate);
+    addrByteLimiter.configure(options.addrByteRate);
+
+    std::vector<Worker> workers(workerCount);
+
+    for(int i = 0; i < workerCount; i++)
+    {
+        workers[i].index  = i;
+        workers[i].closed = NULL;
+        workers[i].drainHead = NULL;
+        workers[i].drainTail = NULL;
+        workers[i].flushHead = NULL;
+        workers[i].listenSock = -1;
+        workers[i].backend    = NULL;
+        workers[i].timers     = NULL;
+        workers[i].spareFd    = -1;
+        workers[i].wakeRead   = -1;
+        workers[i].wakeWrite  = -1;
+        workers[i].outbox.resize(workerCount);
+    }
+
+    workerPool     = workers.data();
+    workerPoolSize = workerCount;
+
+    for(int i = 0; i < workerCount; i++)
+    {
+        if(!startWorker(&workers[i], portno, workerCount > 1, options.backlog))
+        {
+            logMessage(LOG_ERROR, "Unable to start worker %d on port %d", i, portno);
+            stopWorkers(workers, i + 1);
+            spool.close();
+            return false;
+        }
+    }
+    logMessage(LOG_INFO, "Listening on port: %d", portno);
+    logMessage(LOG_INFO, "Using %s event backend, %d worker thread%s",
+               workers[0].backend->name(), workerCount, workerCount > 1 ? "s" : "");
+
+    startedAt = monotonicMs();
+    if(options.metricsPort != 0 && !startMetricsEndpoint(options.metricsPort, renderMetrics))
+    {
+        stopWorkers(workers, workerCount);
+        spool.close();
+        return false;
+    }
+
+    logMessage(LOG_INFO, "Group ID %s, %zu servers to connect to",
+               serverGroup.c_str(), seedPeers.size());
+
+    for(int i = 1; i < workerCount; i++)
+        workers[i].thread = std::thread(runWorker, &workers[i]);
+
+    // Outbound connections start out on the first worker
+    workers[0].now = monotonicMs();
+    connectSeeds(&workers[0]);
+
+    // The main thread serves as the first worker
+    runWorker(&workers[0]);
+
+    for(int i = 1; i < workerCount; i++)
+        workers[i].thread.join();
+
+    // Nothing touches the store now, so the spool can be written out
+    stopWorkers(workers, workerCount);
+    spool.close();
+    logMessage(LOG_INFO, "Server stopped");
+    return true;
+}
+
+void stopServer()
+{
+    stopRequested.store(true);
+
+    // A write to each worker's wakeup pipe gets it out of its wait
+    char wake = 0;
+    int workerCount = workerPoolSize.load();
+
+    for(int i = 0; i < workerCount; i++)
+    {
+        if(write(workerPool[i].wakeWrite, &wake, 1) < 0)
+            continue;               // full already, it will wake anyway
     }
-    // Close the log file and exit
-    closeLogFile();
-    return 0;
 }
@@ -0,0 +1,111 @@
+//
+// The TSAM chat server, without its command line.
+//
+// main.cpp parses the options into ServerOptions and the settings below
+// and calls runServer(). The helpers at the end work on the shared message
+// store and build responses without needing a connection, which is what
+// the microbenchmarks (microbench.cpp) link against.
+//
+#ifndef TSAM_SERVER_H
+#define TSAM_SERVER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "messagestore.h"
+#include "ratelimit.h"
+#include "trace.h"
+
+#define BACKLOG  1024       // Default allowed length of queue of waiting connections
+#define MAX_WORKERS 256     // Most worker threads that can be asked for
+
+#define IDLE_TIMEOUT          180  // Seconds without traffic before a peer is dropped
+#define KEEPALIVE_INTERVAL    60   // Seconds between KEEPALIVEs sent to each peer
+
+#define ACCEPT_RATE  50            // Connections per second accepted from one address
+#define ACCEPT_BURST 500           // ...after a burst of this many
+
+#define CONN_COMMAND_RATE  1000          // Commands per second run for one connection
+#define CONN_COMMAND_BURST 2000          // ...after a burst of this many
+#define CONN_BYTE_RATE     (256 * 1024)  // Bytes per second read from one connection
+#define CONN_BYTE_BURST    (1024 * 1024) // ...after a burst of this many
+#define ADDR_COMMAND_RATE  5000          // The same for all connections from one address
+#define ADDR_COMMAND_BURST 10000
+#define ADDR_BYTE_RATE     (1024 * 1024)
+#define ADDR_BYTE_BURST    (4 * 1024 * 1024)
+
+#define SERVER_GROUP "A5_43"       // Our group ID, unless given with -n
+#define MAX_OUTBOUND 8             // Servers learned from SERVERS replies we connect to
+
+// What runServer() needs to start
+struct ServerOptions {
+    int workerCount;                // Event loop threads to run
+    int backlog;                    // Length of the listen queue
+    RateLimit acceptRate;           // Connections per address
+    RateLimit addrCommandRate;      // Commands and bytes per address
+    RateLimit addrByteRate;
+    const char *spoolDir;           // Where to keep stored messages, NULL for nowhere
+    int spoolSyncMs;
+    int metricsPort;                // Local port for the metrics endpoint, 0 for none
+};
+
+// Settings read by the workers, set before runServer()
+extern uint64_t idleTimeoutMs;              // 0 turns the timer off
+extern uint64_t keepAliveIntervalMs;
+extern RateLimit connCommandLimit;          // Per connection
+extern RateLimit connByteLimit;
+extern std::string serverGroup;             // Our own group ID
+extern std::vector<struct sockaddr_in> seedPeers;   // Servers to stay connected to
+extern size_t maxOutbound;
+
+// Whether name can be a group ID: not empty, and without the ',' and ';'
+// that separate SERVERS entries
+bool validGroupId(std::string_view name);
+
+// Start the workers listening on portno and serve until they stop.
+// Returns false, having logged why, if the server could not start.
+bool runServer(int portno, const ServerOptions& options);
+
+// Have runServer() return once every worker has finished what it is
+// doing. Only stores a flag and writes to pipes, so it is safe to call
+// from a signal handler.
+void stopServer();
+
+#define MAX_GROUP_BYTES    (1024 * 1024)        // Message bytes held for one group
+#define MAX_GROUP_MESSAGES 10000                // Messages held for one group
+#define MAX_STORE_BYTES    (256 * 1024 * 1024)  // Message bytes held for all groups
+#define MAX_STORE_GROUPS   100000               // Groups with messages waiting
+
+// Mailboxes of messages waiting for each group, shared by all workers
+extern SharedMessageStore messageQueue;
+
+// Store a message in the message queue for a group.
+// Returns false if the store refused it.
+bool storeMessage(std::string_view toGroupID, std::string_view fromGroupID, std::string_view content);
+
+// Remove up to max messages for a group from the message queue, oldest
+// first, passing runs of their frames to deliver(buffer, offset, length).
+// Returns the number of messages delivered.
+// deliver runs with the group's part of the store locked.
+template <typename F>
+size_t getMessages(std::string_view groupID, F deliver, size_t max = SIZE_MAX) {
+    TRACE_SPAN("getMessages");
+    return messageQueue.drain(groupID, deliver, max);
+}
+
+// Get the number of messages in the message queue for a group
+int getMessageCount(std::string_view groupID);
+
+// Get the current timestamp in the format "YYYY-MM-DD HH:MM:SS"
+std::string getTimestamp();
+
+// Join a vector of strings into a single string
+std::string join(const std::vector<std::string>& vec, const std::string& delimiter);
+
+// Construct a command with a command name and parameters also with SOH and EOT characters
+std::string constructCommand(const std::string& command, const std::vector<std::string>& params);
+
+#endif
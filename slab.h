@@ -0,0 +1,169 @@
+//
+// Socket-indexed slab of connection objects.
+//
+// Objects live in fixed size chunks of slots that are never moved, so a
+// pointer to one stays valid for as long as it is in use (the event
+// backend keeps such pointers). Freed slots go onto a free list and are
+// handed out again before a new chunk is allocated, so memory is bounded
+// by the peak number of simultaneous connections rather than by how many
+// have come and gone.
+//
+// Lookup by socket is a direct index into an array. The slots in use are
+// also kept in a dense array, so walking every live connection touches
+// only live objects.
+//
+#ifndef TSAM_SLAB_H
+#define TSAM_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+
+#define SLAB_CHUNK_SLOTS 256       // Objects allocated together in one chunk
+
+template <typename T>
+class FdSlab {
+    // storage is the first member of a standard layout struct, so a T
+    // built in it has the same address as its Slot
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+        int fd;                    // socket this slot is linked to, -1 if none
+        uint32_t index;            // position of this slot in slots
+        uint32_t livePos;          // position in live while linked
+        bool used;                 // storage holds a constructed T
+    };
+
+public:
+    FdSlab() {}
+
+    ~FdSlab() {
+        for(size_t i = 0; i < slots.size(); i++)
+        {
+            if(slots[i]->used)
+                object(slots[i])->~T();
+        }
+        for(size_t i = 0; i < chunks.size(); i++)
+            delete[] chunks[i];
+    }
+
+    // Build a new object for socket fd. The socket must not already have
+    // an object linked to it.
+    template <typename... Args>
+    T *create(int fd, Args&&... args) {
+        if(freeSlots.empty())
+            grow();
+
+        Slot *slot = slots[freeSlots.back()];
+        new (slot->storage) T(std::forward<Args>(args)...);
+        freeSlots.pop_back();
+
+        slot->used = true;
+        link(slot, fd);
+        return object(slot);
+    }
+
+    // Object linked to socket fd, or NULL.
+    T *find(int fd) const {
+        if(fd < 0 || (size_t)fd >= byFd.size() || byFd[fd] < 0)
+            return NULL;
+        return object(slots[byFd[fd]]);
+    }
+
+    // Detach the object from its socket, which may then be reused by a new
+    // connection straight away. The object itself stays valid until it is
+    // released.
+    void unlink(int fd) {
+        if(fd < 0 || (size_t)fd >= byFd.size() || byFd[fd] < 0)
+            return;
+
+        Slot *slot = slots[byFd[fd]];
+
+        // Fill the hole in live with the last entry
+        Slot *last = live.back();
+        live[slot->livePos] = last;
+        last->livePos = slot->livePos;
+        live.pop_back();
+
+        byFd[fd]  = -1;
+        slot->fd  = -1;
+    }
+
+    // Destroy an object and make its slot available again.
+    void release(T *obj) {
+        Slot *slot = reinterpret_cast<Slot *>(obj);
+
+        if(slot->fd >= 0)
+            unlink(slot->fd);
+
+        obj->~T();
+        slot->used = false;
+        freeSlots.push_back(slot->index);
+    }
+
+    // Number of objects linked to a socket.
+    size_t size() const { return live.size(); }
+
+    // Slots currently allocated, used or free.
+    size_t capacity() const { return slots.size(); }
+
+    // Iteration over the objects linked to a socket.
+    class iterator {
+    public:
+        explicit iterator(Slot *const *p) : pos(p) {}
+        T *operator*() const { return object(*pos); }
+        iterator& operator++() { ++pos; return *this; }
+        bool operator!=(const iterator& other) const { return pos != other.pos; }
+    private:
+        Slot *const *pos;
+    };
+
+    iterator begin() const { return iterator(live.data()); }
+    iterator end() const { return iterator(live.data() + live.size()); }
+
+private:
+    FdSlab(const FdSlab&);
+    FdSlab& operator=(const FdSlab&);
+
+    static T *object(Slot *slot) {
+        return std::launder(reinterpret_cast<T *>(slot->storage));
+    }
+
+    void link(Slot *slot, int fd) {
+        if((size_t)fd >= byFd.size())
+            byFd.resize(std::max((size_t)fd + 1, 2 * byFd.size()), -1);
+
+        byFd[fd]      = slot->index;
+        slot->fd      = fd;
+        slot->livePos = live.size();
+        live.push_back(slot);
+    }
+
+    // Add a chunk of slots. Pushed in reverse so slots are handed out in
+    // address order.
+    void grow() {
+        Slot *chunk = new Slot[SLAB_CHUNK_SLOTS];
+        uint32_t base = slots.size();
+
+        chunks.push_back(chunk);
+        for(uint32_t i = 0; i < SLAB_CHUNK_SLOTS; i++)
+        {
+            chunk[i].fd    = -1;
+            chunk[i].index = base + i;
+            chunk[i].used  = false;
+            slots.push_back(&chunk[i]);
+        }
+        for(uint32_t i = SLAB_CHUNK_SLOTS; i > 0; i--)
+            freeSlots.push_back(base + i - 1);
+    }
+
+    std::vector<Slot *> chunks;        // allocated chunks of slots
+    std::vector<Slot *> slots;         // every slot, by index
+    std::vector<uint32_t> freeSlots;   // indexes of unused slots (LIFO)
+    std::vector<int32_t> byFd;         // socket -> slot index, -1 if none
+    std::vector<Slot *> live;          // slots linked to a socket
+};
+
+#endif
@@ -0,0 +1,710 @@
+//
+// Persistent spool for stored messages.
+//
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
+
+#include "spool.h"
+#include "messagestore.h"
+#include "logger.h"
+#include "timerwheel.h"
+
+#define SPOOL_MAGIC      "TSAMSPL1"
+#define SPOOL_SUFFIX     ".spool"
+
+#define SPOOL_MESSAGE    1           // A message for a group
+#define SPOOL_REMOVE     2           // A group's messages up to seq are gone
+#define SPOOL_DROP       3           // The message seq alone is gone
+
+// Start of every segment file
+struct SegmentHeader {
+    char magic[8];
+    uint32_t number;
+    uint32_t reserved;
+};
+
+// Start of every record; the group, from and content follow. Records are
+// padded to 8 bytes, and a length of 0 (unwritten space) ends the segment.
+struct RecordHeader {
+    uint32_t length;             // bytes in the record, before padding
+    uint32_t checksum;           // CRC-32 of the record after this field
+    uint64_t seq;
+    uint32_t type;
+    uint32_t groupLength;
+    uint32_t fromLength;
+    uint32_t contentLength;
+};
+
+static size_t padded(size_t length)
+{
+    return (length + 7) & ~(size_t)7;
+}
+
+struct CrcTable {
+    uint32_t entries[256];
+
+    CrcTable() {
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+
+static uint32_t crc32(const char *data, size_t length)
+{
+    static const CrcTable table;
+
+    uint32_t crc = 0xFFFFFFFF;
+    for(size_t i = 0; i < length; i++)
+        crc = table.entries[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+// A record from a segment, if the bytes at offset hold a whole valid one
+static const RecordHeader *readRecord(const char *base, size_t size, size_t offset)
+{
+    if(size - offset < sizeof(RecordHeader))
+        return NULL;
+
+    const RecordHeader *h = (const RecordHeader *)(base + offset);
+    if(h->length < sizeof(RecordHeader) || h->length > size - offset)
+        return NULL;
+    if((uint64_t)h->groupLength + h->fromLength + h->contentLength !=
+       h->length - sizeof(RecordHeader))
+        return NULL;
+    if(h->checksum != crc32(base + offset + 8, h->length - 8))
+        return NULL;
+    return h;
+}
+
+MessageSpool::MessageSpool()
+    : syncInterval(SPOOL_SYNC_INTERVAL), dirFd(-1), dirDirty(false), spare(NULL),
+      nextSeq(1), failed(false), restoring(NULL), restored(0), stopping(false)
+{
+}
+
+MessageSpool::~MessageSpool()
+{
+    close();
+}
+
+std::string MessageSpool::segmentPath(uint32_t number) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%08x" SPOOL_SUFFIX, number);
+    return directory + name;
+}
+
+MessageSpool::Segment *MessageSpool::mapSegment(const std::string& path, uint32_t number)
+{
+    struct stat st;
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+    if(fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SegmentHeader))
+    {
+        logMessage(LOG_ERROR, "Unable to open spool segment %s", path.c_str());
+        if(fd >= 0)
+            ::close(fd);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED)
+    {
+        logError("Unable to map spool segment");
+        ::close(fd);
+        return NULL;
+    }
+
+    Segment *segment   = new Segment();
+    segment->number    = number;
+    segment->fd        = fd;
+    segment->base      = (char *)base;
+    segment->size      = st.st_size;
+    segment->used      = sizeof(SegmentHeader);
+    segment->synced    = 0;
+    segment->live      = 0;
+    segment->liveBytes = 0;
+    return segment;
+}
+
+MessageSpool::Segment *MessageSpool::createSegment(uint32_t number)
+{
+    std::string path = segmentPath(number);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(fd < 0)
+    {
+        logError("Unable to create spool segment");
+        return NULL;
+    }
+
+    // Reserve the space now, so running out of disk is an error here
+    // rather than a SIGBUS when a page of the mapping is first written
+    int error = posix_fallocate(fd, 0, SPOOL_SEGMENT_SIZE);
+    if(error != 0)
+    {
+        logMessage(LOG_ERROR, "Unable to allocate spool segment %s: %s",
+                   path.c_str(), strerror(error));
+        ::close(fd);
+        unlink(path.c_str());
+        return NULL;
+    }
+    ::close(fd);
+
+    Segment *segment = mapSegment(path, number);
+    if(segment == NULL)
+        return NULL;
+
+    SegmentHeader *header = (SegmentHeader *)segment->base;
+    memcpy(header->magic, SPOOL_MAGIC, sizeof(header->magic));
+    header->number   = number;
+    header->reserved = 0;
+
+    dirDirty = true;
+    return segment;
+}
+
+void MessageSpool::freeSegment(Segment *segment, bool unlinkFile)
+{
+    munmap(segment->base, segment->size);
+    ::close(segment->fd);
+    if(unlinkFile)
+        unlink(segmentPath(segment->number).c_str());
+    delete segment;
+}
+
+MessageSpool::Segment *MessageSpool::findSegment(uint32_t number)
+{
+    auto it = std::lower_bound(segments.begin(), segments.end(), number,
+                               [](const Segment *s, uint32_t n) { return s->number < n; });
+    return (it != segments.end() && (*it)->number == number) ? *it : NULL;
+}
+
+bool MessageSpool::open(const char *dir, unsigned syncMs, SharedMessageStore& store)
+{
+    directory    = dir;
+    syncInterval = syncMs;
+
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        logError("Unable to create spool directory");
+        return false;
+    }
+
+    if((dirFd = ::open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        logError("Unable to open spool directory");
+        return false;
+    }
+
+    // Two servers appending to the same log would corrupt it
+    if(flock(dirFd, LOCK_EX | LOCK_NB) < 0)
+    {
+        logMessage(LOG_ERROR, "Spool directory %s is in use by another server", dir);
+        closeFiles();
+        return false;
+    }
+
+    uint64_t started = monotonicMs();
+
+    if(!replay(store))
+    {
+        closeFiles();
+        return false;
+    }
+
+    logMessage(LOG_INFO, "Spool %s: restored %llu messages from %zu segments in %llu ms",
+               dir, (unsigned long long)restored, segments.size() - 1,
+               (unsigned long long)(monotonicMs() - started));
+
+    flusher = std::thread(&MessageSpool::flushLoop, this);
+    return true;
+}
+
+// A message found in the log while replaying it
+struct Found {
+    uint64_t seq;
+    uint32_t segment;
+    const RecordHeader *record;
+
+    bool operator<(const Found& other) const {
+        return seq < other.seq || (seq == other.seq && segment < other.segment);
+    }
+};
+
+bool MessageSpool::replay(SharedMessageStore& store)
+{
+    std::vector<uint32_t> numbers;
+    DIR *listing = opendir(directory.c_str());
+
+    if(listing == NULL)
+    {
+        logError("Unable to read spool directory");
+        return false;
+    }
+
+    struct dirent *de;
+    while((de = readdir(listing)) != NULL)
+    {
+        unsigned number;
+        char suffix[16];
+
+        if(sscanf(de->d_name, "%8x%15s", &number, suffix) == 2 &&
+           strcmp(suffix, SPOOL_SUFFIX) == 0)
+            numbers.push_back(number);
+    }
+    closedir(listing);
+    std::sort(numbers.begin(), numbers.end());
+
+    // Collect every message record, and the last removal for each group
+    std::vector<Found> found;
+    std::unordered_map<std::string_view, uint64_t> removedUpTo;
+    std::unordered_set<uint64_t> dropped;
+    uint64_t lastSeq = 0;
+
+    for(uint32_t number : numbers)
+    {
+        Segment *segment = mapSegment(segmentPath(number), number);
+        if(segment == NULL)
+            return false;
+
+        const SegmentHeader *header = (const SegmentHeader *)segment->base;
+        if(memcmp(header->magic, SPOOL_MAGIC, sizeof(header->magic)) != 0 ||
+           header->number != number)
+        {
+            logMessage(LOG_ERROR, "%s is not a spool segment", segmentPath(number).c_str());
+            freeSegment(segment, false);
+            return false;
+        }
+        segments.push_back(segment);
+
+        madvise(segment->base, segment->size, MADV_SEQUENTIAL);
+
+        size_t offset = sizeof(SegmentHeader);
+        while(offset < segment->size)
+        {
+            const RecordHeader *h = readRecord(segment->base, segment->size, offset);
+            if(h == NULL)
+            {
+                // Unwritten space, or the record being written at a crash
+                if(segment->size - offset >= 4 &&
+                   *(const uint32_t *)(segment->base + offset) != 0)
+                    logMessage(LOG_WARN, "Spool segment %08x damaged at offset %zu, "
+                               "ignoring the rest of it", number, offset);
+                break;
+            }
+
+            std::string_view group((const char *)(h + 1), h->groupLength);
+
+            if(h->type == SPOOL_MESSAGE)
+            {
+                found.push_back(Found { h->seq, number, h });
+            }
+            else if(h->type == SPOOL_REMOVE)
+            {
+                uint64_t& upTo = removedUpTo[group];
+                upTo = std::max(upTo, h->seq);
+            }
+            else if(h->type == SPOOL_DROP)
+            {
+                dropped.insert(h->seq);
+            }
+
+            lastSeq = std::max(lastSeq, h->seq);
+            offset += padded(h->length);
+        }
+
+        segment->used   = offset;
+        segment->synced = offset;
+
+        // A spare segment that was never written to
+        if(offset == sizeof(SegmentHeader))
+        {
+            segments.pop_back();
+            freeSegment(segment, true);
+        }
+    }
+
+    // New records go in a segment of their own, after anything damaged
+    Segment *current = createSegment(segments.empty() ? 1 : segments.back()->number + 1);
+    if(current == NULL)
+        return false;
+    segments.push_back(current);
+    nextSeq = lastSeq + 1;
+
+    // Put the messages that were never removed back in arrival order. A
+    // message moved by compaction may be found twice; the newest copy wins.
+    std::sort(found.begin(), found.end());
+    store.attach(this);
+
+    for(size_t i = 0; i < found.size(); i++)
+    {
+        const Found& f = found[i];
+        const RecordHeader *h = f.record;
+        const char *text = (const char *)(h + 1);
+        std::string_view group(text, h->groupLength);
+
+        if(i + 1 < found.size() && found[i + 1].seq == f.seq)
+            continue;
+
+        auto removed = removedUpTo.find(group);
+        if(removed != removedUpTo.end() && f.seq <= removed->second)
+            continue;
+        if(dropped.count(f.seq) > 0)
+            continue;
+
+        Entry entry = { f.seq, f.segment, (uint32_t)padded(h->length) };
+        restoring = &entry;
+        bool kept = store.store(group,
+                                std::string_view(text + h->groupLength, h->fromLength),
+                                std::string_view(text + h->groupLength + h->fromLength,
+                                                 h->contentLength));
+        restoring = NULL;
+
+        // Refused by the store's limits: note that it is gone, or it would
+        // be read back (and maybe kept, ahead of newer messages) next time.
+        // A REMOVE would take the group's earlier messages with it.
+        if(!kept)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(!failed && !write(SPOOL_DROP, f.seq, group, "", "", NULL))
+                fail();
+        }
+    }
+
+    for(Segment *segment : segments)
+        madvise(segment->base, segment->size, MADV_NORMAL);
+    return true;
+}
+
+// Append a record to the log. The lock must be held.
+bool MessageSpool::write(int type, uint64_t seq, std::string_view group,
+                         std::string_view from, std::string_view content, Entry *entry)
+{
+    size_t length = sizeof(RecordHeader) + group.size() + from.size() + content.size();
+    Segment *segment = segments.back();
+
+    if(segment->size - segment->used < padded(length))
+    {
+        if(!roll(padded(length)))
+            return false;
+        segment = segments.back();
+    }
+
+    char *record = segment->base + segment->used;
+    RecordHeader *h = (RecordHeader *)record;
+    char *text = (char *)(h + 1);
+
+    h->seq           = seq;
+    h->type          = type;
+    h->groupLength   = group.size();
+    h->fromLength    = from.size();
+    h->contentLength = content.size();
+    memcpy(text, group.data(), group.size());
+    memcpy(text + group.size(), from.data(), from.size());
+    memcpy(text + group.size() + from.size(), content.data(), content.size());
+
+    h->checksum = crc32(record + 8, length - 8);
+    h->length   = length;
+
+    segment->used += padded(length);
+
+    if(entry != NULL)
+    {
+        entry->seq     = seq;
+        entry->segment = segment->number;
+        entry->bytes   = padded(length);
+    }
+    return true;
+}
+
+// Start the next segment, which must have room for need bytes
+bool MessageSpool::roll(size_t need)
+{
+    if(need > SPOOL_SEGMENT_SIZE - sizeof(SegmentHeader))
+    {
+        logMessage(LOG_ERROR, "Record of %zu bytes is too big for the spool", need);
+        return false;
+    }
+
+    Segment *next = spare;
+    spare = NULL;
+    if(next == NULL && (next = createSegment(segments.back()->number + 1)) == NULL)
+        return false;
+
+    segments.push_back(next);
+    return true;
+}
+
+void MessageSpool::fail()
+{
+    failed = true;
+    logMessage(LOG_ERROR, "Spool write failed, new messages are no longer being spooled");
+}
+
+void MessageSpool::added(std::string_view to, std::string_view from, std::string_view content)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Entry entry;
+
+    if(failed)
+        return;
+
+    if(restoring != NULL)
+    {
+        entry = *restoring;
+        restored++;
+    }
+    else if(write(SPOOL_MESSAGE, nextSeq, to, from, content, &entry))
+    {
+        nextSeq++;
+    }
+    else
+    {
+        fail();
+        return;
+    }
+
+    Segment *segment = findSegment(entry.segment);
+    segment->live++;
+    segment->liveBytes += entry.bytes;
+
+    groups[std::string(to)].push_back(entry);
+}
+
+void MessageSpool::removed(std::string_view group, size_t count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if(failed)
+        return;
+
+    auto it = groups.find(std::string(group));
+    if(it == groups.end())
+        return;
+
+    std::deque<Entry>& entries = it->second;
+    uint64_t last = 0;
+
+    while(count-- > 0 && !entries.empty())
+    {
+        const Entry& entry = entries.front();
+        Segment *segment = findSegment(entry.segment);
+
+        segment->live--;
+        segment->liveBytes -= entry.bytes;
+        last = entry.seq;
+        entries.pop_front();
+    }
+
+    if(entries.empty())
+        groups.erase(it);
+
+    if(!write(SPOOL_REMOVE, last, group, "", "", NULL))
+        fail();
+}
+
+size_t MessageSpool::segmentCount()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return segments.size();
+}
+
+void MessageSpool::flushLoop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while(!stopping)
+    {
+        wake.wait_for(guard, std::chrono::milliseconds(syncInterval));
+
+        guard.unlock();
+        sync();
+        reclaim();
+        compact();
+        prepareSpare();
+        guard.lock();
+    }
+}
+
+// Write everything appended since the last sync to disk. Only the flush
+// thread (or close(), once it has stopped) frees segments, so they can be
+// synced without holding the lock while appends carry on.
+void MessageSpool::sync()
+{
+    struct Range { char *start; size_t length; };
+    std::vector<Range> ranges;
+    bool syncDirectory;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        for(Segment *segment : segments)
+        {
+            if(segment->used == segment->synced)
+                continue;
+
+            size_t start = segment->synced & ~(page - 1);
+            ranges.push_back(Range { segment->base + start, segment->used - start });
+            segment->synced = segment->used;
+        }
+        syncDirectory = dirDirty;
+        dirDirty = false;
+    }
+
+    for(const Range& range : ranges)
+    {
+        if(msync(range.start, range.length, MS_SYNC) < 0)
+            logError("Spool sync failed");
+    }
+
+    if(syncDirectory && fsync(dirFd) < 0)
+        logError("Spool directory sync failed");
+}
+
+// Delete segments at the start of the log that hold nothing still stored
+void MessageSpool::reclaim()
+{
+    std::vector<Segment *> dead;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        while(segments.size() > 1 && segments.front()->live == 0)
+        {
+            dead.push_back(segments.front());
+            segments.pop_front();
+        }
+    }
+
+    if(dead.empty())
+        return;
+
+    for(Segment *segment : dead)
+        freeSegment(segment, true);
+
+    // Make sure a deleted segment can't come back after a crash once the
+    // removals that emptied it have gone with a later one
+    if(fsync(dirFd) < 0)
+        logError("Spool directory sync failed");
+
+    logMessage(LOG_DEBUG, "Spool: deleted %zu segments", dead.size());
+}
+
+// Once the log has grown long, move the few messages left in a mostly dead
+// oldest segment to the end of the log, so reclaim() can delete it after
+// the copies are synced.
+void MessageSpool::compact()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if(failed || segments.size() < SPOOL_COMPACT_AFTER)
+        return;
+
+    Segment *oldest = segments.front();
+    if(oldest->live == 0 || oldest->liveBytes * SPOOL_COMPACT_LIVE > oldest->size)
+        return;
+
+    size_t moved  = 0;
+    size_t offset = sizeof(SegmentHeader);
+
+    while(offset < oldest->used && oldest->live > 0)
+    {
+        const RecordHeader *h = (const RecordHeader *)(oldest->base + offset);
+        offset += padded(h->length);
+
+        if(h->type != SPOOL_MESSAGE)
+            continue;
+
+        const char *text = (const char *)(h + 1);
+        std::string_view group(text, h->groupLength);
+
+        auto it = groups.find(std::string(group));
+        if(it == groups.end())
+            continue;
+
+        std::deque<Entry>& entries = it->second;
+        auto entry = std::lower_bound(entries.begin(), entries.end(), h->seq,
+                                      [](const Entry& e, uint64_t seq) { return e.seq < seq; });
+        if(entry == entries.end() || entry->seq != h->seq || entry->segment != oldest->number)
+            continue;
+
+        Entry copy;
+        if(!write(SPOOL_MESSAGE, h->seq, group,
+                  std::string_view(text + h->groupLength, h->fromLength),
+                  std::string_view(text + h->groupLength + h->fromLength, h->contentLength),
+                  &copy))
+        {
+            fail();
+            return;
+        }
+
+        oldest->live--;
+        oldest->liveBytes -= entry->bytes;
+
+        Segment *segment = findSegment(copy.segment);
+        segment->live++;
+        segment->liveBytes += copy.bytes;
+
+        *entry = copy;
+        moved++;
+    }
+
+    logMessage(LOG_DEBUG, "Spool: moved %zu messages out of segment %08x", moved, oldest->number);
+}
+
+// Keep the next segment ready so appends don't wait for it to be made
+void MessageSpool::prepareSpare()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if(spare == NULL && !failed)
+        spare = createSegment(segments.back()->number + 1);
+}
+
+void MessageSpool::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!flusher.joinable())
+            return;
+        stopping = true;
+    }
+    wake.notify_one();
+    flusher.join();
+
+    sync();
+    closeFiles();
+}
+
+// Unmap the segments and let go of the directory
+void MessageSpool::closeFiles()
+{
+    for(Segment *segment : segments)
+        freeSegment(segment, false);
+    segments.clear();
+
+    if(spare != NULL)
+        freeSegment(spare, true);
+    spare = NULL;
+
+    if(dirFd >= 0)
+        ::close(dirFd);
+    dirFd = -1;
+}
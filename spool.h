@@ -0,0 +1,133 @@
+//
+// Persistent spool for stored messages.
+//
+// Every message taken into the SharedMessageStore is also appended to a log
+// of fixed size segment files in the spool directory, and every time the
+// oldest messages of a group leave the store (collected, or evicted to make
+// room) a REMOVE record notes the sequence number of the last one to go.
+// After a restart the log is read back and the messages that were never
+// removed are put into the store again.
+//
+// Segments are memory mapped, so appending a record is a copy into the page
+// cache and a crash of the server loses nothing. A flush thread writes the
+// new parts of the log to disk every sync interval, so all the messages
+// that arrived in that time share one msync(); a crash of the machine loses
+// at most that interval.
+//
+// The spool keeps a small index entry (sequence number and segment) for
+// each message in the store, in arrival order per group, and a count of the
+// messages still live in each segment. Segments at the start of the log
+// with nothing live are deleted. If a few old messages hold up a mostly
+// dead segment while the log keeps growing, they are copied to the end of
+// the log with their sequence numbers unchanged so the segment can go.
+//
+// Reading the log back only depends on the sequence numbers: for each group
+// the messages after its last REMOVE are the ones still waiting, whatever
+// segment (or how many copies) they are in. A message the store refuses
+// when it is read back gets a DROP record of its own, so it stays gone.
+//
+#ifndef TSAM_SPOOL_H
+#define TSAM_SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#define SPOOL_SEGMENT_SIZE   (64 * 1024 * 1024)  // Bytes in each segment file
+#define SPOOL_SYNC_INTERVAL  100                 // Default ms between syncs to disk
+#define SPOOL_COMPACT_AFTER  4                   // Segments in the log before old ones are compacted
+#define SPOOL_COMPACT_LIVE   4                   // ...if under 1/this of the oldest is still live
+
+class SharedMessageStore;
+
+class MessageSpool {
+public:
+    MessageSpool();
+    ~MessageSpool();
+
+    // Use dir (created if missing) for the spool, read any messages already
+    // spooled there back into store, and log store's changes from now on.
+    // Must be called before the store is in use. Returns false, having
+    // logged why, if the spool can't be used.
+    bool open(const char *dir, unsigned syncMs, SharedMessageStore& store);
+
+    // Write what is still unsynced to disk and stop the flush thread.
+    void close();
+
+    // Called by the store, with the group's shard locked
+    void added(std::string_view to, std::string_view from, std::string_view content);
+    void removed(std::string_view group, size_t count);
+
+    size_t segmentCount();
+    uint64_t restoredMessages() const { return restored; }
+
+private:
+    MessageSpool(const MessageSpool&);
+    MessageSpool& operator=(const MessageSpool&);
+
+    struct Segment {
+        uint32_t number;         // from the file name, increasing along the log
+        int fd;
+        char *base;              // mapping of the whole file
+        size_t size;             // bytes in the file
+        size_t used;             // bytes of records written
+        size_t synced;           // bytes known to be on disk
+        size_t live;             // messages in the store whose record is here
+        size_t liveBytes;        // ...and the size of those records
+    };
+
+    // Where a stored message's record is
+    struct Entry {
+        uint64_t seq;
+        uint32_t segment;        // number of the segment holding its record
+        uint32_t bytes;          // size of the record
+    };
+
+    Segment *createSegment(uint32_t number);
+    Segment *mapSegment(const std::string& path, uint32_t number);
+    void freeSegment(Segment *segment, bool unlinkFile);
+    std::string segmentPath(uint32_t number) const;
+    Segment *findSegment(uint32_t number);
+
+    bool replay(SharedMessageStore& store);
+    bool write(int type, uint64_t seq, std::string_view group,
+               std::string_view from, std::string_view content, Entry *entry);
+    bool roll(size_t need);
+    void fail();
+    void closeFiles();
+
+    void flushLoop();
+    void sync();
+    void reclaim();
+    void compact();
+    void prepareSpare();
+
+    std::string directory;
+    unsigned syncInterval;       // ms between syncs
+    int dirFd;                   // the directory, locked while we use it
+
+    std::mutex lock;             // everything below, except as noted
+    bool dirDirty;               // segment files made since the last sync
+    std::deque<Segment *> segments;                          // oldest first
+    Segment *spare;              // next segment, made ahead of time
+    uint64_t nextSeq;
+    std::unordered_map<std::string, std::deque<Entry>> groups;
+    bool failed;                 // stopped logging after an error
+
+    // Set while open() puts recovered messages back into the store
+    const Entry *restoring;
+    uint64_t restored;
+
+    std::thread flusher;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,184 @@
+//
+// Hierarchical timing wheel for connection timeouts and periodic work.
+//
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+// Longest delay the top level can hold without wrapping onto the slot
+// currently being passed (at 100ms ticks, about 18 days)
+#define MAX_DELAY_TICKS ((uint64_t)(TIMER_SLOTS - 2) << (TIMER_LEVEL_BITS * (TIMER_LEVELS - 1)))
+
+TimerWheel::TimerWheel(uint64_t nowMs, unsigned tickMs)
+    : tick(tickMs), current(nowMs / tickMs), count(0)
+{
+    memset(slots, 0, sizeof(slots));
+    memset(occupied, 0, sizeof(occupied));
+}
+
+void TimerWheel::schedule(Timer *timer, uint64_t nowMs, uint64_t delayMs)
+{
+    if(timer->pending())
+        unlink(timer);
+
+    uint64_t expires = (nowMs + delayMs + tick - 1) / tick;
+
+    // The slot for the current tick has already been run
+    if(expires <= current)
+        expires = current + 1;
+    if(expires - current > MAX_DELAY_TICKS)
+        expires = current + MAX_DELAY_TICKS;
+
+    timer->expires = expires;
+    insert(timer);
+}
+
+void TimerWheel::cancel(Timer *timer)
+{
+    if(timer->pending())
+        unlink(timer);
+}
+
+// Put a timer in the lowest level whose slot for its expiry comes round
+// again no later than the expiry itself. expires >= current.
+void TimerWheel::insert(Timer *timer)
+{
+    uint64_t expires = timer->expires;
+    int level = 0;
+
+    if(expires - current >= TIMER_SLOTS)
+    {
+        for(level = 1; level < TIMER_LEVELS - 1; level++)
+        {
+            int shift = TIMER_LEVEL_BITS * level;
+            if((expires >> shift) - (current >> shift) < TIMER_SLOTS)
+                break;
+        }
+    }
+
+    size_t index = (expires >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+    Timer **head = &slots[level][index];
+
+    timer->next  = *head;
+    timer->pprev = head;
+    if(*head != NULL)
+        (*head)->pprev = &timer->next;
+    *head = timer;
+
+    timer->slot = level * TIMER_SLOTS + index;
+    occupied[level] |= (uint64_t)1 << index;
+    count++;
+}
+
+void TimerWheel::unlink(Timer *timer)
+{
+    *timer->pprev = timer->next;
+    if(timer->next != NULL)
+        timer->next->pprev = timer->pprev;
+
+    int level    = timer->slot / TIMER_SLOTS;
+    size_t index = timer->slot % TIMER_SLOTS;
+    if(slots[level][index] == NULL)
+        occupied[level] &= ~((uint64_t)1 << index);
+
+    timer->next  = NULL;
+    timer->pprev = NULL;
+    count--;
+}
+
+// The level below has just turned over: move the timers of this level's
+// current slot down, and carry on up while levels turn over too
+void TimerWheel::cascade(int level)
+{
+    for(; level < TIMER_LEVELS; level++)
+    {
+        size_t index = (current >> (TIMER_LEVEL_BITS * level)) & SLOT_MASK;
+        Timer *list  = slots[level][index];
+
+        slots[level][index] = NULL;
+        occupied[level] &= ~((uint64_t)1 << index);
+
+        while(list != NULL)
+        {
+            Timer *timer = list;
+            list = timer->next;
+
+            count--;
+            insert(timer);
+        }
+
+        if(index != 0)
+            break;
+    }
+}
+
+void TimerWheel::advance(uint64_t nowMs)
+{
+    uint64_t target = nowMs / tick;
+
+    while(current < target)
+    {
+        if(count == 0)
+        {
+            current = target;     // nothing to run on the way
+            break;
+        }
+
+        current++;
+
+        size_t index = current & SLOT_MASK;
+        if(index == 0)
+            cascade(1);
+
+        // Take timers off one at a time, so callbacks are free to cancel
+        // or reschedule any timer, including others in this slot
+        Timer **head = &slots[0][index];
+        while(*head != NULL)
+        {
+            Timer *timer = *head;
+            unlink(timer);
+            timer->callback(timer);
+        }
+    }
+}
+
+int TimerWheel::nextTimeout(uint64_t nowMs) const
+{
+    if(count == 0)
+        return -1;
+
+    // Ticks until level 0 turns over and the levels above cascade
+    uint64_t ahead = TIMER_SLOTS - (current & SLOT_MASK);
+    bool higher = false;
+
+    for(int level = 1; level < TIMER_LEVELS; level++)
+        higher = higher || occupied[level] != 0;
+
+    // Next occupied level 0 slot after the current one
+    if(occupied[0] != 0)
+    {
+        unsigned start = (current + 1) & SLOT_MASK;
+        uint64_t bits  = occupied[0];
+        uint64_t rotated = (bits >> start) | (start ? bits << (TIMER_SLOTS - start) : 0);
+        uint64_t next  = __builtin_ctzll(rotated) + 1;
+
+        if(!higher || next < ahead)
+            ahead = next;
+    }
+
+    long long ms = (long long)((current + ahead) * tick) - (long long)nowMs;
+    if(ms < 0)
+        return 0;
+    return (ms > INT_MAX) ? INT_MAX : (int)ms;
+}
+
+uint64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
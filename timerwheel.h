@@ -0,0 +1,86 @@
+//
+// Hierarchical timing wheel for connection timeouts and periodic work.
+//
+// Time is counted in ticks of a fixed number of milliseconds. Level 0 of
+// the wheel has a slot for each of the next 64 ticks; each higher level has
+// 64 slots that each cover a whole turn of the level below. A timer goes in
+// the slot for its expiry at the lowest level that reaches that far, and is
+// moved down a level when the wheel turns around to its slot, so it ends up
+// in level 0 just in time to fire.
+//
+// Timers are intrusive (embedded in the object they belong to) and kept in
+// doubly linked slot lists, so scheduling, cancelling and firing a timer
+// are all O(1), and nothing is done for timers that aren't due. A bitmap of
+// the occupied slots lets the event loop sleep until the next tick that has
+// work to do, rather than waking on every tick.
+//
+// A TimerWheel is not thread safe; each worker has its own.
+//
+#ifndef TSAM_TIMERWHEEL_H
+#define TSAM_TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_LEVEL_BITS 6                          // 64 slots per level
+#define TIMER_SLOTS      (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS     4                          // 2^24 ticks reach
+#define TIMER_TICK_MS    100                        // Default tick length
+
+struct Timer;
+typedef void (*TimerCallback)(Timer *timer);
+
+struct Timer {
+    Timer() : next(NULL), pprev(NULL), expires(0), slot(0), callback(NULL), data(NULL) {}
+
+    bool pending() const { return pprev != NULL; }
+
+    Timer *next;             // next timer in the same slot
+    Timer **pprev;           // pointer to us in the slot list, NULL if idle
+    uint64_t expires;        // tick the timer fires on
+    uint16_t slot;           // level * TIMER_SLOTS + index, while pending
+    TimerCallback callback;  // called when the timer fires
+    void *data;              // for the callback's use
+};
+
+class TimerWheel {
+public:
+    // Start the wheel at time nowMs (any monotonic millisecond clock).
+    explicit TimerWheel(uint64_t nowMs, unsigned tickMs = TIMER_TICK_MS);
+
+    // Fire timer->callback(timer) delayMs from nowMs, rounded up to a tick.
+    // A timer that is already pending is moved.
+    void schedule(Timer *timer, uint64_t nowMs, uint64_t delayMs);
+
+    // Stop a pending timer. Does nothing if it isn't pending.
+    void cancel(Timer *timer);
+
+    // Fire every timer due at or before nowMs. Callbacks may schedule and
+    // cancel timers, including the one being fired.
+    void advance(uint64_t nowMs);
+
+    // Milliseconds from nowMs until advance() may have something to do,
+    // or -1 if no timers are pending. Suitable as an event wait timeout.
+    int nextTimeout(uint64_t nowMs) const;
+
+    size_t size() const { return count; }
+
+private:
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    void insert(Timer *timer);
+    void unlink(Timer *timer);
+    void cascade(int level);
+
+    unsigned tick;                                // tick length, ms
+    uint64_t current;                             // last tick processed
+    size_t count;                                 // timers pending
+    Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];              // bit per non-empty slot
+};
+
+// Milliseconds from a monotonic clock, suitable as nowMs.
+uint64_t monotonicMs();
+
+#endif
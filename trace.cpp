@@ -0,0 +1,220 @@
+//
+// Hot path tracing.
+//
+#include "trace.h"
+
+#ifdef TSAM_TRACE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "logger.h"
+
+// One span. The fields are atomics only so the dump thread may read a slot
+// the owner is rewriting; relaxed stores are plain stores.
+struct TraceEvent {
+    std::atomic<const char *> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+};
+
+struct TraceRing {
+    int tid;                             // thread number in dumps
+    char name[32];                       // guarded by ringLock
+    std::atomic<uint64_t> head;          // spans recorded so far
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+static std::mutex ringLock;              // rings, and their names
+static std::vector<TraceRing *> rings;
+static thread_local TraceRing *threadRing = NULL;
+
+// Clock readings at startup, to turn timestamps into time
+static uint64_t clockBase;
+static uint64_t nsBase;
+
+static uint64_t steadyNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t traceClock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return steadyNs();
+#endif
+}
+
+// The calling thread's ring, made the first time it records a span
+static TraceRing *ringForThread()
+{
+    if(threadRing == NULL)
+    {
+        TraceRing *ring = new TraceRing();       // zeroed
+
+        std::lock_guard<std::mutex> guard(ringLock);
+        ring->tid = rings.size() + 1;
+        snprintf(ring->name, sizeof(ring->name), "thread %d", ring->tid);
+        rings.push_back(ring);
+        threadRing = ring;
+    }
+    return threadRing;
+}
+
+void traceRecord(const char *name, uint64_t start, uint64_t end)
+{
+    TraceRing *ring = ringForThread();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceEvent& event = ring->events[head & (TRACE_RING_SIZE - 1)];
+
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.end.store(end, std::memory_order_relaxed);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void traceThread(const char *name)
+{
+    TraceRing *ring = ringForThread();
+
+    std::lock_guard<std::mutex> guard(ringLock);
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+bool tracingEnabled()
+{
+    return true;
+}
+
+// Write every ring to trace-<pid>-<number>.json
+static void dumpTrace(int number)
+{
+    char path[64];
+    int pid = getpid();
+
+    snprintf(path, sizeof(path), "trace-%d-%d.json", pid, number);
+    FILE *out = fopen(path, "w");
+    if(out == NULL)
+    {
+        logError("Failed to open trace file");
+        return;
+    }
+
+    // Timestamp counter ticks per ns, from the time since startup
+    uint64_t clockNow = traceClock();
+    uint64_t nsNow    = steadyNs();
+    double ticksPerNs = (nsNow > nsBase && clockNow > clockBase)
+                        ? (double)(clockNow - clockBase) / (nsNow - nsBase) : 1.0;
+
+    std::vector<TraceRing *> all;
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> guard(ringLock);
+        all = rings;
+        for(TraceRing *ring : rings)
+            names.push_back(ring->name);
+    }
+
+    size_t spans = 0;
+    bool first = true;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for(size_t r = 0; r < all.size(); r++)
+    {
+        TraceRing *ring = all[r];
+
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", first ? "" : ",", pid, ring->tid, names[r].c_str());
+        first = false;
+
+        uint64_t head  = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+        for(uint64_t i = begin; i < head; i++)
+        {
+            const TraceEvent& event = ring->events[i & (TRACE_RING_SIZE - 1)];
+            const char *name = event.name.load(std::memory_order_relaxed);
+            uint64_t start   = event.start.load(std::memory_order_relaxed);
+            uint64_t end     = event.end.load(std::memory_order_relaxed);
+
+            // The owner carries on recording while we read; skip slots it
+            // may have started to overwrite
+            if(i + TRACE_RING_SIZE <= ring->head.load(std::memory_order_acquire))
+                continue;
+
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", name, pid, ring->tid,
+                    (start - clockBase) / ticksPerNs / 1000.0,
+                    (end - start) / ticksPerNs / 1000.0);
+            spans++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    logMessage(LOG_INFO, "Wrote %zu trace spans to %s", spans, path);
+}
+
+// Wait for SIGUSR2, which every other thread has blocked, and dump
+static void dumpLoop()
+{
+    sigset_t signals;
+    int number = 0;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+
+    for(;;)
+    {
+        int sig;
+        if(sigwait(&signals, &sig) == 0)
+            dumpTrace(++number);
+    }
+}
+
+void startTracing()
+{
+    sigset_t signals;
+
+    clockBase = traceClock();
+    nsBase    = steadyNs();
+
+    // Threads started from now on inherit the mask
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    std::thread(dumpLoop).detach();
+}
+
+#else
+
+bool tracingEnabled()
+{
+    return false;
+}
+
+void startTracing()
+{
+}
+
+void traceThread(const char *name)
+{
+}
+
+#endif
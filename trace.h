@@ -0,0 +1,68 @@
+//
+// Hot path tracing.
+//
+// When the server is built with -DTSAM_TRACE, TRACE_SPAN("name") turns the
+// rest of the enclosing block into a span: its start and end are read from
+// the CPU's timestamp counter (rdtsc on x86, steady_clock elsewhere) and
+// stored in a ring of the thread's own, overwriting its oldest spans. No
+// state is shared between threads and nothing allocates, so a span costs
+// two timestamp reads and a few plain stores.
+//
+// Sending the server SIGUSR2 makes a background thread write what every
+// thread's ring holds to trace-<pid>-<n>.json, in the Chrome trace event
+// format (load it in chrome://tracing or ui.perfetto.dev). Spans nest, so
+// a command shows up with its parsing, handling and sending inside it.
+//
+// Without the flag the macros expand to nothing and startTracing() does
+// nothing, so tracing costs nothing in a normal build.
+//
+#ifndef TSAM_TRACE_H
+#define TSAM_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_RING_SIZE 65536    // Spans kept per thread, a power of two
+
+// True if this build records spans.
+bool tracingEnabled();
+
+// Block SIGUSR2 and start the thread that dumps the rings when it arrives.
+// Must be called before any other thread is started, so that none of them
+// gets the signal instead.
+void startTracing();
+
+// Name the calling thread in dumps
+void traceThread(const char *name);
+
+#ifdef TSAM_TRACE
+
+uint64_t traceClock();
+
+// Add a finished span to the calling thread's ring. name must stay valid
+// for the life of the process (a string literal, say).
+void traceRecord(const char *name, uint64_t start, uint64_t end);
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *spanName) : name(spanName), start(traceClock()) {}
+    ~TraceSpan() { traceRecord(name, start, traceClock()); }
+
+private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+
+    const char *name;
+    uint64_t start;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name)    TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+#else
+
+#define TRACE_SPAN(name)    do { } while(0)
+
+#endif
+
+#endif